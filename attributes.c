@@ -1,7 +1,10 @@
 #include "attributes.h"
 #include <linux/module.h>
+#include <linux/math64.h>
+#include <linux/cpumask.h>
 #include "sdbp.h"
 #include "descriptor.h"
+#include "sdbp_uapi.h"
 #include "debug.h"
 
 int validate(struct device *dev)
@@ -35,55 +38,46 @@ int validate_notification(struct device *dev)
 	return index;
 }
 
-ssize_t get_vendor_name(struct device * dev, struct device_attribute * attr, char *buf)
+// Strings of the valid descriptor, read under RCU because an update replaces them
+static ssize_t show_descriptor_string(struct device *dev, char *buf, enum descriptor_string id)
 {
-	int char_cnt;
+	struct descriptor_strings *strings;
+	struct Descriptor *descriptor;
+	int char_cnt = 0;
 	int index = validate(dev);
 	if (index < 0)
 		return index;
 	if (atomic_read(&get_slot(index)->descriptor.is_valid) < 0)
-		char_cnt = snprintf(buf, get_slot(index)->descriptor.vendor_name_len, (u8 *) get_slot(index)->descriptor.vendor_name);
+		descriptor = &get_slot(index)->descriptor;
 	else {
 		if (atomic_read(&get_slot(index)->descriptor_old.is_valid) >= 0)
 			return -EAGAIN;
-		char_cnt = snprintf(buf, get_slot(index)->descriptor_old.vendor_name_len, (u8 *) get_slot(index)->descriptor_old.vendor_name);
+		descriptor = &get_slot(index)->descriptor_old;
 	}
 
+	buf[0] = '\0';
+	rcu_read_lock();
+	strings = rcu_dereference(descriptor->strings);
+	if (strings)
+		char_cnt = snprintf(buf, strings->length[id], "%s", descriptor_string(strings, id));
+	rcu_read_unlock();
+
 	return char_cnt + 1;
 }
 
-ssize_t get_product_name(struct device * dev, struct device_attribute * attr, char *buf)
+ssize_t get_vendor_name(struct device * dev, struct device_attribute * attr, char *buf)
 {
-	int char_cnt;
-	int index = validate(dev);
-	if (index < 0)
-		return index;
-	if (atomic_read(&get_slot(index)->descriptor.is_valid) < 0)
-		char_cnt = snprintf(buf, get_slot(index)->descriptor.product_name_len, (u8 *) get_slot(index)->descriptor.product_name);
-	else {
-		if (atomic_read(&get_slot(index)->descriptor_old.is_valid) >= 0)
-			return -EAGAIN;
-		char_cnt = snprintf(buf, get_slot(index)->descriptor_old.product_name_len, (u8 *) get_slot(index)->descriptor_old.product_name);
-	}
+	return show_descriptor_string(dev, buf, DESCRIPTOR_STRING_VENDOR_NAME);
+}
 
-	return char_cnt + 1;
+ssize_t get_product_name(struct device * dev, struct device_attribute * attr, char *buf)
+{
+	return show_descriptor_string(dev, buf, DESCRIPTOR_STRING_PRODUCT_NAME);
 }
 
 ssize_t get_vendor_product_id(struct device * dev, struct device_attribute * attr, char *buf)
 {
-	int char_cnt;
-	int index = validate(dev);
-	if (index < 0)
-		return index;
-	if (atomic_read(&get_slot(index)->descriptor.is_valid) < 0)
-		char_cnt = snprintf(buf, get_slot(index)->descriptor.vendor_product_id_len, (u8 *) get_slot(index)->descriptor.vendor_product_id);
-	else {
-		if (atomic_read(&get_slot(index)->descriptor_old.is_valid) >= 0)
-			return -EAGAIN;
-		char_cnt = snprintf(buf, get_slot(index)->descriptor_old.vendor_product_id_len, (u8 *) get_slot(index)->descriptor_old.vendor_product_id);
-	}
-
-	return char_cnt + 1;
+	return show_descriptor_string(dev, buf, DESCRIPTOR_STRING_VENDOR_PRODUCT_ID);
 }
 
 ssize_t get_max_power_3v3(struct device * dev, struct device_attribute * attr, char *buf)
@@ -333,6 +327,7 @@ ssize_t get_serial_code(struct device * dev, struct device_attribute * attr, cha
 ssize_t get_notification_data(struct device * dev, struct device_attribute * attr, char *buf)
 {
 	int char_cnt;
+	int length;
 	int i;
 	int ret;
 	int index = validate_notification(dev);
@@ -355,19 +350,96 @@ ssize_t get_notification_data(struct device * dev, struct device_attribute * att
 		return -ENODEV;
 	}
 
+	length = notification_pop(&get_slot(index)->notification);
+	if (length < 0) {
+		atomic_dec(&get_slot(index)->notification.lock);
+		return -EAGAIN;
+	}
+
 	buf[0] = '0';
 	buf[1] = 'x';
 	char_cnt = 2;
 
-	for (i = 0; i < atomic_read(&get_slot(index)->notification.length); i++) {
+	// The payload follows the header of notification_bin
+	for (i = sizeof(struct sdbp_notification_bin); i < length; i++) {
 		char_cnt += snprintf(buf + char_cnt, 2 + 1, "%02X", get_slot(index)->notification.data[i]);
 	}
 
-	atomic_set(&get_slot(index)->notification.length, 0);
+	// Pollers are signalled again while older notifications are queued
+	if (atomic_read(&get_slot(index)->notification.length) > 0)
+		sysfs_notify(&dev->kobj, NULL, "notification_pending");
 	atomic_dec(&get_slot(index)->notification.lock);
 	return char_cnt + 1;
 }
 
+// Non-blocking and pollable (POLLPRI) counterpart of "notification", returns the pending payload length.
+ssize_t get_notification_pending(struct device * dev, struct device_attribute * attr, char *buf)
+{
+	int char_cnt;
+	int length;
+	int index = validate(dev);
+	if (index < 0)
+		return index;
+
+	length = atomic_read(&get_slot(index)->notification.length);
+	if (length < 0)
+		return -ENODEV;
+
+	char_cnt = snprintf(buf, 10 + 1, "%d", length);
+
+	return char_cnt + 1;
+}
+
+// Binary counterpart of "notification" with timestamps, returns -EAGAIN instead of blocking if nothing is queued
+ssize_t read_notification_bin(struct file *filp, struct kobject *kobj, struct bin_attribute *attr, char *buf, loff_t off, size_t count)
+{
+	struct device *dev = kobj_to_dev(kobj);
+	struct notification *notification;
+	int length;
+	int index;
+
+	if (off != 0)
+		return 0;	// One notification per read
+	index = validate_notification(dev);
+	if (index < 0)
+		return index;
+
+	notification = &get_slot(index)->notification;
+	length = atomic_read(&notification->length);
+	if (length < 0) {
+		length = -ENODEV;
+	} else if (sizeof(struct sdbp_notification_bin) + length > count) {
+		length = -EMSGSIZE;
+	} else {
+		length = notification_pop(notification);
+		if (length < 0)
+			length = -EAGAIN;
+		else
+			memcpy(buf, notification->data, length);
+	}
+
+	if (atomic_read(&notification->length) > 0)
+		sysfs_notify(&dev->kobj, NULL, "notification_pending");
+	atomic_dec(&notification->lock);
+	return length;
+}
+
+// "start response end" of the last write in ns (CLOCK_MONOTONIC), response is the interrupt of the response
+ssize_t get_last_transaction(struct device * dev, struct device_attribute * attr, char *buf)
+{
+	struct transaction_time transaction;
+	int char_cnt;
+	int index = validate(dev);
+	if (index < 0)
+		return index;
+
+	transaction = get_slot(index)->last_transaction;
+	char_cnt = snprintf(buf, 3 * 21 + 1, "%lld %lld %lld", ktime_to_ns(transaction.start), ktime_to_ns(transaction.response),
+			    ktime_to_ns(transaction.end));
+
+	return char_cnt + 1;
+}
+
 ssize_t get_stats_failed_transmissions(struct device * dev, struct device_attribute * attr, char *buf)
 {
 	int char_cnt;
@@ -375,7 +447,7 @@ ssize_t get_stats_failed_transmissions(struct device * dev, struct device_attrib
 	if (index < 0)
 		return index;
 
-	char_cnt = snprintf(buf, 10 + 1, "%u", get_slot(index)->session_stats.transmission_errors);
+	char_cnt = snprintf(buf, 10 + 1, "%u", (u32) stats_get_session(&get_slot(index)->stats, STAT_TRANSACTIONS_FAILED));
 
 	return char_cnt + 1;
 }
@@ -387,7 +459,7 @@ ssize_t get_stats_notifications(struct device * dev, struct device_attribute * a
 	if (index < 0)
 		return index;
 
-	char_cnt = snprintf(buf, 10 + 1, "%u", get_slot(index)->session_stats.notifications);
+	char_cnt = snprintf(buf, 10 + 1, "%u", (u32) stats_get_session(&get_slot(index)->stats, STAT_NOTIFICATIONS));
 
 	return char_cnt + 1;
 }
@@ -399,7 +471,7 @@ ssize_t get_stats_failed_notifications(struct device * dev, struct device_attrib
 	if (index < 0)
 		return index;
 
-	char_cnt = snprintf(buf, 10 + 1, "%u", get_slot(index)->session_stats.notifications_failed);
+	char_cnt = snprintf(buf, 10 + 1, "%u", (u32) stats_get_session(&get_slot(index)->stats, STAT_NOTIFICATIONS_FAILED));
 
 	return char_cnt + 1;
 }
@@ -411,7 +483,7 @@ ssize_t get_stats_failed_descriptors(struct device * dev, struct device_attribut
 	if (index < 0)
 		return index;
 
-	char_cnt = snprintf(buf, 10 + 1, "%u", get_slot(index)->session_stats.descriptor_failed);
+	char_cnt = snprintf(buf, 10 + 1, "%u", (u32) stats_get_session(&get_slot(index)->stats, STAT_DESCRIPTOR_FAILED));
 
 	return char_cnt + 1;
 }
@@ -436,3 +508,411 @@ ssize_t get_rid(struct device * dev, struct device_attribute * attr, char *buf)
 
 	return char_cnt + 1;
 }
+
+ssize_t get_spi_bus(struct device * dev, struct device_attribute * attr, char *buf)
+{
+	int char_cnt;
+	int index = validate(dev);
+	if (index < 0)
+		return index;
+
+	char_cnt = snprintf(buf, 3 + 1, "%u", get_slot(index)->spi_bus);
+
+	return char_cnt + 1;
+}
+
+ssize_t get_spi_chip_select(struct device * dev, struct device_attribute * attr, char *buf)
+{
+	int char_cnt;
+	int index = validate(dev);
+	if (index < 0)
+		return index;
+
+	char_cnt = snprintf(buf, 3 + 1, "%u", get_slot(index)->spi_chip_select);
+
+	return char_cnt + 1;
+}
+
+ssize_t get_stats_bus_acquired(struct device * dev, struct device_attribute * attr, char *buf)
+{
+	struct bus_prio_stats stats[BUS_PRIO_CNT];
+	int char_cnt;
+	int index = validate(dev);
+	if (index < 0)
+		return index;
+
+	bus_get_stats(&get_slot(index)->bus, stats);
+	char_cnt = snprintf(buf, 2 * 11 + 1, "%u %u", stats[BUS_PRIO_NOTIFICATION].acquired, stats[BUS_PRIO_WRITE].acquired);
+
+	return char_cnt + 1;
+}
+
+ssize_t get_stats_bus_contended(struct device * dev, struct device_attribute * attr, char *buf)
+{
+	struct bus_prio_stats stats[BUS_PRIO_CNT];
+	int char_cnt;
+	int index = validate(dev);
+	if (index < 0)
+		return index;
+
+	bus_get_stats(&get_slot(index)->bus, stats);
+	char_cnt = snprintf(buf, 2 * 11 + 1, "%u %u", stats[BUS_PRIO_NOTIFICATION].contended, stats[BUS_PRIO_WRITE].contended);
+
+	return char_cnt + 1;
+}
+
+ssize_t get_stats_bus_max_queued(struct device * dev, struct device_attribute * attr, char *buf)
+{
+	struct bus_prio_stats stats[BUS_PRIO_CNT];
+	int char_cnt;
+	int index = validate(dev);
+	if (index < 0)
+		return index;
+
+	bus_get_stats(&get_slot(index)->bus, stats);
+	char_cnt = snprintf(buf, 2 * 11 + 1, "%u %u", stats[BUS_PRIO_NOTIFICATION].max_queued, stats[BUS_PRIO_WRITE].max_queued);
+
+	return char_cnt + 1;
+}
+
+ssize_t get_stats_bus_wait_us(struct device * dev, struct device_attribute * attr, char *buf)
+{
+	struct bus_prio_stats stats[BUS_PRIO_CNT];
+	int char_cnt;
+	int index = validate(dev);
+	if (index < 0)
+		return index;
+
+	bus_get_stats(&get_slot(index)->bus, stats);
+	char_cnt = snprintf(buf, 4 * 21 + 1, "%llu %u %llu %u", stats[BUS_PRIO_NOTIFICATION].wait_us_total, stats[BUS_PRIO_NOTIFICATION].wait_us_max,
+			    stats[BUS_PRIO_WRITE].wait_us_total, stats[BUS_PRIO_WRITE].wait_us_max);
+
+	return char_cnt + 1;
+}
+
+ssize_t get_keepalive_ms(struct device * dev, struct device_attribute * attr, char *buf)
+{
+	int char_cnt;
+	int index = validate(dev);
+	if (index < 0)
+		return index;
+
+	char_cnt = snprintf(buf, 10 + 1, "%u", get_slot(index)->keepalive_ms);
+
+	return char_cnt + 1;
+}
+
+ssize_t set_keepalive_ms(struct device * dev, struct device_attribute * attr, const char *buf, size_t count)
+{
+	u32 value;
+	int index = validate(dev);
+	if (index < 0)
+		return index;
+
+	if (kstrtou32(buf, 0, &value))
+		return -EINVAL;
+
+	get_slot(index)->keepalive_ms = value;
+	return count;
+}
+
+ssize_t get_stats_suspends(struct device * dev, struct device_attribute * attr, char *buf)
+{
+	int char_cnt;
+	int index = validate(dev);
+	if (index < 0)
+		return index;
+
+	char_cnt = snprintf(buf, 20 + 1, "%llu", stats_get_session(&get_slot(index)->stats, STAT_SUSPENDS));
+
+	return char_cnt + 1;
+}
+
+ssize_t get_stats_resumes(struct device * dev, struct device_attribute * attr, char *buf)
+{
+	int char_cnt;
+	int index = validate(dev);
+	if (index < 0)
+		return index;
+
+	char_cnt = snprintf(buf, 20 + 1, "%llu", stats_get_session(&get_slot(index)->stats, STAT_RESUMES));
+
+	return char_cnt + 1;
+}
+
+ssize_t get_stats_resume_us(struct device * dev, struct device_attribute * attr, char *buf)
+{
+	struct Slot *slot;
+	int char_cnt;
+	int index = validate(dev);
+	if (index < 0)
+		return index;
+
+	slot = get_slot(index);
+	char_cnt = snprintf(buf, 20 + 1 + 10 + 1, "%llu %u", stats_get_session(&slot->stats, STAT_RESUME_US), READ_ONCE(slot->resume_us_max));
+
+	return char_cnt + 1;
+}
+
+ssize_t get_stats_cache(struct device * dev, struct device_attribute * attr, char *buf)
+{
+	struct Slot *slot;
+	int char_cnt;
+	int index = validate(dev);
+	if (index < 0)
+		return index;
+
+	slot = get_slot(index);
+	char_cnt = snprintf(buf, 2 * 21 + 1, "%llu %llu", stats_get_session(&slot->stats, STAT_CACHE_HITS), stats_get_session(&slot->stats, STAT_CACHE_MISSES));
+
+	return char_cnt + 1;
+}
+
+ssize_t get_rt_priority(struct device * dev, struct device_attribute * attr, char *buf)
+{
+	int char_cnt;
+	int index = validate(dev);
+	if (index < 0)
+		return index;
+
+	char_cnt = snprintf(buf, 2 + 1, "%d", get_slot(index)->rt_priority);
+
+	return char_cnt + 1;
+}
+
+ssize_t set_rt_priority(struct device * dev, struct device_attribute * attr, const char *buf, size_t count)
+{
+	int value;
+	int ret;
+	int index = validate(dev);
+	if (index < 0)
+		return index;
+
+	if (kstrtoint(buf, 0, &value))
+		return -EINVAL;
+
+	ret = slot_set_rt_priority(get_slot(index), value);
+	if (ret != 0)
+		return ret;
+	return count;
+}
+
+ssize_t get_cpu_affinity(struct device * dev, struct device_attribute * attr, char *buf)
+{
+	int char_cnt;
+	int index = validate(dev);
+	if (index < 0)
+		return index;
+
+	char_cnt = scnprintf(buf, PAGE_SIZE - 1, "%*pbl", cpumask_pr_args(get_slot(index)->cpus));
+
+	return char_cnt + 1;
+}
+
+ssize_t set_cpu_affinity(struct device * dev, struct device_attribute * attr, const char *buf, size_t count)
+{
+	cpumask_var_t cpus;
+	int ret;
+	int index = validate(dev);
+	if (index < 0)
+		return index;
+
+	if (!zalloc_cpumask_var(&cpus, GFP_KERNEL))
+		return -ENOMEM;
+
+	ret = cpulist_parse(buf, cpus);
+	if (ret == 0)
+		ret = slot_set_cpu_affinity(get_slot(index), cpus);
+	free_cpumask_var(cpus);
+	if (ret != 0)
+		return ret;
+	return count;
+}
+
+ssize_t get_stats_sched_latency_us(struct device * dev, struct device_attribute * attr, char *buf)
+{
+	struct Slot *slot;
+	int char_cnt;
+	int index = validate(dev);
+	if (index < 0)
+		return index;
+
+	slot = get_slot(index);
+	char_cnt = snprintf(buf, 2 * 21 + 10 + 1, "%llu %llu %u", stats_get_session(&slot->stats, STAT_WORKER_KICKS),
+			    stats_get_session(&slot->stats, STAT_SCHED_LATENCY_US), slot->sched_latency_us_max);
+
+	return char_cnt + 1;
+}
+
+static void fill_version_bin(struct sdbp_version_bin *bin, struct Version *version)
+{
+	bin->stability = version->stability;
+	bin->major = version->major;
+	bin->minor = version->minor;
+	bin->patch = version->patch;
+}
+
+static void fill_descriptor_bin(struct sdbp_descriptor_bin *bin, struct Descriptor *descriptor)
+{
+	struct descriptor_strings *strings;
+
+	bin->version = SDBP_DESCRIPTOR_BIN_VERSION;
+	bin->size = sizeof(*bin);
+	bin->rid = descriptor->rid;
+	fill_version_bin(&bin->protocol_version, &descriptor->protocol_version);
+	fill_version_bin(&bin->fw_version, &descriptor->fw_version);
+	fill_version_bin(&bin->hw_version, &descriptor->hw_version);
+	bin->protocol_version.stability = 0;
+	bin->hw_version.stability = 0;
+	bin->max_sclk_speed = descriptor->max_sclk_speed;
+	bin->max_frame_size = descriptor->max_frame_size;
+	bin->max_power_3v3 = descriptor->max_power_3v3;
+	bin->max_power_5v0 = descriptor->max_power_5v0;
+	bin->max_power_12v = descriptor->max_power_12v;
+	bin->bootloader_state = descriptor->bootloader_state;
+	memcpy(bin->serial_code, descriptor->serial_code, sizeof(bin->serial_code));
+	memset(bin->vendor_product_id, 0, sizeof(bin->vendor_product_id));
+	memset(bin->vendor_name, 0, sizeof(bin->vendor_name));
+	memset(bin->product_name, 0, sizeof(bin->product_name));
+
+	rcu_read_lock();
+	strings = rcu_dereference(descriptor->strings);
+	if (strings) {
+		bin->vendor_product_id_len = strings->length[DESCRIPTOR_STRING_VENDOR_PRODUCT_ID];
+		bin->vendor_name_len = strings->length[DESCRIPTOR_STRING_VENDOR_NAME];
+		bin->product_name_len = strings->length[DESCRIPTOR_STRING_PRODUCT_NAME];
+		memcpy(bin->vendor_product_id, descriptor_string(strings, DESCRIPTOR_STRING_VENDOR_PRODUCT_ID), bin->vendor_product_id_len);
+		memcpy(bin->vendor_name, descriptor_string(strings, DESCRIPTOR_STRING_VENDOR_NAME), bin->vendor_name_len);
+		memcpy(bin->product_name, descriptor_string(strings, DESCRIPTOR_STRING_PRODUCT_NAME), bin->product_name_len);
+	}
+	rcu_read_unlock();
+}
+
+// All descriptor fields of one generation, retried if an update started or finished while copying.
+ssize_t read_descriptor_bin(struct file *filp, struct kobject *kobj, struct bin_attribute *attr, char *buf, loff_t off, size_t count)
+{
+	struct sdbp_descriptor_bin *bin;
+	struct Slot *slot;
+	ssize_t ret;
+	int tries = 0;
+	int gen;
+	int index = validate(kobj_to_dev(kobj));
+	if (index < 0)
+		return index;
+
+	slot = get_slot(index);
+	bin = kzalloc(sizeof(*bin), GFP_KERNEL);
+	if (!bin)
+		return -ENOMEM;
+
+	do {
+		if (tries++ == DESCRIPTOR_BIN_TRIES) {
+			kfree(bin);
+			return -EAGAIN;
+		}
+		gen = atomic_read(&slot->descriptor_gen);
+		smp_rmb();
+		fill_descriptor_bin(bin, (gen & 1) ? &slot->descriptor_old : &slot->descriptor);
+		smp_rmb();
+	} while (atomic_read(&slot->descriptor_gen) != gen);
+
+	ret = memory_read_from_buffer(buf, count, &off, bin, sizeof(*bin));
+	kfree(bin);
+	return ret;
+}
+
+ssize_t set_firmware_update(struct device * dev, struct device_attribute * attr, const char *buf, size_t count)
+{
+	int ret;
+	int index = validate(dev);
+	if (index < 0)
+		return index;
+
+	if (count == 0 || count >= FIRMWARE_NAME_MAX)
+		return -EINVAL;
+
+	ret = firmware_start(get_slot(index), buf);
+	return ret ? ret : count;
+}
+
+// "state done size records bytes_per_second frame_size sclk_khz error"
+ssize_t get_firmware_status(struct device * dev, struct device_attribute * attr, char *buf)
+{
+	struct firmware_upload *fw;
+	u64 elapsed_us, rate = 0;
+	size_t done;
+	int char_cnt;
+	int index = validate(dev);
+	if (index < 0)
+		return index;
+
+	fw = &get_slot(index)->fw;
+	done = READ_ONCE(fw->done);
+	elapsed_us = READ_ONCE(fw->elapsed_us);
+	if (elapsed_us)
+		rate = div64_u64((u64) done * USEC_PER_SEC, elapsed_us);
+	char_cnt = snprintf(buf, PAGE_SIZE, "%s %zu %zu %u %llu %u %u %d", firmware_state_name(READ_ONCE(fw->state)), done, READ_ONCE(fw->size),
+			    READ_ONCE(fw->records), rate, READ_ONCE(fw->frame_size), READ_ONCE(fw->sclk_khz), READ_ONCE(fw->error));
+
+	return char_cnt + 1;
+}
+
+ssize_t get_stats(struct device * dev, struct device_attribute * attr, char *buf)
+{
+	u64 *lifetime;
+	u64 *session;
+	struct Slot *slot;
+	int char_cnt;
+	int i;
+	int index = validate(dev);
+	if (index < 0)
+		return index;
+
+	lifetime = kcalloc(2 * STAT_CNT, sizeof(u64), GFP_KERNEL);
+	if (!lifetime)
+		return -ENOMEM;
+	session = lifetime + STAT_CNT;
+
+	// One snapshot for all counters, columns are "name lifetime session"
+	slot = get_slot(index);
+	stats_get(&slot->stats, lifetime, session);
+	char_cnt = snprintf(buf, PAGE_SIZE, "frame_size %u\nsclk_speed %u\n", slot->frame_size, slot->speed_sclk);
+	for (i = 0; i < STAT_CNT; i++)
+		char_cnt += snprintf(buf + char_cnt, PAGE_SIZE - char_cnt, "%s %llu %llu\n", stats_name(i), lifetime[i], session[i]);
+
+	kfree(lifetime);
+	return char_cnt + 1;
+}
+
+ssize_t get_memory_usage(struct device * dev, struct device_attribute * attr, char *buf)
+{
+	struct Slot *slot;
+	size_t usage[6];
+	int char_cnt;
+	int index = validate(dev);
+	if (index < 0)
+		return index;
+
+	// Bytes allocated for the slot, the frame buffers follow the max. frame size of the attached device
+	slot = get_slot(index);
+	usage[0] = sizeof(struct Slot);
+	usage[1] = FRAME_BUFFER_CNT * READ_ONCE(slot->buffer_size) + CRC32_SIZE;
+	usage[2] = notification_queue_size(&slot->notification);
+	usage[3] = descriptor_strings_size(slot);
+	usage[4] = sizeof(struct sdbp_stats_cpu) * num_possible_cpus();
+	usage[5] = recorder_size(&slot->recorder);
+	char_cnt = snprintf(buf, PAGE_SIZE, "slot %zu\nframe_buffers %zu\nnotification_queue %zu\ndescriptor_strings %zu\nstats %zu\nrecorder %zu\n"
+			    "total %zu\n", usage[0], usage[1], usage[2], usage[3], usage[4], usage[5],
+			    usage[0] + usage[1] + usage[2] + usage[3] + usage[4] + usage[5]);
+	return char_cnt + 1;
+}
+
+ssize_t set_stats_reset(struct device * dev, struct device_attribute * attr, const char *buf, size_t count)
+{
+	int index = validate(dev);
+	if (index < 0)
+		return index;
+
+	stats_reset(&get_slot(index)->stats);
+	return count;
+}
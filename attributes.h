@@ -4,6 +4,8 @@
 #include <linux/module.h>
 #include <linux/device.h>
 
+#define DESCRIPTOR_BIN_TRIES 3	// Reads of descriptor_bin racing with descriptor updates
+
 ssize_t get_vendor_product_id(struct device *dev, struct device_attribute *attr, char *buf);
 ssize_t get_vendor_name(struct device *dev, struct device_attribute *attr, char *buf);
 ssize_t get_product_name(struct device *dev, struct device_attribute *attr, char *buf);
@@ -18,11 +20,37 @@ ssize_t get_hw_version(struct device *dev, struct device_attribute *attr, char *
 ssize_t get_protocol_version(struct device *dev, struct device_attribute *attr, char *buf);
 ssize_t get_serial_code(struct device *dev, struct device_attribute *attr, char *buf);
 ssize_t get_notification_data(struct device *dev, struct device_attribute *attr, char *buf);
+ssize_t get_notification_pending(struct device *dev, struct device_attribute *attr, char *buf);
+ssize_t read_notification_bin(struct file *filp, struct kobject *kobj, struct bin_attribute *attr, char *buf, loff_t off, size_t count);
+ssize_t get_last_transaction(struct device *dev, struct device_attribute *attr, char *buf);
 ssize_t get_stats_failed_transmissions(struct device *dev, struct device_attribute *attr, char *buf);
 ssize_t get_stats_notifications(struct device *dev, struct device_attribute *attr, char *buf);
 ssize_t get_stats_failed_notifications(struct device *dev, struct device_attribute *attr, char *buf);
 ssize_t get_stats_failed_descriptors(struct device *dev, struct device_attribute *attr, char *buf);
 ssize_t get_rid(struct device *dev, struct device_attribute *attr, char *buf);
+ssize_t get_spi_bus(struct device *dev, struct device_attribute *attr, char *buf);
+ssize_t get_spi_chip_select(struct device *dev, struct device_attribute *attr, char *buf);
+ssize_t get_stats_bus_acquired(struct device *dev, struct device_attribute *attr, char *buf);
+ssize_t get_stats_bus_contended(struct device *dev, struct device_attribute *attr, char *buf);
+ssize_t get_stats_bus_max_queued(struct device *dev, struct device_attribute *attr, char *buf);
+ssize_t get_stats_bus_wait_us(struct device *dev, struct device_attribute *attr, char *buf);
+ssize_t get_keepalive_ms(struct device *dev, struct device_attribute *attr, char *buf);
+ssize_t set_keepalive_ms(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+ssize_t get_stats_suspends(struct device *dev, struct device_attribute *attr, char *buf);
+ssize_t get_stats_resumes(struct device *dev, struct device_attribute *attr, char *buf);
+ssize_t get_stats_resume_us(struct device *dev, struct device_attribute *attr, char *buf);
+ssize_t get_stats_cache(struct device *dev, struct device_attribute *attr, char *buf);
+ssize_t get_rt_priority(struct device *dev, struct device_attribute *attr, char *buf);
+ssize_t set_rt_priority(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+ssize_t get_cpu_affinity(struct device *dev, struct device_attribute *attr, char *buf);
+ssize_t set_cpu_affinity(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+ssize_t get_stats_sched_latency_us(struct device *dev, struct device_attribute *attr, char *buf);
+ssize_t read_descriptor_bin(struct file *filp, struct kobject *kobj, struct bin_attribute *attr, char *buf, loff_t off, size_t count);
+ssize_t set_firmware_update(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+ssize_t get_firmware_status(struct device *dev, struct device_attribute *attr, char *buf);
+ssize_t get_stats(struct device *dev, struct device_attribute *attr, char *buf);
+ssize_t get_memory_usage(struct device *dev, struct device_attribute *attr, char *buf);
+ssize_t set_stats_reset(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
 ssize_t trigger_notification(struct device *dev, struct device_attribute *attr, char *buf);
 
 #endif
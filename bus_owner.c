@@ -0,0 +1,143 @@
+#include <linux/sched.h>
+#include <linux/ktime.h>
+#include <linux/errno.h>
+#include "bus_owner.h"
+
+/*
+ * Per-slot bus ownership.
+ * The bus is handed over directly from the releasing owner to the first waiter,
+ * so exactly one task is woken per release and nobody can overtake a queued waiter.
+ */
+
+void bus_owner_init(struct bus_owner *owner)
+{
+	int i;
+
+	spin_lock_init(&owner->lock);
+	owner->busy = false;
+	for (i = 0; i < BUS_PRIO_CNT; i++) {
+		INIT_LIST_HEAD(&owner->waiters[i]);
+		owner->queued[i] = 0;
+		memset(&owner->stats[i], 0, sizeof(owner->stats[i]));
+	}
+}
+
+static void account_wait(struct bus_owner *owner, enum bus_prio prio, ktime_t start)
+{
+	u32 wait_us = ktime_us_delta(ktime_get(), start);
+	unsigned long flags;
+
+	spin_lock_irqsave(&owner->lock, flags);
+	owner->stats[prio].wait_us_total += wait_us;
+	if (wait_us > owner->stats[prio].wait_us_max)
+		owner->stats[prio].wait_us_max = wait_us;
+	spin_unlock_irqrestore(&owner->lock, flags);
+}
+
+// Returns true if the bus was taken immediately, otherwise the waiter is queued.
+static bool enqueue(struct bus_owner *owner, enum bus_prio prio, struct bus_waiter *waiter)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&owner->lock, flags);
+	owner->stats[prio].acquired++;
+	if (!owner->busy) {
+		owner->busy = true;
+		spin_unlock_irqrestore(&owner->lock, flags);
+		return true;
+	}
+	init_completion(&waiter->granted);
+	list_add_tail(&waiter->node, &owner->waiters[prio]);
+	owner->stats[prio].contended++;
+	if (++owner->queued[prio] > owner->stats[prio].max_queued)
+		owner->stats[prio].max_queued = owner->queued[prio];
+	spin_unlock_irqrestore(&owner->lock, flags);
+	return false;
+}
+
+void bus_acquire(struct bus_owner *owner, enum bus_prio prio)
+{
+	struct bus_waiter waiter;
+	ktime_t start = ktime_get();
+
+	if (enqueue(owner, prio, &waiter))
+		return;
+	wait_for_completion(&waiter.granted);
+	account_wait(owner, prio, start);
+}
+
+int bus_acquire_interruptible(struct bus_owner *owner, enum bus_prio prio)
+{
+	struct bus_waiter waiter;
+	ktime_t start = ktime_get();
+	unsigned long flags;
+
+	if (enqueue(owner, prio, &waiter))
+		return 0;
+
+	if (wait_for_completion_interruptible(&waiter.granted) != 0) {
+		spin_lock_irqsave(&owner->lock, flags);
+		if (!completion_done(&waiter.granted)) {
+			list_del(&waiter.node);
+			owner->queued[prio]--;
+			owner->stats[prio].acquired--;
+			spin_unlock_irqrestore(&owner->lock, flags);
+			return -ERESTARTSYS;
+		}
+		spin_unlock_irqrestore(&owner->lock, flags);
+		// Ownership was handed over concurrently with the signal, keep it.
+	}
+	account_wait(owner, prio, start);
+	return 0;
+}
+
+bool bus_try_acquire(struct bus_owner *owner, enum bus_prio prio)
+{
+	unsigned long flags;
+	bool ret = false;
+
+	spin_lock_irqsave(&owner->lock, flags);
+	if (!owner->busy) {
+		owner->busy = true;
+		owner->stats[prio].acquired++;
+		ret = true;
+	}
+	spin_unlock_irqrestore(&owner->lock, flags);
+	return ret;
+}
+
+void bus_release(struct bus_owner *owner)
+{
+	struct bus_waiter *waiter;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&owner->lock, flags);
+	for (i = 0; i < BUS_PRIO_CNT; i++) {
+		waiter = list_first_entry_or_null(&owner->waiters[i], struct bus_waiter, node);
+		if (waiter) {
+			// Hand over, the bus stays busy
+			list_del(&waiter->node);
+			owner->queued[i]--;
+			complete(&waiter->granted);
+			spin_unlock_irqrestore(&owner->lock, flags);
+			return;
+		}
+	}
+	owner->busy = false;
+	spin_unlock_irqrestore(&owner->lock, flags);
+}
+
+bool bus_is_busy(struct bus_owner *owner)
+{
+	return READ_ONCE(owner->busy);
+}
+
+void bus_get_stats(struct bus_owner *owner, struct bus_prio_stats *stats)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&owner->lock, flags);
+	memcpy(stats, owner->stats, sizeof(owner->stats));
+	spin_unlock_irqrestore(&owner->lock, flags);
+}
@@ -0,0 +1,45 @@
+#ifndef BUS_OWNER_H_
+#define BUS_OWNER_H_
+
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/completion.h>
+
+// Waiters of a higher priority (lower value) are always served first, FIFO within a priority.
+enum bus_prio {
+	BUS_PRIO_NOTIFICATION,
+	BUS_PRIO_WRITE,
+	BUS_PRIO_CNT,
+};
+
+struct bus_waiter {
+	struct list_head node;
+	struct completion granted;
+};
+
+struct bus_prio_stats {
+	u32 acquired;
+	u32 contended;		// Acquisitions which had to wait for the bus
+	u32 max_queued;		// Highest number of concurrent waiters
+	u64 wait_us_total;
+	u32 wait_us_max;
+};
+
+struct bus_owner {
+	spinlock_t lock;
+	bool busy;
+	struct list_head waiters[BUS_PRIO_CNT];
+	u32 queued[BUS_PRIO_CNT];
+	struct bus_prio_stats stats[BUS_PRIO_CNT];
+};
+
+void bus_owner_init(struct bus_owner *owner);
+void bus_acquire(struct bus_owner *owner, enum bus_prio prio);
+int bus_acquire_interruptible(struct bus_owner *owner, enum bus_prio prio);
+bool bus_try_acquire(struct bus_owner *owner, enum bus_prio prio);
+void bus_release(struct bus_owner *owner);
+bool bus_is_busy(struct bus_owner *owner);
+void bus_get_stats(struct bus_owner *owner, struct bus_prio_stats *stats);
+
+#endif
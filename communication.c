@@ -7,25 +7,98 @@
 #include "communication.h"
 #include "sdbp.h"
 #include "crc16ccitt.h"
+#include "sdbp_uapi.h"
+#include "recorder.h"
 #include "debug.h"
 
-ssize_t spi_api_exchange(struct Slot * slot, u8 * tx_buffer, u8 * rx_buffer)
+static u8 *padding;		// Shared read-only DUMMY_PATTERN padding of all slots
+
+int init_padding(void)
+{
+	padding = kmalloc(MAXIMUM_FRAME_SIZE, GFP_KERNEL);
+	if (!padding)
+		return -ENOMEM;
+	memset(padding, DUMMY_PATTERN, MAXIMUM_FRAME_SIZE);
+	return 0;
+}
+
+void free_padding(void)
+{
+	kfree(padding);
+}
+
+/*
+ * Sends the prepared dummy frame as one transfer. The messages into rx_buffer and dummy_buffer are kept per slot and
+ * only initialized again after a frame size or SCLK change, other buffers (notifications) use an ad-hoc message.
+ */
+static int dummy_exchange(struct Slot *slot, u8 * rx_buffer)
 {
+	struct sdbp_message *m;
+	struct sdbp_message adhoc = { };
+
+	if (rx_buffer == slot->rx_buffer)
+		m = &slot->dummy_msg[0];
+	else if (rx_buffer == slot->dummy_buffer)
+		m = &slot->dummy_msg[1];
+	else
+		m = &adhoc;
+
+	if (m->frame_size != slot->frame_size || m->speed_sclk != slot->speed_sclk) {
+		m->xfer.tx_buf = slot->dummy_frame;
+		m->xfer.rx_buf = rx_buffer;
+		m->xfer.len = slot->frame_size;
+		m->xfer.speed_hz = slot->speed_sclk;
+		spi_message_init_with_transfers(&m->msg, &m->xfer, 1);
+		m->frame_size = slot->frame_size;
+		m->speed_sclk = slot->speed_sclk;
+	}
+
+	return spi_sync(slot->spi_device, &m->msg);
+}
+
+// The dummy messages are initialized again by the next dummy_exchange()
+void release_messages(struct Slot *slot)
+{
+	int i;
 
-	struct spi_transfer t = {.tx_buf = tx_buffer,.rx_buf = rx_buffer,.len = slot->frame_size,.speed_hz = slot->speed_sclk,
+	for (i = 0; i < ARRAY_SIZE(slot->dummy_msg); i++)
+		slot->dummy_msg[i].frame_size = 0;
+}
+
+/*
+ * Sends one frame as scatter-gather message: header and payload from tx_buffer, the shared padding and the CRC
+ * of prepare_frame(). rx_buffer receives the whole frame. The dummy frame is already padded and uses dummy_exchange().
+ */
+ssize_t spi_api_exchange(struct Slot * slot, u8 * tx_buffer, u8 * rx_buffer)
+{
+	u16 length = (tx_buffer[1] << 8) | tx_buffer[2];
+	u16 padding_length = slot->frame_size - slot->crc_size - length;
+	struct spi_transfer t[3] = {
+		{.tx_buf = tx_buffer,.rx_buf = rx_buffer,.len = length,.speed_hz = slot->speed_sclk},
+		{.tx_buf = padding,.rx_buf = rx_buffer + length,.len = padding_length,.speed_hz = slot->speed_sclk},
+		{.tx_buf = slot->tx_crc,.rx_buf = rx_buffer + length + padding_length,.len = slot->crc_size,.speed_hz = slot->speed_sclk},
 	};
 
 	struct spi_message m;
 
+	stats_add(&slot->stats, STAT_TX_WIRE_BYTES, slot->frame_size);
+	stats_add(&slot->stats, STAT_RX_WIRE_BYTES, slot->frame_size);
+
+	if (tx_buffer == slot->dummy_frame)
+		return dummy_exchange(slot, rx_buffer);
+
 	spi_message_init(&m);
-	spi_message_add_tail(&t, &m);
+	spi_message_add_tail(&t[0], &m);
+	if (padding_length)
+		spi_message_add_tail(&t[1], &m);
+	spi_message_add_tail(&t[2], &m);
 
 	return spi_sync(slot->spi_device, &m);
 }
 
+// Checks the frame length and calculates the CRC over header, payload and padding into slot->tx_crc, data is not padded.
 int prepare_frame(struct Slot *slot, u8 * data)
 {
-	u16 cnt;
 	u16 length;
 	u16 calc_crc;
 
@@ -41,28 +114,41 @@ int prepare_frame(struct Slot *slot, u8 * data)
 		return -1;
 	}
 
-	for (cnt = length; cnt < (slot->frame_size - slot->crc_size); cnt++) {
-		data[cnt] = DUMMY_PATTERN;
-	}
-
-	if (slot->crc_size == DEFAULT_CRC_SIZE) {
-		// calc_crc =
-		//              crc_ccitt(0, (unsigned char *)data, slot->frame_size - slot->crc_size);
-		calc_crc = crc16_ccitt((unsigned char *)data, slot->frame_size - slot->crc_size, 0);
-
-		data[slot->frame_size - slot->crc_size] = (calc_crc & 0xff00) >> 8;
-		data[slot->frame_size - slot->crc_size + 1] = (calc_crc & 0x00ff);
-	} else {
+	if (slot->crc_size != DEFAULT_CRC_SIZE) {
 		PRINT_SLOT_ERR("CRC32 not implemented!\n", slot->number);
 		return -1;
 	}
 
+	calc_crc = crc16_ccitt((unsigned char *)data, length, 0);
+	calc_crc = crc16_ccitt(padding, slot->frame_size - slot->crc_size - length, calc_crc);
+
+	slot->tx_crc[0] = (calc_crc & 0xff00) >> 8;
+	slot->tx_crc[1] = (calc_crc & 0x00ff);
 	return 0;
 }
+EXPORT_FOR_KUNIT(prepare_frame);
+
+// Pads the dummy frame to the frame size and appends its CRC, only done when the frame size changed
+void prepare_dummy(struct Slot *slot)
+{
+	u16 calc_crc;
+
+	slot->crc_size = DEFAULT_CRC_SIZE;
+	if (slot->dummy_frame_size != slot->frame_size) {
+		memset(slot->dummy_frame + sizeof(DUMMY_DUMMY), DUMMY_PATTERN, slot->frame_size - slot->crc_size - sizeof(DUMMY_DUMMY));
+		calc_crc = crc16_ccitt(slot->dummy_frame, slot->frame_size - slot->crc_size, 0);
+		slot->dummy_frame[slot->frame_size - slot->crc_size] = (calc_crc & 0xff00) >> 8;
+		slot->dummy_frame[slot->frame_size - slot->crc_size + 1] = (calc_crc & 0x00ff);
+		slot->dummy_frame_size = slot->frame_size;
+	}
+	// Kept for transfer functions which send the unpadded frame plus tx_crc
+	memcpy(slot->tx_crc, slot->dummy_frame + slot->frame_size - slot->crc_size, slot->crc_size);
+}
+EXPORT_FOR_KUNIT(prepare_dummy);
 
+// One printk, %*ph is limited to 64 bytes. The frames of the last exchanges are kept by the recorder.
 void print_frame(struct Slot *slot, u8 * data)
 {
-	u16 i;
 	u16 length;
 	length = (data[1] << 8) | data[2];
 
@@ -71,16 +157,35 @@ void print_frame(struct Slot *slot, u8 * data)
 
 	if (length == 0)
 		PRINT_SLOT_ERR("Corrupted data: Length is zero!\n", slot->number);
-	else {
-		PRINT_SLOT_ERR("Corrupted data: ", slot->number);
-		for (i = 0; i < length; i++) {
-			printk(KERN_CONT "%#02x ", data[i]);
-		}
-		printk(KERN_CONT "[0x7F,...,0x7F] ");
-		for (i = slot->frame_size - slot->crc_size; i < slot->frame_size; i++) {
-			printk(KERN_CONT "%#02x ", data[i]);
-		}
+	else
+		PRINT_SLOT_ERR("Corrupted data: %*ph [0x7F,...,0x7F] %*ph\n", slot->number, min_t(int, length, 64), data, slot->crc_size,
+			       data + slot->frame_size - slot->crc_size);
+}
+
+// Error prints are rate limited per slot, a failing device must not slow down the others with console output
+static bool log_error(struct Slot *slot, u8 log_lvl)
+{
+	return log_lvl > LOG_LVL_SILENT && __ratelimit(&slot->print_limit);
+}
+
+// An injected interrupt loss waits the whole timeout like a device which never gets ready
+static int wait_for_ready(struct Slot *slot, u32 timeout_us)
+{
+	if (fault_inject(slot, FAULT_IRQ)) {
+		fsleep(timeout_us);
+		return -1;
 	}
+	return wait_for_interrupt(slot, timeout_us);
+}
+
+static void record_exchange(struct Slot *slot, struct frame_record *record, ktime_t start, const u8 * tx, const u8 * rx, int result)
+{
+	record->result = result;
+	record->start_ns = ktime_to_ns(start);
+	record->duration_us = ktime_us_delta(ktime_get(), start);
+	record->frame_size = slot->frame_size;
+	record->sclk_speed = slot->speed_sclk;
+	recorder_add(&slot->recorder, record, tx, rx);
 }
 
 int check_crc(struct Slot *slot, u8 * data, u8 log_lvl)
@@ -97,78 +202,173 @@ int check_crc(struct Slot *slot, u8 * data, u8 log_lvl)
 	}
 
 	if (calc_crc != rec_crc) {
-		if (log_lvl > LOG_LVL_SILENT)
+		stats_inc(&slot->stats, STAT_CRC_ERRORS);
+		if (log_error(slot, log_lvl))
 			PRINT_SLOT_ERR("CRC ERROR: (calc) %#04x!=%#04x (rec).\n", slot->number, calc_crc, rec_crc);
 		return -1;
 	}
 
 	return 0;
 }
+EXPORT_FOR_KUNIT(check_crc);
 
-int wait_for_interrupt(struct Slot *slot, u16 timeout_ms)
+/*
+ * hrtimer based, so short timeouts like the CTS wait or a device WAIT are not rounded up to jiffies.
+ * Not interruptible: a signal must not abort an exchange between request and response. Returns -1 on timeout.
+ */
+int wait_for_interrupt(struct Slot *slot, u32 timeout_us)
 {
-	long ret = 0;
 	int interrupt = atomic_read(&slot->interrupt_arrived);
 
 	if (interrupt != 1) {
-
-		ret = wait_event_timeout(slot->queue, atomic_read(&slot->interrupt_arrived) > 0, msecs_to_jiffies(timeout_ms));
-
-		if (ret == 0) {
+		if (wait_event_hrtimeout(slot->queue, atomic_read(&slot->interrupt_arrived) > 0, us_to_ktime(timeout_us)) != 0) {
 			//PRINT_SLOT_DBG("Interrupt timeout!\n",slot->number); //DEBUGGED BY CALLING FUNCTION
 			return -1;
-		} else if (ret == -ERESTARTSYS) {
-			PRINT_SLOT_DBG("Interrupted by system!\n", slot->number);
-			return -2;
 		}
 	}
 
 	return 0;
 }
 
+int notification_queue_init(struct notification *notification, u32 size)
+{
+	notification->record = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	notification->data = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!notification->record || !notification->data)
+		goto free;
+	if (kfifo_alloc(&notification->queue, size, GFP_KERNEL) != 0)
+		goto free;
+	return 0;
+
+ free:
+	kfree(notification->record);
+	kfree(notification->data);
+	notification->record = NULL;
+	notification->data = NULL;
+	return -ENOMEM;
+}
+
+void notification_queue_free(struct notification *notification)
+{
+	kfifo_free(&notification->queue);
+	kfree(notification->record);
+	kfree(notification->data);
+}
+
+size_t notification_queue_size(struct notification *notification)
+{
+	if (!notification->record)
+		return 0;
+	return kfifo_size(&notification->queue) + 2 * PAGE_SIZE;
+}
+
+// Payload length of the oldest queued notification, called with queue_lock held
+static int queued_length(struct notification *notification)
+{
+	if (kfifo_is_empty(&notification->queue))
+		return 0;
+	return kfifo_peek_len(&notification->queue) - sizeof(struct sdbp_notification_bin);
+}
+
+// Drops all queued notifications, length is 0 for a new connection and -1 after a disconnect
+void notification_queue_reset(struct notification *notification, int length)
+{
+	spin_lock(&notification->queue_lock);
+	kfifo_reset(&notification->queue);
+	notification->sequence = 0;
+	atomic_set(&notification->length, length);
+	spin_unlock(&notification->queue_lock);
+}
+
+// Moves the oldest notification (struct sdbp_notification_bin and payload) into data, returns its length or -1 if the queue is empty
+int notification_pop(struct notification *notification)
+{
+	int length = -1;
+
+	spin_lock(&notification->queue_lock);
+	if (!kfifo_is_empty(&notification->queue)) {
+		length = kfifo_out(&notification->queue, notification->data, PAGE_SIZE);
+		atomic_set(&notification->length, queued_length(notification));
+	}
+	spin_unlock(&notification->queue_lock);
+	return length;
+}
+
+static void queue_notification(struct Slot *slot, u8 * data, u16 length, ktime_t announced)
+{
+	struct notification *notification = &slot->notification;
+	struct sdbp_notification_bin *header = (struct sdbp_notification_bin *)notification->record;
+	u16 size = sizeof(*header) + length;
+
+	header->irq_ns = ktime_to_ns(announced);
+	header->fetch_ns = ktime_get_ns();
+	header->length = length;
+	header->reserved = 0;
+	memcpy(header->payload, data, length);
+
+	spin_lock(&notification->queue_lock);
+	header->sequence = notification->sequence++;
+	while (kfifo_avail(&notification->queue) < size && !kfifo_is_empty(&notification->queue)) {
+		kfifo_skip(&notification->queue);
+		stats_inc(&slot->stats, STAT_NOTIFICATIONS_DROPPED);
+	}
+	kfifo_in(&notification->queue, notification->record, size);
+	atomic_set(&notification->length, queued_length(notification));
+	spin_unlock(&notification->queue_lock);
+}
+
+// Fetches one notification into the queue, returns 1 if the device has further notifications pending.
 int get_notification(struct Slot *slot)
 {
-	int ret;
-	u8 *rx_buffer;
+	u8 *rx_buffer = slot->notification.rx_buffer;
+	ktime_t announced = atomic64_xchg(&slot->announce_time, 0);
 	u16 length;
-	rx_buffer = kcalloc(MAXIMUM_FRAME_SIZE, sizeof(u8), GFP_KERNEL);	// Allocate memory
-	ret = 0;
 
-	if (atomic_read(&slot->notification.length) > 0) {
-		PRINT_SLOT_DBG("Notification is not received because buffer is full!\n", slot->number);
-		ret = -2;
-	} else {
-		if (exchange_sdbp(slot, (u8 *) NOTIFICATION, rx_buffer, LOG_LVL_SILENT)
-		    != 0) {
-			PRINT_SLOT_DBG("Notification exchange failed!\n", slot->number);
-			ret = -1;
-			slot->session_stats.transmission_errors--;
-			slot->session_stats.notifications_failed++;
-		} else {
-			length = (rx_buffer[1] << 8) | rx_buffer[2];
-			if (length >= MAXIMUM_FRAME_SIZE || length >= PAGE_SIZE) {	// sysfs max. size is PAGE_SIZE
-				PRINT_SLOT_DBG("Notification length invalid!\n", slot->number);
-				slot->session_stats.notifications_failed++;
-				ret = -1;
-			} else {
-				atomic_set(&slot->notification.length, length - 4);
-				memcpy(slot->notification.data, rx_buffer + 4, length - 4);
-				slot->session_stats.notifications++;
-				wake_up(&slot->notification.wait_for_notification);
-				ret = 0;
-			}
-		}
+	if (exchange_sdbp(slot, (u8 *) NOTIFICATION, rx_buffer, LOG_LVL_SILENT) != 0) {
+		PRINT_SLOT_DBG("Notification exchange failed!\n", slot->number);
+		stats_inc(&slot->stats, STAT_NOTIFICATIONS_FAILED);
+		return -1;
 	}
-	kfree(rx_buffer);
-	return ret;
+
+	length = (rx_buffer[1] << 8) | rx_buffer[2];
+	if (length < 4 || length >= MAXIMUM_FRAME_SIZE || length - 4 > PAGE_SIZE - sizeof(struct sdbp_notification_bin)) {	// sysfs max. size is PAGE_SIZE
+		PRINT_SLOT_DBG("Notification length invalid!\n", slot->number);
+		stats_inc(&slot->stats, STAT_NOTIFICATIONS_FAILED);
+		return -1;
+	}
+
+	// Fetched without a known announcement (e.g. a retry after a failed fetch), the response interrupt is used
+	queue_notification(slot, rx_buffer + 4, length - 4, announced ? announced : slot->response_irq);
+	stats_inc(&slot->stats, STAT_NOTIFICATIONS);
+	wake_up(&slot->notification.wait_for_notification);
+	sysfs_notify(&slot->sdbp_device->kobj, NULL, "notification_pending");
+	return rx_buffer[3] == SDBP_OPTION_BYTE_NOTIFICATION_PENDING;
+}
+
+/*
+ * Fetches notifications back to back until the device clears the pending flag, the caller owns the bus.
+ * After NOTIFICATION_DRAIN_MAX fetches the rest is left to the worker, so a burst cannot hold off pending writers.
+ */
+int drain_notifications(struct Slot *slot)
+{
+	int ret;
+	int i;
+
+	for (i = 0; i < NOTIFICATION_DRAIN_MAX; i++) {
+		ret = get_notification(slot);
+		if (ret <= 0)
+			return ret;
+	}
+	atomic_set(&slot->notification_arrived, 1);
+	return 0;
 }
 
 int sync_com(struct Slot *slot)
 {
 	int ret, i;
-	u8 *tx_buffer, *rx_buffer;
-	tx_buffer = kcalloc(MAXIMUM_FRAME_SIZE, sizeof(u8), GFP_KERNEL);	// Allocate memory
-	rx_buffer = kcalloc(MAXIMUM_FRAME_SIZE, sizeof(u8), GFP_KERNEL);	// Allocate memory
+	u8 *rx_buffer;
+	bus_acquire(&slot->bus, BUS_PRIO_NOTIFICATION);
+	rx_buffer = slot->descriptor_buffer;
 	ret = 0;
 	i = 0;
 	do {
@@ -188,8 +388,7 @@ int sync_com(struct Slot *slot)
 	else
 		ret = 0;
 
-	kfree(tx_buffer);
-	kfree(rx_buffer);
+	bus_release(&slot->bus);
 	return ret;
 }
 
@@ -207,6 +406,7 @@ int check_frame_size_change(u8 * data, u16 length, u32 max_frame_size, struct Sl
 	} else
 		return 0;
 }
+EXPORT_FOR_KUNIT(check_frame_size_change);
 
 int change_frame_size(u8 * data, u16 length, u32 max_frame_size, struct Slot *slot)
 {
@@ -214,6 +414,7 @@ int change_frame_size(u8 * data, u16 length, u32 max_frame_size, struct Slot *sl
 	    && (data[7] == 0x00) && (length == 8)) {
 		PRINT_SLOT_DBG("Frame size changed from %d bytes to %d bytes\n", slot->number, slot->frame_size, max_frame_size);
 		slot->frame_size = max_frame_size;
+		release_messages(slot);
 		return 1;
 	} else
 		return 0;
@@ -228,9 +429,9 @@ int check_sclk_change(u8 * data, u16 length, u32 max_speed_khz, struct Slot *slo
 	if ((data[4] == 0x01) && (data[5] == 0x03) && (data[6] == 0x02)) {
 		PRINT_SLOT_DBG("Send MODE_SUSPEND\n", slot->number);
 	}
-	//if ((data[4] == 0x01) && (data[5] == 0x03) && (data[6] == 0x03)) {
-	//            PRINT_SLOT_DBG("Send MODE_RUN\n", slot->number);
-	//}
+	if ((data[4] == 0x01) && (data[5] == 0x03) && (data[6] == 0x03)) {
+		PRINT_SLOT_DBG("Send MODE_RUN\n", slot->number);
+	}
 
 	if ((data[4] == 0x01) && (data[5] == 0x03) && (data[6] == 0x08)
 	    && (length == 11)) {
@@ -244,6 +445,7 @@ int check_sclk_change(u8 * data, u16 length, u32 max_speed_khz, struct Slot *slo
 	} else
 		return 0;
 }
+EXPORT_FOR_KUNIT(check_sclk_change);
 
 int change_sclk(u8 * data, u16 length, u32 speed_khz, struct Slot *slot)
 {
@@ -251,6 +453,7 @@ int change_sclk(u8 * data, u16 length, u32 speed_khz, struct Slot *slot)
 	    && (data[7] == 0x00) && (length == 8)) {
 		PRINT_SLOT_DBG("Speed changed from %d kHz to %d kHz\n", slot->number, slot->speed_sclk / 1000, speed_khz);
 		slot->speed_sclk = speed_khz * 1000;
+		release_messages(slot);
 		return 1;
 	} else
 		return 0;
@@ -261,6 +464,7 @@ int update_descriptor(u8 * data, u16 length, struct Slot *slot)
 	if ((data[4] == 0x01) && (data[5] == 0x03) && (data[6] == 0x09)
 	    && (data[7] == 0x00) && (length == 8)) {
 		PRINT_SLOT_DBG("Update descriptor requested.\n", slot->number);
+		cache_invalidate(&slot->cache);
 		if (!gpio_get_value(slot->interrupt_pin)) {
 			usleep_range(500, 1000);	// Delay until interrupt goes high
 		}
@@ -274,77 +478,134 @@ int update_descriptor(u8 * data, u16 length, struct Slot *slot)
 		return 0;
 }
 
+static enum sdbp_stat transaction_error_stat(u8 error)
+{
+	switch (error) {
+	case SDBP_C_TRANSACTION_ERROR_FRAME_CRC:
+		return STAT_ERROR_FRAME_CRC;
+	case SDBP_C_TRANSACTION_ERROR_MESSAGE_TYPE_INVALID:
+		return STAT_ERROR_MESSAGE_TYPE_INVALID;
+	case SDBP_C_TRANSACTION_ERROR_CLASS_IDENTIFIER_INVALID:
+		return STAT_ERROR_CLASS_IDENTIFIER_INVALID;
+	case SDBP_C_TRANSACTION_ERROR_CLASS_INVALID:
+		return STAT_ERROR_CLASS_INVALID;
+	case SDBP_C_TRANSACTION_ERROR_DATA_LENGTH_INVALID:
+		return STAT_ERROR_DATA_LENGTH_INVALID;
+	case SDBP_C_TRANSACTION_ERROR_DEVICE_WRONG_MODE:
+		return STAT_ERROR_DEVICE_WRONG_MODE;
+	default:
+		return STAT_ERROR_UNKNOWN;
+	}
+}
+
+/*
+ * The per-slot frame buffers are only used while the exchange runs, a nested exchange from update_descriptor()
+ * starts after the response of the outer one has been evaluated.
+ */
 int exchange_sdbp(struct Slot *slot, u8 * data, u8 * rx_buffer, u8 log_lvl)
 {
-	u8 *tx_buffer_tmp;
-	u8 *dummy_buffer;
+	u8 *tx_frame;
+	u8 *dummy_buffer = slot->dummy_buffer;
 	u16 length;
 	u32 sclk_change;
 	u32 frame_size_change;
-	u32 wait_timeout = 250;	//ms
+	u32 wait_timeout = READY_TIMEOUT_US;
+	u32 injected_wait_us;
 	u8 wait = false;
 	u8 cleanup_later = false;
 	u8 retransmit = false;
-	tx_buffer_tmp = kcalloc(MAXIMUM_FRAME_SIZE, sizeof(u8), GFP_KERNEL);	// Allocate memory
-	dummy_buffer = kcalloc(MAXIMUM_FRAME_SIZE, sizeof(u8), GFP_KERNEL);	// Allocate memory
+	u8 response = false;
+	ktime_t wait_start = 0;
+	ktime_t start = ktime_get();
+	struct frame_record record = { 0 };
 	length = (data[1] << 8) | data[2];
 	if (length > (MAXIMUM_FRAME_SIZE - DEFAULT_CRC_SIZE)) {
 		PRINT_SLOT_ERR("Frame size bigger than 4096 bytes is not supported!", slot->number);
+		record.reason = RECORD_LENGTH;
 		goto cleanup;
 	}
 
-	memcpy(tx_buffer_tmp, data, length);
-	sclk_change = check_sclk_change(tx_buffer_tmp, length, slot->descriptor.max_sclk_speed, slot);
-	frame_size_change = check_frame_size_change(tx_buffer_tmp, length, slot->descriptor.max_frame_size, slot);
-	if (prepare_frame(slot, tx_buffer_tmp) != 0) {
+	if (length > slot->buffer_size - DEFAULT_CRC_SIZE) {
+		PRINT_SLOT_ERR("Frame exceeds the slot buffers (%d bytes)!", slot->number, slot->buffer_size);
+		record.reason = RECORD_LENGTH;
+		goto cleanup;
+	}
+
+	stats_inc(&slot->stats, STAT_TRANSACTIONS);
+	stats_add(&slot->stats, STAT_TX_PAYLOAD_BYTES, length > 4 ? length - 4 : 0);
+	// Write payloads are sent in place, constant requests are copied into DMA safe memory
+	tx_frame = data;
+	if (data != slot->tx_buffer) {
+		memcpy(slot->tx_frame, data, length);
+		tx_frame = slot->tx_frame;
+	}
+	sclk_change = check_sclk_change(tx_frame, length, slot->descriptor.max_sclk_speed, slot);
+	frame_size_change = check_frame_size_change(tx_frame, length, min(slot->descriptor.max_frame_size, slot->buffer_size), slot);
+	if (prepare_frame(slot, tx_frame) != 0) {
+		record.reason = RECORD_LENGTH;
+		goto cleanup;
+	}
+
+	if (fault_disconnect(slot)) {
+		record.reason = RECORD_DISCONNECT;
 		goto cleanup;
 	}
 
 	do {
 		atomic_set(&slot->interrupt_arrived, 0);
-		if (spi_api_exchange(slot, tx_buffer_tmp, dummy_buffer) < 0)
+		if (slot->transfer(slot, tx_frame, dummy_buffer) < 0 && log_error(slot, LOG_LVL_NORMAL))
 			PRINT_SLOT_ERR("Low level spi transfer failed (send)!\n", slot->number);
 		do {
-			if (wait_for_interrupt(slot, wait_timeout) != 0) {
-				if (log_lvl > LOG_LVL_SILENT)
-					PRINT_SLOT_ERR("Interrupt timed out after %d ms!\n", slot->number, wait_timeout);
+			if (wait_for_ready(slot, wait_timeout) != 0) {
+				stats_inc(&slot->stats, STAT_IRQ_TIMEOUTS);
+				if (log_error(slot, log_lvl))
+					PRINT_SLOT_ERR("Interrupt timed out after %d us!\n", slot->number, wait_timeout);
+				record.reason = RECORD_IRQ_TIMEOUT;
 				goto cleanup;
 			}
+			if (wait)
+				stats_add(&slot->stats, STAT_WAIT_US, ktime_us_delta(ktime_get(), wait_start));
 			wait = false;
+			slot->response_irq = atomic64_read(&slot->irq_time);
 			if (!retransmit) {
-				memcpy(tx_buffer_tmp, DUMMY_DUMMY, sizeof(DUMMY_DUMMY));
-				if (prepare_frame(slot, tx_buffer_tmp) != 0) {
-					goto cleanup;
-				}
-
+				prepare_dummy(slot);
 				atomic_set(&slot->interrupt_arrived, 0);
-				if (spi_api_exchange(slot, tx_buffer_tmp, rx_buffer) < 0)
+				if (slot->transfer(slot, slot->dummy_frame, rx_buffer) < 0 && log_error(slot, LOG_LVL_NORMAL))
 					PRINT_SLOT_ERR("Low level spi transfer failed (received)!\n", slot->number);
-				wait_for_interrupt(slot, 3);	// CTS, legacy devices do not trigger an interrupt therefore timeout silently
+				wait_for_interrupt(slot, CTS_TIMEOUT_US);	// CTS, legacy devices do not trigger an interrupt therefore timeout silently
 				atomic_set(&slot->interrupt_arrived, 0);	// Do this after retransmit check
 				length = (dummy_buffer[1] << 8) | dummy_buffer[2];
 				if (check_crc(slot, dummy_buffer, log_lvl) != 0 || length == 0 || length > (slot->frame_size - slot->crc_size)) {
-					if (log_lvl > LOG_LVL_SILENT) {
+					if (log_error(slot, log_lvl)) {
 						PRINT_SLOT_ERR("Dummy invalid because of crc or length issue!\n", slot->number);
 						print_frame(slot, dummy_buffer);
 					}
+					record.reason = RECORD_DUMMY;
 					cleanup_later = true;
 				}
 			} else {
-				memcpy(rx_buffer, dummy_buffer, MAXIMUM_FRAME_SIZE);
+				memcpy(rx_buffer, dummy_buffer, slot->frame_size);
 			}
+			response = true;
+			if (fault_inject(slot, FAULT_RX_CRC))
+				rx_buffer[slot->frame_size - 1] ^= 0xff;	// CRC low byte
 
 			length = (rx_buffer[1] << 8) | rx_buffer[2];
 			if (check_crc(slot, rx_buffer, log_lvl) != 0 || length == 0 || length > (slot->frame_size - slot->crc_size)) {
 				if ((!retransmit)) {
 					PRINT_SLOT_DBG("Retransmit because of CRC error in response!\n", slot->number);
+					stats_inc(&slot->stats, STAT_RETRANSMITS_CRC);
+					record.retransmits_crc++;
+					record.reason = RECORD_CRC;
 					usleep_range(2000, 2500);
-					memcpy(tx_buffer_tmp, DUMMY_DUMMY, sizeof(DUMMY_DUMMY));
+					tx_frame = slot->dummy_frame;
+					prepare_dummy(slot);
 					retransmit = true;
 					break;
 				} else
 					cleanup_later = true;
-				if (log_lvl > LOG_LVL_SILENT) {
+				record.reason = RECORD_CRC;
+				if (log_error(slot, log_lvl)) {
 					PRINT_SLOT_ERR("Response invalid because of crc or length issue!\n", slot->number);
 					print_frame(slot, rx_buffer);
 				}
@@ -352,54 +613,76 @@ int exchange_sdbp(struct Slot *slot, u8 * data, u8 * rx_buffer, u8 log_lvl)
 
 			if (rx_buffer[0] == SDBP_MSG_TYPE_ACKNOWLEDGEMENT && !retransmit) {
 				PRINT_SLOT_DBG("Retransmit message because type is acknowledgement!\n", slot->number);
+				stats_inc(&slot->stats, STAT_RETRANSMITS_ACK);
+				record.retransmits_ack++;
+				record.reason = RECORD_ACK;
 				usleep_range(1000, 1500);
-				memcpy(tx_buffer_tmp, DUMMY_DUMMY, sizeof(DUMMY_DUMMY));
+				tx_frame = slot->dummy_frame;
+				prepare_dummy(slot);
 				retransmit = true;
 				break;
 			}
 
+			if (!cleanup_later && fault_inject(slot, FAULT_TRANSACTION_ERROR)) {
+				rx_buffer[0] = SDBP_MSG_TYPE_RESPONSE;
+				rx_buffer[4] = SDBP_CLASSID_CORE;
+				rx_buffer[5] = SDBP_C_TRANSACTION_ERROR;
+				rx_buffer[6] = SDBP_C_TRANSACTION_ERROR_FRAME_CRC;
+			}
+
 			if (cleanup_later) {
-				if (log_lvl > LOG_LVL_SILENT)
+				if (log_error(slot, log_lvl))
 					PRINT_SLOT_ERR("Transmission aborted because of previous error(s)!\n", slot->number);
 				goto cleanup;
 			}
 
 			if (rx_buffer[0] != SDBP_MSG_TYPE_RESPONSE) {
-				if (log_lvl > LOG_LVL_SILENT) {
+				if (log_error(slot, log_lvl)) {
 					PRINT_SLOT_ERR("Received message type is wrong (not 0x02)!\n", slot->number);
 					print_frame(slot, rx_buffer);
 				}
+				// A second acknowledgement after the retransmit
+				record.reason = rx_buffer[0] == SDBP_MSG_TYPE_ACKNOWLEDGEMENT ? RECORD_ACK : RECORD_MESSAGE_TYPE;
 				goto cleanup;
 			} else {
 				if (rx_buffer[4] == SDBP_CLASSID_CORE && rx_buffer[5] == SDBP_C_TRANSACTION_ERROR) {
+					stats_inc(&slot->stats, transaction_error_stat(rx_buffer[6]));
+					record.reason = RECORD_TRANSACTION_ERROR;
+					if (!log_error(slot, log_lvl))
+						goto cleanup;
 					if (rx_buffer[6] == SDBP_C_TRANSACTION_ERROR_FRAME_CRC) {
-						if (log_lvl > LOG_LVL_SILENT)
-							PRINT_SLOT_ERR("Last message received by device with CRC error!\n", slot->number);
+						PRINT_SLOT_ERR("Last message received by device with CRC error!\n", slot->number);
 					} else {
-						if (log_lvl > LOG_LVL_SILENT) {
-							char error[100];
-							if (rx_buffer[6] == SDBP_C_TRANSACTION_ERROR_MESSAGE_TYPE_INVALID)
-								strncpy(error, "MESSAGE_TYPE_INVALID\0", sizeof(error));
-							else if (rx_buffer[6] == SDBP_C_TRANSACTION_ERROR_CLASS_IDENTIFIER_INVALID)
-								strncpy(error, "CLASS_IDENTIFIER_INVALID\0", sizeof(error));
-							else if (rx_buffer[6] == SDBP_C_TRANSACTION_ERROR_CLASS_INVALID)
-								strncpy(error, "CLASS_INVALID\0", sizeof(error));
-							else if (rx_buffer[6] == SDBP_C_TRANSACTION_ERROR_DATA_LENGTH_INVALID)
-								strncpy(error, "DATA_LENGTH_INVALID\0", sizeof(error));
-							else if (rx_buffer[6] == SDBP_C_TRANSACTION_ERROR_DEVICE_WRONG_MODE)
-								strncpy(error, "DEVICE_WRONG_MODE\0", sizeof(error));
-							else
-								strncpy(error, "UNKNOWN", sizeof(error));
-							PRINT_SLOT_ERR("Last message received by device with transaction error! (%s)\n", slot->number, error);
-						}
+						char error[100];
+						if (rx_buffer[6] == SDBP_C_TRANSACTION_ERROR_MESSAGE_TYPE_INVALID)
+							strncpy(error, "MESSAGE_TYPE_INVALID\0", sizeof(error));
+						else if (rx_buffer[6] == SDBP_C_TRANSACTION_ERROR_CLASS_IDENTIFIER_INVALID)
+							strncpy(error, "CLASS_IDENTIFIER_INVALID\0", sizeof(error));
+						else if (rx_buffer[6] == SDBP_C_TRANSACTION_ERROR_CLASS_INVALID)
+							strncpy(error, "CLASS_INVALID\0", sizeof(error));
+						else if (rx_buffer[6] == SDBP_C_TRANSACTION_ERROR_DATA_LENGTH_INVALID)
+							strncpy(error, "DATA_LENGTH_INVALID\0", sizeof(error));
+						else if (rx_buffer[6] == SDBP_C_TRANSACTION_ERROR_DEVICE_WRONG_MODE)
+							strncpy(error, "DEVICE_WRONG_MODE\0", sizeof(error));
+						else
+							strncpy(error, "UNKNOWN", sizeof(error));
+						PRINT_SLOT_ERR("Last message received by device with transaction error! (%s)\n", slot->number, error);
 					}
 
-					if (log_lvl > LOG_LVL_SILENT)
-						print_frame(slot, rx_buffer);
+					print_frame(slot, rx_buffer);
 					goto cleanup;
 				}
 			}
 
+			injected_wait_us = fault_wait_us(slot);
+			if (injected_wait_us) {
+				// Costs the same time as a device WAIT, the response itself is kept
+				stats_inc(&slot->stats, STAT_WAIT_REQUESTS);
+				stats_add(&slot->stats, STAT_WAIT_US, injected_wait_us);
+				record.waits++;
+				fsleep(injected_wait_us);
+			}
+
 			if ((rx_buffer[4] == 0x03) && (rx_buffer[5] == 0x03) && (length > 6)) {
 				PRINT_SLOT_DBG("Recv PWR_MGMT %d\n", slot->number, rx_buffer[6]);
 			}
@@ -407,108 +690,77 @@ int exchange_sdbp(struct Slot *slot, u8 * data, u8 * rx_buffer, u8 log_lvl)
 			if (rx_buffer[4] == SDBP_CLASSID_CORE && rx_buffer[5] == SDBP_C_WAIT && rx_buffer[6] == SDBP_C_WAIT_WAIT && length == 11) {
 				wait_timeout = rx_buffer[7] << 24 | rx_buffer[8] << 16 | rx_buffer[9] << 8 | rx_buffer[10];
 				wait = true;
-				wait_timeout = wait_timeout / 1000;
-				PRINT_SLOT_DBG("Device requested wait time: %dms", slot->number, wait_timeout);
+				wait_start = ktime_get();
+				stats_inc(&slot->stats, STAT_WAIT_REQUESTS);
+				record.waits++;
+				PRINT_SLOT_DBG("Device requested wait time: %dus", slot->number, wait_timeout);
+				// The SPI controller is not locked between frames, other slots on the bus transfer meanwhile
+				wait_timeout = min_t(u64, (u64) wait_timeout + WAIT_MARGIN_US, U32_MAX);
 			} else {
 				if (sclk_change > 0)
 					change_sclk(rx_buffer, length, sclk_change, slot);
 				if (frame_size_change > 0)
 					change_frame_size(rx_buffer, length, frame_size_change, slot);
 				if (update_descriptor(rx_buffer, length, slot) < 0) {
-					if (log_lvl > LOG_LVL_SILENT)
+					if (log_error(slot, log_lvl))
 						PRINT_SLOT_ERR("Updating descriptor failed!\n", slot->number);
+					record.reason = RECORD_DESCRIPTOR;
 					goto cleanup;
 				}
 			}
 			retransmit = false;
 		} while (wait);
 	} while (retransmit);
-	kfree(dummy_buffer);
-	kfree(tx_buffer_tmp);
+	stats_add(&slot->stats, STAT_RX_PAYLOAD_BYTES, length > 4 ? length - 4 : 0);
+	if (rx_buffer[3] == SDBP_OPTION_BYTE_NOTIFICATION_PENDING)
+		atomic64_cmpxchg(&slot->announce_time, 0, slot->response_irq);
+	record_exchange(slot, &record, start, data, rx_buffer, 0);
 	return 0;
  cleanup:
-	kfree(tx_buffer_tmp);
-	kfree(dummy_buffer);
-	slot->session_stats.transmission_errors++;
+	stats_inc(&slot->stats, STAT_TRANSACTIONS_FAILED);
+	record_exchange(slot, &record, start, data, response ? rx_buffer : NULL, -1);
 	return -1;
 }
+EXPORT_FOR_KUNIT(exchange_sdbp);
 
 int init_slot(struct Slot *slot)
 {
 	u8 ret;
-	struct spi_master *master;
 	int irq_number;
-	int i;
-	int TRIES = 20;
-	//Register information about your slave device:
-	struct spi_board_info spi_device_info = {
-		.modalias = "sdbpk",
-		.max_speed_hz = slot->speed_sclk,	//speed your device (slave) can handle
-		.bus_num = slot->spi_bus,
-		.chip_select = slot->spi_chip_select,
-		.mode = 0,
-	};
-	ret = 0;
-	for (i = 0; i < TRIES; i++) {
-		msleep_interruptible(1000);
-		master = spi_busnum_to_master(spi_device_info.bus_num);
-		if (!master) {
-			PRINT_SLOT_ERR("SPI bus %d not found.\n", slot->number, slot->spi_bus);
-			ret = -ENODEV;
-			continue;
-		}
-		// create a new slave device, given the master and device info
-		slot->spi_device = spi_new_device(master, &spi_device_info);
-		if (!slot->spi_device) {
-			PRINT_SLOT_DBG("Failed to create SPI slave %d %d.\n", slot->number, slot->spi_bus, slot->spi_chip_select);
-			ret = -ENODEV;
-			continue;
-		}
-		ret = 0;
-		break;
-	}
 
-	if (ret != 0) {
-		PRINT_SLOT_ERR("Failed to find SPI bus.cs %d.%d after %d attempts.\n", slot->number, slot->spi_bus, slot->spi_chip_select, i);
-		return ret;
-	} else {
-		PRINT_SLOT_DBG("Found SPI bus.cs %d.%d after %d attempts.\n", slot->number, slot->spi_bus, slot->spi_chip_select, i);
-	}
+	PRINT_SLOT_DBG("Found SPI bus.cs %d.%d.\n", slot->number, slot->spi_bus, slot->spi_chip_select);
 
+	slot->spi_device->max_speed_hz = slot->speed_sclk;
+	slot->spi_device->mode = 0;
 	slot->spi_device->bits_per_word = 8;
 	ret = spi_setup(slot->spi_device);
 	if (ret) {
 		PRINT_SLOT_ERR("Failed to setup SPI slave!\n", slot->number);
-		spi_unregister_device(slot->spi_device);
 		return -ENODEV;
 	}
 
 	{			// GPIO init
 		if (gpio_request(slot->interrupt_pin, "sysfs") != 0) {
-			spi_unregister_device(slot->spi_device);
 			PRINT_SLOT_ERR("Failed to request GPIO!\n", slot->number);
 			return -EIO;
 		}
 		if (gpio_direction_input(slot->interrupt_pin) != 0 || gpio_export(slot->interrupt_pin, false) != 0) {
-			spi_unregister_device(slot->spi_device);
 			gpio_free(slot->interrupt_pin);
 			PRINT_SLOT_ERR("Failed to set GPIO input!\n", slot->number);
 			return -EIO;
 		}
 
 		irq_number = gpio_to_irq(slot->interrupt_pin);
-		if (request_irq(irq_number, gpio_rising_interrupt, IRQF_TRIGGER_FALLING | IRQF_ONESHOT, "gpio_rising", NULL)) {
+		if (request_irq(irq_number, gpio_rising_interrupt, IRQF_TRIGGER_FALLING | IRQF_ONESHOT, "gpio_rising", slot)) {
 			PRINT_SLOT_ERR("Failed requesting IRQ %d!", slot->number, irq_number);
 			gpio_unexport(slot->interrupt_pin);
 			gpio_free(slot->interrupt_pin);
-			spi_unregister_device(slot->spi_device);
 			return (-EIO);
 		} else {
 			slot->irq_number = irq_number;
 		}
 	}
 
-	init_waitqueue_head(&slot->queue);
 	PRINT_SLOT_NORM("connected to bus:%d cs:%d int:%d\n", slot->number, slot->spi_bus, slot->spi_chip_select, slot->interrupt_pin);
 	slot->valid = 1;
 	return 0;
@@ -3,30 +3,44 @@
 
 #include "sdbp.h"
 
-struct ErrorStatistics {
-	u32 transmission_errors;
-	u32 notifications;
-	u32 notifications_failed;
-	u32 descriptor_failed;
-};
+struct notification;
 
 int exchange_sdbp(struct Slot *slot, u8 * data, u8 * rx_buffer, u8 log_lvl);
 int receive_notification(struct Slot *slot, u8 * data, u8 * rx_buffer, u8 log_lvl);
 int init_slot(struct Slot *slot);
 ssize_t spi_api_exchange(struct Slot *slot, u8 * tx_buffer, u8 * rx_buffer);
 void print_struct(struct Slot *slot);
-int wait_for_interrupt(struct Slot *slot, u16 timeout_ms);
+int wait_for_interrupt(struct Slot *slot, u32 timeout_us);
 int prepare_frame(struct Slot *slot, u8 * data);
+void prepare_dummy(struct Slot *slot);
+void release_messages(struct Slot *slot);
 void print_frame(struct Slot *slot, u8 * data);
 int check_crc(struct Slot *slot, u8 * data, u8 log_lvl);
 int get_notification(struct Slot *slot);
+int drain_notifications(struct Slot *slot);
+int notification_queue_init(struct notification *notification, u32 size);
+void notification_queue_free(struct notification *notification);
+size_t notification_queue_size(struct notification *notification);
+void notification_queue_reset(struct notification *notification, int length);
+int notification_pop(struct notification *notification);
+int init_padding(void);
+void free_padding(void);
 int sync_com(struct Slot *slot);
+int check_frame_size_change(u8 * data, u16 length, u32 max_frame_size, struct Slot *slot);
+int change_frame_size(u8 * data, u16 length, u32 max_frame_size, struct Slot *slot);
+int check_sclk_change(u8 * data, u16 length, u32 max_speed_khz, struct Slot *slot);
+int change_sclk(u8 * data, u16 length, u32 speed_khz, struct Slot *slot);
+int update_descriptor(u8 * data, u16 length, struct Slot *slot);
 
 #define DEFAULT_FRAME_SIZE 64
 #define DEFAULT_SCLK_SPEED 100000	//kHz
 #define DEFAULT_CRC_SIZE 2
 #define CRC32_SIZE 4
 #define MAXIMUM_FRAME_SIZE 4096	// >4096 not implemented!
+#define READY_TIMEOUT_US 250000	// Operation frame until the device is ready
+#define CTS_TIMEOUT_US 3000
+#define WAIT_MARGIN_US 200	// Added to a device WAIT for the interrupt latency
+#define NOTIFICATION_DRAIN_MAX 16	// Back to back notification fetches per bus ownership
 
 #define LOG_LVL_SILENT 0
 #define LOG_LVL_NORMAL 1
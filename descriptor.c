@@ -8,19 +8,13 @@
 
 void print_descriptor(struct Slot *slot, struct Descriptor *descriptor_sdbp)
 {
-	u8 *tmp_buffer;
+	struct descriptor_strings *strings = rcu_dereference_protected(descriptor_sdbp->strings, 1);
+	u8 tmp_buffer[16 * 2 + 7 + 1];
 	int char_cnt;
 
-	tmp_buffer = kcalloc(MAXIMUM_FRAME_SIZE, sizeof(u8), GFP_KERNEL);
-
-	char_cnt = snprintf(tmp_buffer, descriptor_sdbp->vendor_product_id_len, (u8 *) descriptor_sdbp->vendor_product_id);
-	PRINT_SLOT_NORM("Vendor product id: %s", slot->number, tmp_buffer);
-
-	char_cnt = snprintf(tmp_buffer, descriptor_sdbp->vendor_name_len, (u8 *) descriptor_sdbp->vendor_name);
-	PRINT_SLOT_NORM("Vendor name: %s", slot->number, tmp_buffer);
-
-	char_cnt = snprintf(tmp_buffer, descriptor_sdbp->product_name_len, (u8 *) descriptor_sdbp->product_name);
-	PRINT_SLOT_NORM("Product name: %s", slot->number, tmp_buffer);
+	PRINT_SLOT_NORM("Vendor product id: %s", slot->number, descriptor_string(strings, DESCRIPTOR_STRING_VENDOR_PRODUCT_ID));
+	PRINT_SLOT_NORM("Vendor name: %s", slot->number, descriptor_string(strings, DESCRIPTOR_STRING_VENDOR_NAME));
+	PRINT_SLOT_NORM("Product name: %s", slot->number, descriptor_string(strings, DESCRIPTOR_STRING_PRODUCT_NAME));
 
 	PRINT_SLOT_NORM
 	    ("Protocol/Hardware/Firmware version: %d.%d.%d/%d.%d.%d/%c.%d.%d.%d",
@@ -39,7 +33,7 @@ void print_descriptor(struct Slot *slot, struct Descriptor *descriptor_sdbp)
 	PRINT_SLOT_NORM("Maximum power 3V3/5V0/12V: %d/%d/%d mW", slot->number,
 			descriptor_sdbp->max_power_3v3, descriptor_sdbp->max_power_5v0, descriptor_sdbp->max_power_12v);
 
-	char_cnt = snprintf(tmp_buffer, 16 * 2 + 7 + 1,
+	char_cnt = snprintf(tmp_buffer, sizeof(tmp_buffer),
 			    "%02X%02X-%02X%02X-%02X%02X-%02X%02X-%02X%02X-%02X%02X-%02X%02X-%02X%02X",
 			    descriptor_sdbp->serial_code[0],
 			    descriptor_sdbp->serial_code[1],
@@ -67,25 +61,146 @@ void print_descriptor(struct Slot *slot, struct Descriptor *descriptor_sdbp)
 		PRINT_SLOT_NORM("Bootloader state: Device in bootloader mode (%d)", slot->number, descriptor_sdbp->bootloader_state);
 	else
 		PRINT_SLOT_NORM("Bootloader state: (%d)", slot->number, descriptor_sdbp->bootloader_state);
+}
+
+// fields holds DESCRIPTOR_STRING_CNT strings of DESCRIPTOR_STRING_MAX bytes
+static struct descriptor_strings *alloc_strings(const u8 * fields, const u8 * lengths)
+{
+	struct descriptor_strings *strings;
+	size_t size = 0;
+	u8 *pos;
+	int i;
+
+	for (i = 0; i < DESCRIPTOR_STRING_CNT; i++)
+		size += lengths[i] + 1;
+	strings = kmalloc(struct_size(strings, data, size), GFP_KERNEL);
+	if (!strings)
+		return NULL;
+
+	pos = strings->data;
+	for (i = 0; i < DESCRIPTOR_STRING_CNT; i++) {
+		strings->length[i] = lengths[i];
+		strings->offset[i] = pos - strings->data;
+		memcpy(pos, fields + i * DESCRIPTOR_STRING_MAX, lengths[i]);
+		pos[lengths[i]] = '\0';
+		pos += lengths[i] + 1;
+	}
+	return strings;
+}
+
+// descriptor and descriptor_old may share their strings
+void free_descriptor_strings(struct Slot *slot)
+{
+	struct descriptor_strings *strings = rcu_dereference_protected(slot->descriptor.strings, 1);
+	struct descriptor_strings *strings_old = rcu_dereference_protected(slot->descriptor_old.strings, 1);
+
+	if (strings_old != strings)
+		kfree(strings_old);
+	kfree(strings);
+	RCU_INIT_POINTER(slot->descriptor.strings, NULL);
+	RCU_INIT_POINTER(slot->descriptor_old.strings, NULL);
+}
 
-	kfree(tmp_buffer);
+size_t descriptor_strings_size(struct Slot *slot)
+{
+	struct descriptor_strings *strings;
+	struct descriptor_strings *strings_old;
+	size_t size = 0;
+
+	rcu_read_lock();
+	strings = rcu_dereference(slot->descriptor.strings);
+	strings_old = rcu_dereference(slot->descriptor_old.strings);
+	if (strings)
+		size += ksize(strings);
+	if (strings_old && strings_old != strings)
+		size += ksize(strings_old);
+	rcu_read_unlock();
+	return size;
 }
 
+/*
+ * Fetches a chained descriptor field: the request is repeated until the device clears the chaining byte,
+ * the chunks are appended to data. Returns the total length, -1 on exchange errors or -2 if the device returned
+ * the descriptor error code. rx_buffer holds the last response.
+ */
+int get_chained(struct Slot *slot, u8 * request, u8 * rx_buffer, u8 * data, u16 size, u8 log_lvl)
+{
+	u16 pos = 0;
+	u16 frame_length;
+	u8 chaining;
+	u8 length;
+
+	do {
+		if (exchange_sdbp(slot, request, rx_buffer, log_lvl) != 0)
+			return -1;
+
+		if (rx_buffer[6] == DESCRIPTOR_ERROR_CODE) {
+			PRINT_SLOT_DBG("Descriptor error code returned!", slot->number);
+			return -2;
+		}
+
+		frame_length = (rx_buffer[1] << 8) | rx_buffer[2];
+		chaining = rx_buffer[7];
+		length = rx_buffer[8];
+		if (chaining != 0 || pos != 0)
+			PRINT_SLOT_DBG("Chained field %#02x: chaining: %d length %d", slot->number, request[6], chaining, length);
+		if (pos + length > size) {
+			PRINT_SLOT_ERR("Chained field %#02x exceeds %d bytes!\n", slot->number, request[6], size);
+			return -1;
+		}
+		if (9 + length > frame_length) {
+			PRINT_SLOT_ERR("Chained field %#02x: chunk of %d bytes exceeds the response!\n", slot->number, request[6], length);
+			return -1;
+		}
+		memcpy(data + pos, rx_buffer + 9, length);
+		pos += length;
+	} while (chaining != 0);
+
+	return pos;
+}
+
+// Descriptor GETs answered in chained chunks: VENDOR_PRODUCT_ID, VENDOR_NAME and PRODUCT_NAME
+bool is_chained_request(u8 * data)
+{
+	u16 length = (data[1] << 8) | data[2];
+
+	return length == 7 && data[4] == SDBP_CLASSID_CORE && data[5] == 0x02 && (data[6] == 0x02 || data[6] == 0x09 || data[6] == 0x0A);
+}
+
+static const u8 *const STRING_REQUESTS[DESCRIPTOR_STRING_CNT] = {
+	[DESCRIPTOR_STRING_VENDOR_PRODUCT_ID] = DESCRIPTOR_GET_VENDOR_PRODUCT_ID,
+	[DESCRIPTOR_STRING_VENDOR_NAME] = DESCRIPTOR_GET_VENDOR_NAME,
+	[DESCRIPTOR_STRING_PRODUCT_NAME] = DESCRIPTOR_GET_PRODUCT_NAME,
+};
+
 int get_descriptor(struct Slot *slot, struct Descriptor *descriptor_sdbp, u8 force, u32 old_rid)
 {
+	struct descriptor_strings *strings = rcu_dereference_protected(slot->descriptor_old.strings, 1);
+	u8 lengths[DESCRIPTOR_STRING_CNT];
+	u8 *fields;
 	u8 *rx_buffer;
 	u8 i;
 	u16 length;
-	u8 chaining;
-	u8 pos_cnt;
 	u32 rand;
-	bool chaining_active;
+	int ret;
 	slot->descriptor_old = slot->descriptor;
+	// Strings only referenced by the previous descriptor_old
+	if (strings != rcu_dereference_protected(slot->descriptor.strings, 1))
+		kfree_rcu(strings, rcu);
 	atomic_inc(&descriptor_sdbp->is_valid);
+	// Odd while the descriptor is written, descriptor_bin readers use descriptor_old meanwhile
+	smp_mb__before_atomic();
+	atomic_inc(&slot->descriptor_gen);
+	smp_mb__after_atomic();
 
-	rx_buffer = kcalloc(MAXIMUM_FRAME_SIZE, sizeof(u8), GFP_KERNEL);	// Allocate memory
+	fields = kmalloc(DESCRIPTOR_STRING_CNT * DESCRIPTOR_STRING_MAX, GFP_KERNEL);
 	if (!force)
-		atomic_set(&slot->write_count, 0);
+		bus_acquire(&slot->bus, BUS_PRIO_NOTIFICATION);
+	// Own buffer, update_descriptor() reads the descriptor within an exchange whose response is still used
+	rx_buffer = slot->descriptor_buffer;
+
+	if (!fields)
+		goto cleanup;
 
 	if (exchange_sdbp(slot, (u8 *) DESCRIPTOR_GET_PROTOCOL_VERSION, rx_buffer, LOG_LVL_SILENT) != 0)
 		goto cleanup;
@@ -112,87 +227,17 @@ int get_descriptor(struct Slot *slot, struct Descriptor *descriptor_sdbp, u8 for
 		goto cleanup;
 	}
 
-	chaining = 1;
-	pos_cnt = 0;
-	chaining_active = false;
-	descriptor_sdbp->vendor_product_id_len = 0;
-	while (chaining != 0) {
-		if (exchange_sdbp(slot, (u8 *) DESCRIPTOR_GET_VENDOR_PRODUCT_ID, rx_buffer, LOG_LVL_SILENT) != 0)
+	for (i = 0; i < DESCRIPTOR_STRING_CNT; i++) {
+		ret = get_chained(slot, (u8 *) STRING_REQUESTS[i], rx_buffer, fields + i * DESCRIPTOR_STRING_MAX, DESCRIPTOR_STRING_MAX, LOG_LVL_SILENT);
+		if (ret < 0)
 			goto cleanup;
-
-		if (rx_buffer[6] == DESCRIPTOR_ERROR_CODE) {
-			PRINT_SLOT_DBG("Descriptor error code returned!", slot->number);
-			goto cleanup;
-		}
-
-		chaining = rx_buffer[7];
-		length = rx_buffer[8];
-		if (chaining != 0 && chaining_active == false)
-			chaining_active = true;
-		if (chaining_active)
-			PRINT_SLOT_DBG("VENDOR_PRODUCT_ID: chaining: %d length %d", slot->number, chaining, length);
-		descriptor_sdbp->vendor_product_id_len = descriptor_sdbp->vendor_product_id_len + length;
-
-		for (i = 0; i < length; i++) {
-			descriptor_sdbp->vendor_product_id[i + pos_cnt] = rx_buffer[i + 9];
-		}
-		pos_cnt += length;
-	}
-
-	chaining = 1;
-	pos_cnt = 0;
-	chaining_active = false;
-	descriptor_sdbp->vendor_name_len = 0;
-	while (chaining != 0) {
-		if (exchange_sdbp(slot, (u8 *) DESCRIPTOR_GET_VENDOR_NAME, rx_buffer, LOG_LVL_SILENT)
-		    != 0)
-			goto cleanup;
-
-		if (rx_buffer[6] == DESCRIPTOR_ERROR_CODE) {
-			PRINT_SLOT_DBG("Descriptor error code returned!", slot->number);
-			goto cleanup;
-		}
-
-		chaining = rx_buffer[7];
-		length = rx_buffer[8];
-		if (chaining != 0 && chaining_active == false)
-			chaining_active = true;
-		if (chaining_active)
-			PRINT_SLOT_DBG("VENDOR_NAME: chaining: %d length %d", slot->number, chaining, length);
-		descriptor_sdbp->vendor_name_len = descriptor_sdbp->vendor_name_len + length;
-
-		for (i = 0; i < length; i++) {
-			descriptor_sdbp->vendor_name[i + pos_cnt] = rx_buffer[i + 9];
-		}
-		pos_cnt += length;
-	}
-
-	chaining = 1;
-	pos_cnt = 0;
-	chaining_active = false;
-	descriptor_sdbp->product_name_len = 0;
-	while (chaining != 0) {
-		if (exchange_sdbp(slot, (u8 *) DESCRIPTOR_GET_PRODUCT_NAME, rx_buffer, LOG_LVL_SILENT)
-		    != 0)
-			goto cleanup;
-
-		if (rx_buffer[6] == DESCRIPTOR_ERROR_CODE) {
-			PRINT_SLOT_DBG("Descriptor error code returned!", slot->number);
-			goto cleanup;
-		}
-		chaining = rx_buffer[7];
-		length = rx_buffer[8];
-		if (chaining != 0 && chaining_active == false)
-			chaining_active = true;
-		if (chaining_active)
-			PRINT_SLOT_DBG("PRODUCT_NAME: chaining: %d length %d", slot->number, chaining, length);
-		descriptor_sdbp->product_name_len = descriptor_sdbp->product_name_len + length;
-
-		for (i = 0; i < length; i++) {
-			descriptor_sdbp->product_name[i + pos_cnt] = rx_buffer[i + 9];
-		}
-		pos_cnt += length;
+		lengths[i] = ret;
 	}
+	strings = alloc_strings(fields, lengths);
+	if (!strings)
+		goto cleanup;
+	// The previous strings stay referenced by descriptor_old
+	rcu_assign_pointer(descriptor_sdbp->strings, strings);
 
 	if (exchange_sdbp(slot, (u8 *) DESCRIPTOR_GET_HW_VERSION, rx_buffer, LOG_LVL_SILENT) != 0)
 		goto cleanup;
@@ -369,14 +414,20 @@ int get_descriptor(struct Slot *slot, struct Descriptor *descriptor_sdbp, u8 for
 		print_descriptor(slot, descriptor_sdbp);
 
 	atomic_dec(&descriptor_sdbp->is_valid);
-	kfree(rx_buffer);
+	smp_mb__before_atomic();
+	atomic_inc(&slot->descriptor_gen);
+	kfree(fields);
 	if (!force)
-		atomic_set(&slot->write_count, -1);
+		bus_release(&slot->bus);
 	return 0;
 
  cleanup:
-	slot->session_stats.descriptor_failed++;
-	kfree(rx_buffer);
+	if (!force)
+		bus_release(&slot->bus);
+	stats_inc(&slot->stats, STAT_DESCRIPTOR_FAILED);
+	kfree(fields);
 	atomic_dec(&descriptor_sdbp->is_valid);
+	smp_mb__before_atomic();
+	atomic_inc(&slot->descriptor_gen);
 	return -1;
 }
@@ -1,8 +1,23 @@
 #ifndef DESCRIPTOR_H_
 #define DESCRIPTOR_H_
 
+#include <linux/hrtimer.h>
+#include <linux/spi/spi.h>
+#include <linux/kthread.h>
+#include <linux/cpumask.h>
+#include <linux/mutex.h>
+#include <linux/kfifo.h>
+#include <linux/rcupdate.h>
+#include <linux/ratelimit.h>
+#include <linux/debugfs.h>
 #include "sdbp.h"
 #include "communication.h"
+#include "bus_owner.h"
+#include "recorder.h"
+#include "fault.h"
+#include "stats.h"
+#include "response_cache.h"
+#include "firmware.h"
 
 struct Version {
 	u8 stability;
@@ -12,25 +27,56 @@ struct Version {
 };
 
 struct notification {
-	atomic_t length;
-	u8 data[PAGE_SIZE];	// sysfs max. size is PAGE_SIZE
+	atomic_t length;	// Payload length of the oldest queued notification, -1 after a disconnect
+	u8 *data;		// PAGE_SIZE, sysfs max. size is PAGE_SIZE
+	struct kfifo_rec_ptr_2 queue;	// Payloads in arrival order, the oldest are dropped when full
+	spinlock_t queue_lock;
+	u8 *rx_buffer;		// Notification exchanges, used while the bus is owned
+	u8 *record;		// Header and payload of a received notification, used while the bus is owned
+	u32 sequence;
 	wait_queue_head_t wait_for_notification;
 	atomic_t lock;
 };
 
+// Timestamps of the last write
+struct transaction_time {
+	ktime_t start;
+	ktime_t response;	// Interrupt of the response
+	ktime_t end;
+};
+
+enum descriptor_string {
+	DESCRIPTOR_STRING_VENDOR_PRODUCT_ID,
+	DESCRIPTOR_STRING_VENDOR_NAME,
+	DESCRIPTOR_STRING_PRODUCT_NAME,
+	DESCRIPTOR_STRING_CNT,
+};
+
+#define DESCRIPTOR_STRING_MAX 255
+
+#define FRAME_BUFFER_CNT 7	// Per-slot buffers of buffer_size bytes
+
+// Chained descriptor strings in one allocation of their actual size, replaced as a whole and freed after an RCU grace period
+struct descriptor_strings {
+	struct rcu_head rcu;
+	u8 length[DESCRIPTOR_STRING_CNT];	// As returned by the device, the null byte included
+	u16 offset[DESCRIPTOR_STRING_CNT];
+	u8 data[];		// Null terminated strings
+};
+
+static inline const u8 *descriptor_string(const struct descriptor_strings *strings, enum descriptor_string id)
+{
+	return strings->data + strings->offset[id];
+}
+
 struct Descriptor {
-	u8 vendor_product_id[256];
-	u8 vendor_product_id_len;
+	struct descriptor_strings __rcu *strings;	// NULL until the first descriptor was read
 	u8 serial_code[16];
 	struct Version fw_version;
 	struct Version hw_version;
 	u32 max_sclk_speed;
 	u32 max_frame_size;
 	struct Version protocol_version;
-	u8 vendor_name[256];
-	u8 vendor_name_len;
-	u8 product_name[256];
-	u8 product_name_len;
 	u8 bootloader_state;
 	u32 max_power_3v3;
 	u32 max_power_5v0;
@@ -39,8 +85,16 @@ struct Descriptor {
 	atomic_t is_valid;
 };
 
+// Persistent single transfer message of the dummy frame, frame_size 0 means not prepared
+struct sdbp_message {
+	struct spi_message msg;
+	struct spi_transfer xfer;
+	u32 frame_size;
+	u32 speed_sclk;
+};
+
 struct Slot {
-	u8 number;
+	int number;
 	u8 valid;
 	u32 speed_sclk;
 	u32 frame_size;
@@ -48,28 +102,68 @@ struct Slot {
 	u8 spi_bus;
 	u8 spi_chip_select;
 	u8 cs_pin_alt;
-	u8 interrupt_pin;
+	int interrupt_pin;
 	int irq_number;
 	struct spi_device *spi_device;
+	ssize_t (*transfer)(struct Slot *slot, u8 * tx_buffer, u8 * rx_buffer);	// One unpadded frame plus tx_crc, spi_api_exchange() or a mock
 	atomic_t interrupt_arrived;
 	atomic_t notification_arrived;
 	wait_queue_head_t queue;
-	struct task_struct *thread;
+	atomic_t link_state;
+	struct hrtimer link_timer;
+	ktime_t link_low_since;
+	struct delayed_work work;
+	struct kthread_worker *worker;	// Dedicated RT worker, the shared workqueue is used while NULL
+	struct kthread_delayed_work rt_work;
+	struct mutex work_lock;	// Serializes the state machine while it moves to the RT worker
+	struct mutex sched_lock;	// Protects worker, rt_priority and cpus
+	int rt_priority;
+	cpumask_var_t cpus;	// Worker and IRQ affinity, empty means all CPUs
+	atomic64_t irq_time;	// ktime of the last interrupt
+	atomic64_t announce_time;	// ktime the next notification was announced, 0 if unknown
+	ktime_t response_irq;	// Interrupt of the last response, set by exchange_sdbp()
+	struct transaction_time last_transaction;
+	atomic64_t kick_time;	// ktime of the first pending kick, 0 if none
+	u32 sched_latency_us_max;
+	u32 resume_us_max;	// Written by the runtime PM callbacks, which never run concurrently
+	struct delayed_work close_work;
+	u32 keepalive_ms;
+	enum slot_state state;
+	u8 debounce_cnt;
+	u8 tx_err_cnt;
+	u8 was_connected;
 	struct device *sdbp_device;
 	struct Descriptor descriptor;
 	struct Descriptor descriptor_old;
+	atomic_t descriptor_gen;	// Incremented before and after every descriptor update
+	u32 buffer_size;	// Size of the FRAME_BUFFER_CNT frame buffers, the largest frame size of the connection
 	u8 *tx_buffer;
 	u8 *rx_buffer;
+	u8 *tx_frame;		// Copy of constant requests
+	u8 *tx_crc;
+	u8 *dummy_frame;	// Padded dummy frame incl. CRC, see prepare_dummy()
+	u8 *dummy_buffer;
+	u8 *descriptor_buffer;	// Descriptor reads and sync_com(), used while the bus is owned
+	u32 dummy_frame_size;
+	struct sdbp_message dummy_msg[2];	// Dummy frame into rx_buffer and into dummy_buffer
 	u16 rx_len;
 	u16 tx_len;
 	wait_queue_head_t wait_queue_for_read;
-	wait_queue_head_t wait_queue_for_write;
 	atomic_t access_count;
-	atomic_t write_count;
+	atomic_t users;		// References of get_slot_ref()
+	wait_queue_head_t users_wait;
+	struct bus_owner bus;
 	atomic_t stop;
 	struct notification notification;
 	struct completion dev_obj_is_free;
-	struct ErrorStatistics session_stats;
+	struct sdbp_stats stats;
+	struct response_cache cache;
+	struct firmware_upload fw;
+	bool pm_resuming;	// The worker holds a usage count and waits for the resume it requested
+	struct frame_recorder recorder;
+	struct ratelimit_state print_limit;	// Error prints of the exchange path
+	struct dentry *debugfs;
+	struct slot_faults faults;
 };
 
 static const u8 DESCRIPTOR_GET_VENDOR_PRODUCT_ID[] = { 0x01, 0x00, 0x07, 0x00, 0x01, 0x02, 0x02 };
@@ -90,11 +184,16 @@ static const u8 DESCRIPTOR_ERROR_CODE = 0x01;
 
 static const u8 CONTROL_SET_FRAME_SIZE_DEFAULT[] = { 0x01, 0x00, 0x09, 0x00, 0x01, 0x03, 0x07, 0x00, 64 };
 static const u8 CONTROL_SET_MODE_SUSPEND[] = { 0x01, 0x00, 0x07, 0x00, 0x01, 0x03, 0x02 };
+static const u8 CONTROL_SET_MODE_RUN[] = { 0x01, 0x00, 0x07, 0x00, 0x01, 0x03, 0x03 };
 static const u8 CONTROL_UPDATE_DESCRIPTOR[] = { 0x01, 0x00, 0x07, 0x00, 0x01, 0x03, 0x09 };
 
 static const u8 DUMMY_DUMMY[] = { 0x04, 0x00, 0x07, 0x00, 0x01, 0x04, 0x01 };
 static const u8 NOTIFICATION[] = { 0x01, 0x00, 0x07, 0x00, 0x01, 0x06, 0x02 };
 
 int get_descriptor(struct Slot *slot, struct Descriptor *descriptor, u8 force, u32 old_rid);
+void free_descriptor_strings(struct Slot *slot);
+size_t descriptor_strings_size(struct Slot *slot);
+int get_chained(struct Slot *slot, u8 * request, u8 * rx_buffer, u8 * data, u16 size, u8 log_lvl);
+bool is_chained_request(u8 * data);
 
 #endif
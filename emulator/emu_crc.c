@@ -0,0 +1,2 @@
+// The emulator is a separate module and links its own copy of the driver's CRC implementation
+#include "../crc16ccitt.c"
@@ -0,0 +1,751 @@
+/*
+ * SDBP device emulator.
+ *
+ * Registers virtual SPI controllers with emulated SDBP devices and a GPIO chip providing their ready/interrupt lines,
+ * so the unchanged sdbpk driver can be attached and benchmarked without hardware.
+ * Every controller is a separate (serialized) bus, devices on the same controller share it.
+ */
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/platform_device.h>
+#include <linux/spi/spi.h>
+#include <linux/gpio/driver.h>
+#include <linux/irq.h>
+#include <linux/interrupt.h>
+#include <linux/hrtimer.h>
+#include <linux/random.h>
+#include <linux/slab.h>
+#include "../sdbp.h"
+#include "../communication.h"
+#include "../crc16ccitt.h"
+
+#define EMU_MAX_STRING 255	// Chained strings are limited to 255 bytes by the driver
+#define EMU_MAX_SPEED_HZ 100000000
+
+enum emu_phase {
+	EMU_PHASE_IDLE,
+	EMU_PHASE_TURNAROUND,	// Operation received, response ready after turnaround_us
+	EMU_PHASE_WAIT,		// WAIT response shifted out, response ready after half of wait_us
+};
+
+enum emu_string {
+	EMU_STRING_VENDOR_PRODUCT_ID,
+	EMU_STRING_VENDOR_NAME,
+	EMU_STRING_PRODUCT_NAME,
+	EMU_STRING_CNT,
+};
+
+struct emu_bus;
+
+struct emu_dev {
+	spinlock_t lock;
+	int index;
+	struct emu_bus *bus;
+	struct spi_device *spi;
+	struct sdbp_slot_config config;	// Platform data of the spi_device
+	unsigned int irq;
+	struct hrtimer ready_timer;
+	struct hrtimer notification_timer;
+	enum emu_phase phase;
+	bool inject_wait;
+	bool waiting;		// WAIT response is shifted out by the next transfer
+	bool in_transaction;	// No notification interrupts until the response is shifted out
+	u16 string_pos[EMU_STRING_CNT];
+	u32 notifications_pending;
+	u32 notification_seq;
+	u8 out[MAXIMUM_FRAME_SIZE];	// Frame shifted out by the next transfer (without padding and CRC)
+	u8 response[MAXIMUM_FRAME_SIZE];
+};
+
+struct emu_bus {
+	struct spi_controller *ctlr;
+	struct hrtimer xfer_timer;
+	struct emu_dev *dev;	// Device and message in flight
+	struct spi_message *msg;
+	u16 len;		// Frame length of the message
+	u8 tx[MAXIMUM_FRAME_SIZE];	// Frame gathered from the transfers of the message
+	u8 rx[MAXIMUM_FRAME_SIZE];
+};
+
+static int buses = 1;
+module_param(buses, int, S_IRUGO);
+MODULE_PARM_DESC(buses, " Number of emulated SPI buses. (default=1)");
+
+static int slots_per_bus = 2;
+module_param(slots_per_bus, int, S_IRUGO);
+MODULE_PARM_DESC(slots_per_bus, " Number of emulated devices (chip selects) per bus. (default=2)");
+
+static int bus_num = 10;
+module_param(bus_num, int, S_IRUGO);
+MODULE_PARM_DESC(bus_num, " SPI bus number of the first emulated bus, away from the legacy slot table buses. (default=10)");
+
+static char *vendor_product_id = "nexus-unity.sdbp-emu";
+module_param(vendor_product_id, charp, S_IRUGO);
+MODULE_PARM_DESC(vendor_product_id, " Descriptor vendor product id.");
+
+static char *vendor_name = "Nexus Unity";
+module_param(vendor_name, charp, S_IRUGO);
+MODULE_PARM_DESC(vendor_name, " Descriptor vendor name.");
+
+static char *product_name = "SDBP device emulator";
+module_param(product_name, charp, S_IRUGO);
+MODULE_PARM_DESC(product_name, " Descriptor product name.");
+
+static uint max_sclk_khz = 10000;
+module_param(max_sclk_khz, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(max_sclk_khz, " Descriptor maximum SCLK speed in kHz. (default=10000)");
+
+static uint max_frame_size = MAXIMUM_FRAME_SIZE;
+module_param(max_frame_size, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(max_frame_size, " Descriptor maximum frame size in bytes. (default=4096)");
+
+static uint bootloader_state;
+module_param(bootloader_state, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(bootloader_state, " Descriptor bootloader state. (default=0)");
+
+static uint turnaround_us = 50;
+module_param(turnaround_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(turnaround_us, " Time between an operation frame and the ready interrupt in us. (default=50)");
+
+static uint wait_permille;
+module_param(wait_permille, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(wait_permille, " Share of operations answered with a WAIT response first, in 1/1000. (default=0)");
+
+static uint wait_us = 2000;
+module_param(wait_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(wait_us, " Wait time requested by WAIT responses in us, the response is ready after half of it. (default=2000)");
+
+static uint crc_error_permille;
+module_param(crc_error_permille, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(crc_error_permille, " Share of frames sent with a corrupted CRC, in 1/1000. (default=0)");
+
+static bool simulate_sclk = true;
+module_param(simulate_sclk, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(simulate_sclk, " Transfers take the time of the requested SCLK speed. (default=1)");
+
+static int set_notification_hz(const char *val, const struct kernel_param *kp);
+static uint notification_hz;
+static const struct kernel_param_ops notification_hz_ops = {
+	.set = set_notification_hz,
+	.get = param_get_uint,
+};
+
+module_param_cb(notification_hz, &notification_hz_ops, &notification_hz, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(notification_hz, " Notifications generated per second and device, 0 disables them. (default=0)");
+
+static int set_connected(const char *val, const struct kernel_param *kp);
+static ulong connected = ~0UL;
+static const struct kernel_param_ops connected_ops = {
+	.set = set_connected,
+	.get = param_get_ulong,
+};
+
+module_param_cb(connected, &connected_ops, &connected, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(connected, " Bit mask of connected devices, a cleared bit pulls the ready line low. (default=all)");
+
+static struct platform_device *emu_pdev;
+static struct emu_bus *emu_buses;
+static struct emu_dev *emu_devs;
+static int emu_dev_cnt;
+static int emu_irq_base = -1;
+static bool emu_gpio_added;
+
+static bool permille(uint rate)
+{
+	return rate && get_random_u32() % 1000 < rate;
+}
+
+static bool is_connected(struct emu_dev *dev)
+{
+	return test_bit(dev->index, &connected);
+}
+
+// Falling edge of the ready line, must be called with interrupts disabled
+static void emu_fire(struct emu_dev *dev)
+{
+	generic_handle_irq(dev->irq);
+}
+
+static void emu_reset(struct emu_dev *dev)
+{
+	static const u8 dummy[] = { SDBP_MSG_TYPE_ACKNOWLEDGEMENT, 0x00, 0x07, SDBP_OPTION_BYTE, SDBP_CLASSID_CORE, 0x04, 0x01 };
+
+	dev->phase = EMU_PHASE_IDLE;
+	dev->inject_wait = false;
+	dev->waiting = false;
+	dev->in_transaction = false;
+	dev->notifications_pending = 0;
+	memset(dev->string_pos, 0, sizeof(dev->string_pos));
+	memcpy(dev->out, dummy, sizeof(dummy));
+}
+
+static void respond(struct emu_dev *dev, const u8 *payload, u16 len)
+{
+	dev->response[0] = SDBP_MSG_TYPE_RESPONSE;
+	dev->response[1] = (len + 4) >> 8;
+	dev->response[2] = (len + 4) & 0xff;
+	dev->response[3] = SDBP_OPTION_BYTE;
+	memcpy(dev->response + 4, payload, len);
+}
+
+static void respond_error(struct emu_dev *dev, u8 error)
+{
+	u8 payload[] = { SDBP_CLASSID_CORE, SDBP_C_TRANSACTION_ERROR, error };
+
+	respond(dev, payload, sizeof(payload));
+}
+
+static void put_be16(u8 *data, u16 value)
+{
+	data[0] = value >> 8;
+	data[1] = value & 0xff;
+}
+
+static void put_be32(u8 *data, u32 value)
+{
+	put_be16(data, value >> 16);
+	put_be16(data + 2, value & 0xffff);
+}
+
+static void descriptor_string(struct emu_dev *dev, enum emu_string index, u8 *payload, u16 *len, u16 frame_size)
+{
+	const char *strings[EMU_STRING_CNT] = { vendor_product_id, vendor_name, product_name };
+	u16 size = min_t(size_t, strlen(strings[index]), EMU_MAX_STRING);
+	u16 pos = min(dev->string_pos[index], size);
+	u16 chunk = min_t(u16, size - pos, frame_size - DEFAULT_CRC_SIZE - 9);
+
+	payload[3] = pos + chunk < size;	// Chaining
+	payload[4] = chunk;
+	memcpy(payload + 5, strings[index] + pos, chunk);
+	dev->string_pos[index] = payload[3] ? pos + chunk : 0;
+	*len = 5 + chunk;
+}
+
+static void handle_descriptor(struct emu_dev *dev, u8 command, u16 frame_size)
+{
+	u8 payload[EMU_MAX_STRING + 8] = { SDBP_CLASSID_CORE, 0x02, command };
+	u16 len = 3;
+	int i;
+
+	switch (command) {
+	case 0x02:
+		descriptor_string(dev, EMU_STRING_VENDOR_PRODUCT_ID, payload, &len, frame_size);
+		break;
+	case 0x03:		// Serial code
+		for (i = 0; i < 14; i++)
+			payload[3 + i] = 0xE0 + i;
+		payload[17] = dev->config.spi_bus;
+		payload[18] = dev->config.spi_chip_select;
+		len += 16;
+		break;
+	case 0x04:		// Firmware version S.1.2.0
+		payload[3] = 3;
+		put_be16(payload + 4, 1);
+		put_be16(payload + 6, 2);
+		put_be16(payload + 8, 0);
+		len += 7;
+		break;
+	case 0x05:		// Hardware version 1.0.0
+		put_be16(payload + 3, 1);
+		put_be16(payload + 5, 0);
+		put_be16(payload + 7, 0);
+		len += 6;
+		break;
+	case 0x06:
+		put_be32(payload + 3, max_sclk_khz);
+		len += 4;
+		break;
+	case 0x07:
+		put_be16(payload + 3, min_t(uint, max_frame_size, MAXIMUM_FRAME_SIZE));
+		len += 2;
+		break;
+	case 0x08:		// Protocol version 1.0.0
+		put_be16(payload + 3, 1);
+		put_be16(payload + 5, 0);
+		put_be16(payload + 7, 0);
+		len += 6;
+		break;
+	case 0x09:
+		descriptor_string(dev, EMU_STRING_VENDOR_NAME, payload, &len, frame_size);
+		break;
+	case 0x0A:
+		descriptor_string(dev, EMU_STRING_PRODUCT_NAME, payload, &len, frame_size);
+		break;
+	case 0x0B:
+		payload[3] = bootloader_state;
+		len += 1;
+		break;
+	case 0x0C:		// Maximum power 3V3/5V0/12V in mW
+	case 0x0D:
+	case 0x0E:
+		put_be32(payload + 3, command == 0x0C ? 500 : command == 0x0D ? 1000 : 0);
+		len += 4;
+		break;
+	default:
+		payload[2] = 0x01;	// Descriptor error code
+		break;
+	}
+	respond(dev, payload, len);
+}
+
+static void handle_control(struct emu_dev *dev, const u8 *data, u16 length)
+{
+	u8 payload[] = { SDBP_CLASSID_CORE, 0x03, data[6], 0x00 };
+	u32 value;
+
+	switch (data[6]) {
+	case 0x07:		// SET_FRAME_SIZE
+		value = length == 9 ? data[7] << 8 | data[8] : 0;
+		payload[3] = value >= DEFAULT_FRAME_SIZE && value <= max_frame_size ? 0x00 : 0x01;
+		break;
+	case 0x08:		// SET_SCLK_SPEED in kHz
+		value = length == 11 ? data[7] << 24 | data[8] << 16 | data[9] << 8 | data[10] : 0;
+		payload[3] = value >= 100 && value <= max_sclk_khz ? 0x00 : 0x01;
+		break;
+	default:		// Mode changes, UPDATE_DESCRIPTOR, ...
+		break;
+	}
+	respond(dev, payload, sizeof(payload));
+}
+
+static void handle_notification(struct emu_dev *dev)
+{
+	u8 payload[7] = { SDBP_CLASSID_CORE, 0x06, 0x02 };
+
+	if (dev->notifications_pending == 0) {
+		respond(dev, payload, 3);
+		return;
+	}
+	dev->notifications_pending--;
+	put_be32(payload + 3, ++dev->notification_seq);
+	respond(dev, payload, sizeof(payload));
+}
+
+static void handle_operation(struct emu_dev *dev, const u8 *data, u16 frame_size)
+{
+	u16 length = data[1] << 8 | data[2];
+
+	if (length < 7 || length > frame_size - DEFAULT_CRC_SIZE) {
+		respond_error(dev, SDBP_C_TRANSACTION_ERROR_DATA_LENGTH_INVALID);
+		return;
+	}
+
+	switch (data[4]) {
+	case SDBP_CLASSID_CORE:
+		if (data[5] == 0x02)
+			handle_descriptor(dev, data[6], frame_size);
+		else if (data[5] == 0x03)
+			handle_control(dev, data, length);
+		else if (data[5] == 0x06)
+			handle_notification(dev);
+		else
+			respond_error(dev, SDBP_C_TRANSACTION_ERROR_CLASS_INVALID);
+		break;
+	case SDBP_CLASSID_STANDARD:
+	case SDBP_CLASSID_CUSTOM:
+		// Echo, usable as variable length payload for benchmarks
+		respond(dev, data + 4, length - 4);
+		break;
+	default:
+		respond_error(dev, SDBP_C_TRANSACTION_ERROR_CLASS_IDENTIFIER_INVALID);
+		break;
+	}
+}
+
+// Pads "out" to the transfer length and appends the CRC
+static void encode_frame(struct emu_dev *dev, u8 *rx, u16 len)
+{
+	u16 length = dev->out[1] << 8 | dev->out[2];
+	u16 crc;
+
+	if (length > len - DEFAULT_CRC_SIZE)
+		length = len - DEFAULT_CRC_SIZE;
+	memcpy(rx, dev->out, length);
+	memset(rx + length, DUMMY_PATTERN, len - DEFAULT_CRC_SIZE - length);
+	if (rx[0] == SDBP_MSG_TYPE_RESPONSE && dev->notifications_pending)
+		rx[3] = SDBP_OPTION_BYTE_NOTIFICATION_PENDING;
+
+	crc = crc16_ccitt(rx, len - DEFAULT_CRC_SIZE, 0);
+	if (permille(crc_error_permille))
+		crc = ~crc;
+	put_be16(rx + len - DEFAULT_CRC_SIZE, crc);
+}
+
+// Handles a received frame, returns true if a CTS interrupt follows
+static bool decode_frame(struct emu_dev *dev, const u8 *tx, u16 len)
+{
+	u16 crc = crc16_ccitt(tx, len - DEFAULT_CRC_SIZE, 0);
+
+	if (tx[0] == SDBP_MSG_TYPE_ACKNOWLEDGEMENT) {
+		// Dummy frame, the response has been shifted out
+		if (dev->waiting) {
+			dev->waiting = false;
+			dev->phase = EMU_PHASE_WAIT;
+			hrtimer_start(&dev->ready_timer, us_to_ktime(wait_us / 2), HRTIMER_MODE_REL_HARD);
+		} else if (dev->phase == EMU_PHASE_IDLE) {
+			dev->in_transaction = false;
+		}
+		return true;
+	}
+
+	if (crc != (tx[len - DEFAULT_CRC_SIZE] << 8 | tx[len - DEFAULT_CRC_SIZE + 1]))
+		respond_error(dev, SDBP_C_TRANSACTION_ERROR_FRAME_CRC);
+	else if (tx[0] != SDBP_MSG_TYPE_OPERATION)
+		respond_error(dev, SDBP_C_TRANSACTION_ERROR_MESSAGE_TYPE_INVALID);
+	else
+		handle_operation(dev, tx, len);
+
+	dev->in_transaction = true;
+	dev->inject_wait = permille(wait_permille);
+	dev->phase = EMU_PHASE_TURNAROUND;
+	hrtimer_start(&dev->ready_timer, us_to_ktime(turnaround_us), HRTIMER_MODE_REL_HARD);
+	return false;
+}
+
+static enum hrtimer_restart ready_timer_fn(struct hrtimer *timer)
+{
+	struct emu_dev *dev = container_of(timer, struct emu_dev, ready_timer);
+	u8 wait[] = { SDBP_MSG_TYPE_RESPONSE, 0x00, 11, SDBP_OPTION_BYTE, SDBP_CLASSID_CORE, SDBP_C_WAIT, SDBP_C_WAIT_WAIT, 0, 0, 0, 0 };
+	bool fire;
+
+	spin_lock(&dev->lock);
+	if (dev->phase == EMU_PHASE_TURNAROUND && dev->inject_wait) {
+		put_be32(wait + 7, wait_us);
+		memcpy(dev->out, wait, sizeof(wait));
+		dev->inject_wait = false;
+		dev->waiting = true;
+	} else {
+		memcpy(dev->out, dev->response, (dev->response[1] << 8) | dev->response[2]);
+	}
+	dev->phase = EMU_PHASE_IDLE;
+	fire = is_connected(dev);
+	spin_unlock(&dev->lock);
+
+	if (fire)
+		emu_fire(dev);
+	return HRTIMER_NORESTART;
+}
+
+static enum hrtimer_restart notification_timer_fn(struct hrtimer *timer)
+{
+	struct emu_dev *dev = container_of(timer, struct emu_dev, notification_timer);
+	uint rate = READ_ONCE(notification_hz);
+	bool fire;
+
+	if (rate == 0)
+		return HRTIMER_NORESTART;
+
+	spin_lock(&dev->lock);
+	if (dev->notifications_pending < U8_MAX)
+		dev->notifications_pending++;
+	fire = is_connected(dev) && !dev->in_transaction;
+	spin_unlock(&dev->lock);
+
+	if (fire)
+		emu_fire(dev);
+	hrtimer_forward_now(timer, ns_to_ktime(NSEC_PER_SEC / rate));
+	return HRTIMER_RESTART;
+}
+
+static enum hrtimer_restart xfer_timer_fn(struct hrtimer *timer)
+{
+	struct emu_bus *bus = container_of(timer, struct emu_bus, xfer_timer);
+	struct emu_dev *dev = bus->dev;
+	struct spi_message *m = bus->msg;
+	struct spi_transfer *t;
+	u16 pos = 0;
+	bool cts = false;
+
+	// One message is one frame, the driver may split it into several transfers (header, payload, padding, CRC)
+	spin_lock(&dev->lock);
+	if (!is_connected(dev))
+		memset(bus->rx, 0xff, bus->len);
+	else if (bus->len >= DEFAULT_FRAME_SIZE) {
+		encode_frame(dev, bus->rx, bus->len);
+		cts = decode_frame(dev, bus->tx, bus->len);
+	}
+	spin_unlock(&dev->lock);
+
+	list_for_each_entry(t, &m->transfers, transfer_list) {
+		if (t->rx_buf)
+			memcpy(t->rx_buf, bus->rx + pos, t->len);
+		pos += t->len;
+	}
+
+	if (cts)
+		emu_fire(dev);
+	m->actual_length = bus->len;
+	m->status = 0;
+	spi_finalize_current_message(bus->ctlr);
+	return HRTIMER_NORESTART;
+}
+
+static int emu_transfer_one_message(struct spi_controller *ctlr, struct spi_message *m)
+{
+	struct emu_bus *bus = spi_controller_get_devdata(ctlr);
+	struct spi_transfer *t;
+	u32 speed_hz = 0;
+	u64 ns = 0;
+
+	bus->dev = &emu_devs[(bus - emu_buses) * slots_per_bus + m->spi->chip_select];
+	bus->msg = m;
+	bus->len = 0;
+	list_for_each_entry(t, &m->transfers, transfer_list) {
+		if (bus->len + t->len > MAXIMUM_FRAME_SIZE) {
+			m->status = -EMSGSIZE;
+			spi_finalize_current_message(ctlr);
+			return 0;
+		}
+		if (t->tx_buf)
+			memcpy(bus->tx + bus->len, t->tx_buf, t->len);
+		else
+			memset(bus->tx + bus->len, 0, t->len);
+		bus->len += t->len;
+		speed_hz = t->speed_hz;
+	}
+
+	if (simulate_sclk && speed_hz)
+		ns = div_u64((u64) bus->len * 8 * NSEC_PER_SEC, speed_hz);
+	hrtimer_start(&bus->xfer_timer, ns_to_ktime(ns), HRTIMER_MODE_REL_HARD);
+	return 0;		// Completed by spi_finalize_current_message()
+}
+
+static int emu_gpio_get(struct gpio_chip *chip, unsigned int offset)
+{
+	return test_bit(offset, &connected);
+}
+
+static int emu_gpio_direction_input(struct gpio_chip *chip, unsigned int offset)
+{
+	return 0;
+}
+
+static int emu_gpio_get_direction(struct gpio_chip *chip, unsigned int offset)
+{
+	return GPIO_LINE_DIRECTION_IN;
+}
+
+static int emu_gpio_to_irq(struct gpio_chip *chip, unsigned int offset)
+{
+	return emu_irq_base + offset;
+}
+
+static struct gpio_chip emu_gpio = {
+	.label = "sdbp-emu",
+	.owner = THIS_MODULE,
+	.base = -1,
+	.get = emu_gpio_get,
+	.direction_input = emu_gpio_direction_input,
+	.get_direction = emu_gpio_get_direction,
+	.to_irq = emu_gpio_to_irq,
+	.can_sleep = false,
+};
+
+static void start_notifications(void)
+{
+	int i;
+
+	for (i = 0; i < emu_dev_cnt; i++) {
+		if (notification_hz && !hrtimer_active(&emu_devs[i].notification_timer))
+			hrtimer_start(&emu_devs[i].notification_timer, ns_to_ktime(NSEC_PER_SEC / notification_hz), HRTIMER_MODE_REL_HARD);
+	}
+}
+
+static int set_notification_hz(const char *val, const struct kernel_param *kp)
+{
+	int ret = param_set_uint(val, kp);
+
+	if (ret == 0 && emu_devs)
+		start_notifications();
+	return ret;
+}
+
+static int set_connected(const char *val, const struct kernel_param *kp)
+{
+	ulong old = connected;
+	unsigned long flags;
+	int ret, i;
+
+	ret = param_set_ulong(val, kp);
+	if (ret != 0 || !emu_devs)
+		return ret;
+
+	for (i = 0; i < emu_dev_cnt; i++) {
+		struct emu_dev *dev = &emu_devs[i];
+
+		if (test_bit(i, &old) && !is_connected(dev)) {
+			pr_info("sdbp-emu: device %d.%d disconnected\n", dev->config.spi_bus, dev->config.spi_chip_select);
+			local_irq_save(flags);
+			emu_fire(dev);	// Line stays low
+			local_irq_restore(flags);
+		} else if (!test_bit(i, &old) && is_connected(dev)) {
+			pr_info("sdbp-emu: device %d.%d connected\n", dev->config.spi_bus, dev->config.spi_chip_select);
+			spin_lock_irqsave(&dev->lock, flags);
+			emu_reset(dev);
+			spin_unlock_irqrestore(&dev->lock, flags);
+		}
+	}
+	return 0;
+}
+
+static void emu_release(void)
+{
+	int i;
+
+	for (i = 0; i < emu_dev_cnt; i++) {
+		if (emu_devs[i].spi)
+			spi_unregister_device(emu_devs[i].spi);
+		hrtimer_cancel(&emu_devs[i].notification_timer);
+		hrtimer_cancel(&emu_devs[i].ready_timer);
+	}
+	for (i = 0; i < buses; i++) {
+		if (emu_buses[i].ctlr)
+			spi_unregister_controller(emu_buses[i].ctlr);
+		hrtimer_cancel(&emu_buses[i].xfer_timer);
+	}
+	if (emu_gpio_added)
+		gpiochip_remove(&emu_gpio);
+	if (emu_irq_base >= 0)
+		irq_free_descs(emu_irq_base, emu_dev_cnt);
+	platform_device_unregister(emu_pdev);
+	kfree(emu_devs);
+	kfree(emu_buses);
+}
+
+static int emu_add_bus(int index)
+{
+	struct emu_bus *bus = &emu_buses[index];
+	struct spi_controller *ctlr;
+	struct spi_board_info info = {
+		.modalias = "sdbpk",
+		.max_speed_hz = DEFAULT_SCLK_SPEED,
+		.mode = 0,
+	};
+	int i, ret;
+
+	ctlr = spi_alloc_master(&emu_pdev->dev, 0);
+	if (!ctlr)
+		return -ENOMEM;
+	spi_controller_set_devdata(ctlr, bus);
+	ctlr->bus_num = bus_num + index;
+	ctlr->num_chipselect = slots_per_bus;
+	ctlr->mode_bits = SPI_CPOL | SPI_CPHA;
+	ctlr->bits_per_word_mask = SPI_BPW_MASK(8);
+	ctlr->min_speed_hz = 1000;
+	ctlr->max_speed_hz = EMU_MAX_SPEED_HZ;
+	ctlr->transfer_one_message = emu_transfer_one_message;
+	ret = spi_register_controller(ctlr);
+	if (ret != 0) {
+		spi_controller_put(ctlr);
+		return ret;
+	}
+	bus->ctlr = ctlr;
+
+	for (i = 0; i < slots_per_bus; i++) {
+		struct emu_dev *dev = &emu_devs[index * slots_per_bus + i];
+
+		info.bus_num = ctlr->bus_num;
+		info.chip_select = i;
+		info.platform_data = &dev->config;
+		dev->spi = spi_new_device(ctlr, &info);
+		if (!dev->spi)
+			return -ENODEV;
+	}
+	return 0;
+}
+
+static int __init sdbp_emu_init(void)
+{
+	int i, ret;
+
+	if (buses < 1 || slots_per_bus < 1 || buses * slots_per_bus > BITS_PER_LONG) {
+		pr_err("sdbp-emu: 1 to %d devices supported!\n", BITS_PER_LONG);
+		return -EINVAL;
+	}
+	emu_dev_cnt = buses * slots_per_bus;
+
+	emu_buses = kcalloc(buses, sizeof(struct emu_bus), GFP_KERNEL);
+	emu_devs = kcalloc(emu_dev_cnt, sizeof(struct emu_dev), GFP_KERNEL);
+	if (!emu_buses || !emu_devs) {
+		kfree(emu_buses);
+		kfree(emu_devs);
+		return -ENOMEM;
+	}
+	for (i = 0; i < buses; i++) {
+		hrtimer_init(&emu_buses[i].xfer_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_HARD);
+		emu_buses[i].xfer_timer.function = xfer_timer_fn;
+	}
+	for (i = 0; i < emu_dev_cnt; i++) {
+		hrtimer_init(&emu_devs[i].ready_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_HARD);
+		emu_devs[i].ready_timer.function = ready_timer_fn;
+		hrtimer_init(&emu_devs[i].notification_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_HARD);
+		emu_devs[i].notification_timer.function = notification_timer_fn;
+	}
+
+	emu_pdev = platform_device_register_simple("sdbp-emu", -1, NULL, 0);
+	if (IS_ERR(emu_pdev)) {
+		kfree(emu_buses);
+		kfree(emu_devs);
+		return PTR_ERR(emu_pdev);
+	}
+
+	emu_irq_base = irq_alloc_descs(-1, 0, emu_dev_cnt, NUMA_NO_NODE);
+	if (emu_irq_base < 0) {
+		ret = emu_irq_base;
+		goto error;
+	}
+
+	emu_gpio.parent = &emu_pdev->dev;
+	emu_gpio.ngpio = emu_dev_cnt;
+	ret = gpiochip_add_data(&emu_gpio, NULL);
+	if (ret != 0)
+		goto error;
+	emu_gpio_added = true;
+
+	for (i = 0; i < emu_dev_cnt; i++) {
+		struct emu_dev *dev = &emu_devs[i];
+
+		spin_lock_init(&dev->lock);
+		dev->index = i;
+		dev->bus = &emu_buses[i / slots_per_bus];
+		dev->irq = emu_irq_base + i;
+		dev->config.number = -1;	// First free slot number
+		dev->config.spi_bus = bus_num + i / slots_per_bus;
+		dev->config.spi_chip_select = i % slots_per_bus;
+		dev->config.interrupt_pin = emu_gpio.base + i;
+		emu_reset(dev);
+
+		irq_set_chip_and_handler(dev->irq, &dummy_irq_chip, handle_simple_irq);
+		irq_modify_status(dev->irq, IRQ_NOREQUEST | IRQ_NOAUTOEN, IRQ_NOPROBE);
+	}
+
+	for (i = 0; i < buses; i++) {
+		ret = emu_add_bus(i);
+		if (ret != 0) {
+			pr_err("sdbp-emu: Failed to register SPI bus %d (%d)!\n", bus_num + i, ret);
+			goto error;
+		}
+	}
+
+	start_notifications();
+	pr_info("sdbp-emu: %d device(s) on SPI bus %d-%d, ready lines GPIO %d-%d\n", emu_dev_cnt, bus_num, bus_num + buses - 1, emu_gpio.base,
+		emu_gpio.base + emu_dev_cnt - 1);
+	return 0;
+
+ error:
+	emu_release();
+	return ret;
+}
+
+static void __exit sdbp_emu_exit(void)
+{
+	emu_release();
+}
+
+module_init(sdbp_emu_init);
+module_exit(sdbp_emu_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Nexus-Unity");
+MODULE_DESCRIPTION("SDBP device emulator");
+MODULE_VERSION(DRIVER_VERSION);
@@ -0,0 +1,158 @@
+/*
+ * Bus ownership stress test.
+ * Several threads write to /dev/slotX while a listener consumes notifications,
+ * afterwards the write latency percentiles and the driver's bus counters are printed.
+ *
+ * gcc -O2 -pthread -o stress stress.c
+ * ./stress [slot] [writer threads] [seconds]
+ */
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define MAX_SAMPLES 1000000
+
+static int fd;
+static int slot = 1;
+static volatile int running = 1;
+static uint32_t *samples;
+static volatile long sample_cnt;
+static volatile long write_errors;
+static volatile long notifications;
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// arg: descriptor of /dev/slotX, shared by all writers
+static void *writer(void *arg)
+{
+	int wfd = *(int *)arg;
+	char buf[64] = { 0x01, 0x02, 0x02 };
+	uint64_t start;
+	long i;
+
+	while (running) {
+		start = now_us();
+		if (write(wfd, buf, 3) != 3) {
+			__sync_fetch_and_add(&write_errors, 1);
+			continue;
+		}
+		i = __sync_fetch_and_add(&sample_cnt, 1);
+		if (i < MAX_SAMPLES)
+			samples[i] = now_us() - start;
+	}
+	return NULL;
+}
+
+// arg: path of the notification attribute
+static void *listener(void *arg)
+{
+	const char *path = arg;
+	char buf[4096];
+	int nfd;
+
+	while (running) {
+		nfd = open(path, O_RDONLY);
+		if (nfd < 0)
+			return NULL;
+		if (read(nfd, buf, sizeof(buf)) > 0)
+			__sync_fetch_and_add(&notifications, 1);
+		close(nfd);
+	}
+	return NULL;
+}
+
+static int compare(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);	// The difference does not fit into an int
+}
+
+static void print_attribute(const char *name)
+{
+	char path[96];
+	char buf[128] = { 0 };
+	int afd;
+
+	snprintf(path, sizeof(path), "/sys/class/sdbp/slot%d/%s", slot, name);
+	afd = open(path, O_RDONLY);
+	if (afd < 0)
+		return;
+	if (read(afd, buf, sizeof(buf) - 1) > 0)
+		printf("%-22s %s\n", name, buf);
+	close(afd);
+}
+
+int main(int argc, char *argv[])
+{
+	int threads = 4;
+	int seconds = 10;
+	char dev[32];
+	char notification[64];
+	pthread_t notify_thread;
+	pthread_t *write_threads;
+	long cnt;
+	int i;
+
+	if (argc > 1)
+		slot = atoi(argv[1]);
+	if (argc > 2)
+		threads = atoi(argv[2]);
+	if (argc > 3)
+		seconds = atoi(argv[3]);
+
+	snprintf(dev, sizeof(dev), "/dev/slot%d", slot);
+	fd = open(dev, O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s\n", dev, strerror(errno));
+		return -1;
+	}
+
+	samples = calloc(MAX_SAMPLES, sizeof(uint32_t));
+	write_threads = calloc(threads, sizeof(pthread_t));
+	if (!samples || !write_threads)
+		return -1;
+
+	printf("Stressing %s with %d writers for %d s...\n", dev, threads, seconds);
+	snprintf(notification, sizeof(notification), "/sys/class/sdbp/slot%d/notification", slot);
+	pthread_create(&notify_thread, NULL, listener, notification);
+	for (i = 0; i < threads; i++)
+		pthread_create(&write_threads[i], NULL, writer, &fd);
+
+	sleep(seconds);
+	running = 0;
+	for (i = 0; i < threads; i++)
+		pthread_join(write_threads[i], NULL);
+	// The listener may block until the next notification arrives.
+	pthread_cancel(notify_thread);
+	pthread_join(notify_thread, NULL);
+	close(fd);
+
+	cnt = sample_cnt < MAX_SAMPLES ? sample_cnt : MAX_SAMPLES;
+	printf("writes: %ld (%.1f/s), failed: %ld, notifications: %ld\n", sample_cnt, (double)sample_cnt / seconds, write_errors, notifications);
+	if (cnt > 0) {
+		qsort(samples, cnt, sizeof(uint32_t), compare);
+		printf("write latency us: p50 %u p90 %u p99 %u p99.9 %u max %u\n", samples[cnt / 2], samples[cnt * 90 / 100],
+		       samples[cnt * 99 / 100], samples[cnt * 999 / 1000], samples[cnt - 1]);
+	}
+
+	printf("bus counters (notification write):\n");
+	print_attribute("stats_bus_acquired");
+	print_attribute("stats_bus_contended");
+	print_attribute("stats_bus_max_queued");
+	print_attribute("stats_bus_wait_us");
+	return 0;
+}
@@ -0,0 +1,354 @@
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <linux/pm_runtime.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/bitops.h>
+#include "fanout.h"
+#include "sdbp.h"
+#include "descriptor.h"
+#include "communication.h"
+#include "sdbp_uapi.h"
+#include "debug.h"
+
+struct fanout_job {
+	struct Slot *slot;	// Referenced, NULL if the slot is not usable
+	u32 number;		// Requested slot
+	u8 *tx;
+	u8 *rx;
+	int error;
+	bool prepared;		// Bus and PM reference held until the exchange ran
+	ktime_t start;
+	ktime_t end;
+};
+
+// Jobs of one SPI bus, run back to back by one work item
+struct fanout_bus {
+	struct work_struct work;
+	struct fanout_job *jobs[FANOUT_MAX_SLOTS];
+	int cnt;
+	u8 spi_bus;
+};
+
+// Per open file, a read returns the results of the last write once
+struct fanout_file {
+	struct mutex lock;
+	u8 *results;
+	size_t results_len;
+};
+
+static struct workqueue_struct *fanout_wq;
+
+// Returns a referenced slot, the reference is put by fan_out()
+static struct Slot *fanout_slot(int number)
+{
+	struct Slot *slot = get_slot_ref(number);
+
+	if (slot == NULL)
+		return NULL;
+	if (!slot->valid || slot->state != SLOT_STATE_CONNECTED) {
+		put_slot(slot);
+		return NULL;
+	}
+	return slot;
+}
+
+// Owns the slot bus and builds the operation frame, the exchange itself is started by the bus work
+static int prepare_job(struct fanout_job *job, const u8 * payload, u16 length)
+{
+	struct Slot *slot = job->slot;
+	int ret;
+
+	ret = pm_runtime_resume_and_get(&slot->spi_device->dev);
+	if (ret < 0)
+		return ret;
+	ret = bus_acquire_interruptible(&slot->bus, BUS_PRIO_WRITE);
+	if (ret != 0)
+		goto put;
+
+	if (length > slot->frame_size - 6) {
+		ret = -EMSGSIZE;
+		goto release;
+	}
+	job->tx = kmalloc(length + 4, GFP_KERNEL);
+	job->rx = kzalloc(slot->frame_size, GFP_KERNEL);
+	if (!job->tx || !job->rx) {
+		ret = -ENOMEM;
+		goto release;
+	}
+	job->tx[0] = SDBP_MSG_TYPE_OPERATION;
+	job->tx[1] = (length + 4) >> 8;
+	job->tx[2] = (length + 4) & 0xff;
+	job->tx[3] = SDBP_OPTION_BYTE;
+	memcpy(job->tx + 4, payload, length);
+	job->prepared = true;
+	return 0;
+
+ release:
+	release_bus(slot);
+ put:
+	pm_runtime_put_autosuspend(&slot->spi_device->dev);
+	return ret;
+}
+
+static void finish_job(struct fanout_job *job)
+{
+	struct Slot *slot = job->slot;
+
+	release_bus(slot);
+	pm_runtime_mark_last_busy(&slot->spi_device->dev);
+	pm_runtime_put_autosuspend(&slot->spi_device->dev);
+	job->prepared = false;
+}
+
+static void run_job(struct fanout_job *job)
+{
+	struct Slot *slot = job->slot;
+
+	job->start = ktime_get();
+	if (exchange_sdbp(slot, job->tx, job->rx, LOG_LVL_NORMAL) != 0)
+		job->error = -ECOMM;
+	job->end = ktime_get();
+
+	// Same as a write, notifications are fetched while the bus is still owned
+	if (job->error == 0 && job->rx[3] == SDBP_OPTION_BYTE_NOTIFICATION_PENDING && drain_notifications(slot) < 0)
+		atomic_set(&slot->notification_arrived, 1);
+	finish_job(job);
+}
+
+static void fanout_bus_work(struct work_struct *work)
+{
+	struct fanout_bus *bus = container_of(work, struct fanout_bus, work);
+	int i;
+
+	for (i = 0; i < bus->cnt; i++)
+		run_job(bus->jobs[i]);
+}
+
+static u16 response_length(struct fanout_job *job)
+{
+	u16 length;
+
+	if (job->error != 0)
+		return 0;
+	length = (job->rx[1] << 8) | job->rx[2];
+	return length > 4 ? length - 4 : 0;
+}
+
+static int collect_results(struct fanout_file *ff, struct fanout_job *jobs, int cnt)
+{
+	struct sdbp_fanout_result *result;
+	ktime_t first = 0;
+	size_t size = 0;
+	u8 *pos;
+	int i;
+
+	for (i = 0; i < cnt; i++) {
+		size += sizeof(*result) + ALIGN(response_length(&jobs[i]), 8);
+		if (jobs[i].start && (!first || ktime_before(jobs[i].start, first)))
+			first = jobs[i].start;
+	}
+
+	kfree(ff->results);
+	ff->results_len = 0;
+	ff->results = kzalloc(size, GFP_KERNEL);
+	if (!ff->results)
+		return -ENOMEM;
+
+	pos = ff->results;
+	for (i = 0; i < cnt; i++) {
+		result = (struct sdbp_fanout_result *)pos;
+		result->slot = jobs[i].number;
+		result->error = jobs[i].error;
+		result->length = response_length(&jobs[i]);
+		if (jobs[i].start) {
+			result->start_ns = ktime_to_ns(ktime_sub(jobs[i].start, first));
+			result->duration_ns = ktime_to_ns(ktime_sub(jobs[i].end, jobs[i].start));
+		}
+		memcpy(pos + sizeof(*result), jobs[i].rx + 4, result->length);
+		pos += sizeof(*result) + ALIGN(result->length, 8);
+	}
+	ff->results_len = size;
+	return 0;
+}
+
+/*
+ * All selected slots are prepared first (bus owned, frame built), then one work item per SPI bus is queued.
+ * Start skew between buses is the queueing and wake up latency, slots of one bus follow each other directly.
+ */
+static int fan_out(struct fanout_file *ff, struct sdbp_fanout_request *request, const u8 * payload)
+{
+	struct fanout_job *jobs;
+	struct fanout_bus *buses;
+	int cnt = hweight64(request->slot_mask);
+	int bus_cnt = 0;
+	int i, j, n;
+	int ret = 0;
+
+	jobs = kcalloc(cnt, sizeof(*jobs), GFP_KERNEL);
+	buses = kcalloc(cnt, sizeof(*buses), GFP_KERNEL);
+	if (!jobs || !buses) {
+		ret = -ENOMEM;
+		goto free;
+	}
+
+	// Buses are acquired in slot order, concurrent fan-outs cannot deadlock
+	for (i = 0, n = 0; i < FANOUT_MAX_SLOTS; i++) {
+		if (!(request->slot_mask & BIT_ULL(i)))
+			continue;
+		jobs[n].number = i;
+		jobs[n].slot = fanout_slot(i);
+		if (jobs[n].slot == NULL) {
+			jobs[n].error = -ENODEV;
+		} else {
+			jobs[n].error = prepare_job(&jobs[n], payload, request->length);
+			if (jobs[n].error == -ERESTARTSYS) {
+				ret = -ERESTARTSYS;
+				goto release;
+			}
+		}
+		if (jobs[n].error != 0)
+			PRINT_DBG("Fan-out to slot %d not possible (%d).\n", i, jobs[n].error);
+		n++;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		if (!jobs[i].prepared)
+			continue;
+		for (j = 0; j < bus_cnt && buses[j].spi_bus != jobs[i].slot->spi_bus; j++) ;
+		if (j == bus_cnt) {
+			INIT_WORK(&buses[j].work, fanout_bus_work);
+			buses[j].spi_bus = jobs[i].slot->spi_bus;
+			bus_cnt++;
+		}
+		buses[j].jobs[buses[j].cnt++] = &jobs[i];
+	}
+	for (j = 0; j < bus_cnt; j++)
+		queue_work(fanout_wq, &buses[j].work);
+	for (j = 0; j < bus_cnt; j++)
+		flush_work(&buses[j].work);
+
+	ret = collect_results(ff, jobs, cnt);
+
+ release:
+	for (i = 0; i < cnt; i++) {
+		if (jobs[i].prepared)
+			finish_job(&jobs[i]);
+		kfree(jobs[i].tx);
+		kfree(jobs[i].rx);
+		if (jobs[i].slot)
+			put_slot(jobs[i].slot);
+	}
+ free:
+	kfree(buses);
+	kfree(jobs);
+	return ret;
+}
+
+static ssize_t fanout_write(struct file *instance, const char __user * buffer, size_t count, loff_t * offset)
+{
+	struct fanout_file *ff = instance->private_data;
+	struct sdbp_fanout_request request;
+	u8 *payload;
+	int ret;
+
+	if (instance->f_flags & O_NONBLOCK)
+		return -EWOULDBLOCK;
+	if (count < sizeof(request))
+		return -EINVAL;
+	if (copy_from_user(&request, buffer, sizeof(request)))
+		return -EFAULT;
+	if (request.slot_mask == 0 || request.length < 2 || request.length > MAXIMUM_FRAME_SIZE - 6 || count < sizeof(request) + request.length)
+		return -EINVAL;
+
+	payload = memdup_user(buffer + sizeof(request), request.length);
+	if (IS_ERR(payload))
+		return PTR_ERR(payload);
+
+	mutex_lock(&ff->lock);
+	ret = fan_out(ff, &request, payload);
+	mutex_unlock(&ff->lock);
+	kfree(payload);
+	return ret ? ret : sizeof(request) + request.length;
+}
+
+static ssize_t fanout_read(struct file *instance, char __user * buffer, size_t count, loff_t * offset)
+{
+	struct fanout_file *ff = instance->private_data;
+	ssize_t ret;
+
+	mutex_lock(&ff->lock);
+	if (ff->results == NULL) {
+		ret = -EWOULDBLOCK;
+	} else if (count < ff->results_len) {
+		ret = -EMSGSIZE;
+	} else if (copy_to_user(buffer, ff->results, ff->results_len)) {
+		ret = -EFAULT;
+	} else {
+		ret = ff->results_len;
+		kfree(ff->results);
+		ff->results = NULL;
+		ff->results_len = 0;
+	}
+	mutex_unlock(&ff->lock);
+	return ret;
+}
+
+static int fanout_open(struct inode *inode, struct file *instance)
+{
+	struct fanout_file *ff = kzalloc(sizeof(*ff), GFP_KERNEL);
+
+	if (!ff)
+		return -ENOMEM;
+	mutex_init(&ff->lock);
+	instance->private_data = ff;
+	return 0;
+}
+
+static int fanout_close(struct inode *inode, struct file *instance)
+{
+	struct fanout_file *ff = instance->private_data;
+
+	kfree(ff->results);
+	kfree(ff);
+	return 0;
+}
+
+static const struct file_operations fanout_fops = {
+	.owner = THIS_MODULE,
+	.open = fanout_open,
+	.release = fanout_close,
+	.read = fanout_read,
+	.write = fanout_write,
+};
+
+static struct miscdevice fanout_device = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "sdbp",
+	.fops = &fanout_fops,
+};
+
+int fanout_init(void)
+{
+	int ret;
+
+	// Unbounded, every bus gets its own worker
+	fanout_wq = alloc_workqueue("sdbp_fanout", WQ_UNBOUND | WQ_HIGHPRI, 0);
+	if (!fanout_wq)
+		return -ENOMEM;
+	ret = misc_register(&fanout_device);
+	if (ret != 0) {
+		PRINT_ERR("Failed to register /dev/%s...\n", fanout_device.name);
+		destroy_workqueue(fanout_wq);
+	}
+	return ret;
+}
+
+void fanout_exit(void)
+{
+	misc_deregister(&fanout_device);
+	destroy_workqueue(fanout_wq);
+}
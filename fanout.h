@@ -0,0 +1,9 @@
+#ifndef FANOUT_H_
+#define FANOUT_H_
+
+#define FANOUT_MAX_SLOTS 64	// Width of the slot mask
+
+int fanout_init(void);
+void fanout_exit(void);
+
+#endif
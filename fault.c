@@ -0,0 +1,71 @@
+#include <linux/debugfs.h>
+#include <linux/err.h>
+#include "fault.h"
+#include "sdbp.h"
+#include "descriptor.h"
+#include "stats.h"
+
+static DECLARE_FAULT_ATTR(fault_default);
+
+static const char *const fault_names[FAULT_CNT] = {
+	[FAULT_RX_CRC] = "fail_rx_crc",
+	[FAULT_IRQ] = "fail_irq",
+	[FAULT_WAIT] = "fail_wait",
+	[FAULT_TRANSACTION_ERROR] = "fail_transaction_error",
+	[FAULT_DISCONNECT] = "fail_disconnect",
+};
+
+// All faults start disabled (probability 0)
+void fault_init(struct slot_faults *faults)
+{
+	int i;
+
+	for (i = 0; i < FAULT_CNT; i++)
+		faults->attr[i] = fault_default;
+	faults->wait_us = 10000;
+	atomic_set(&faults->disconnect, 0);
+}
+EXPORT_FOR_KUNIT(fault_init);
+
+void fault_debugfs_init(struct slot_faults *faults, struct dentry *parent)
+{
+	struct dentry *dir;
+	int i;
+
+	for (i = 0; i < FAULT_CNT; i++) {
+		dir = fault_create_debugfs_attr(fault_names[i], parent, &faults->attr[i]);
+		if (IS_ERR(dir))
+			return;
+		if (i == FAULT_WAIT)
+			debugfs_create_u32("wait_us", 0600, dir, &faults->wait_us);
+	}
+}
+
+bool fault_inject(struct Slot *slot, enum slot_fault fault)
+{
+	if (!should_fail(&slot->faults.attr[fault], 1))
+		return false;
+	stats_inc(&slot->stats, STAT_FAULTS_INJECTED);
+	return true;
+}
+
+// Injected WAIT time, 0 if no WAIT is injected
+u32 fault_wait_us(struct Slot *slot)
+{
+	return fault_inject(slot, FAULT_WAIT) ? READ_ONCE(slot->faults.wait_us) : 0;
+}
+
+// Called with the bus owned, the worker confirms the disconnect by the failing notification fetch
+bool fault_disconnect(struct Slot *slot)
+{
+	if (atomic_read(&slot->faults.disconnect))
+		return true;
+	if (slot->state != SLOT_STATE_CONNECTED || !fault_inject(slot, FAULT_DISCONNECT))
+		return false;
+
+	atomic_set(&slot->faults.disconnect, 1);
+	atomic_set(&slot->link_state, LINK_DISCONNECTED);
+	atomic_set(&slot->notification_arrived, 1);
+	sdbp_kick(slot);
+	return true;
+}
@@ -0,0 +1,78 @@
+#ifndef FAULT_H_
+#define FAULT_H_
+
+#include <linux/types.h>
+#include <linux/atomic.h>
+#include <linux/fault-inject.h>
+
+struct Slot;
+struct dentry;
+
+enum slot_fault {
+	FAULT_RX_CRC,		// Response CRC corrupted, the response is read again
+	FAULT_IRQ,		// Ready interrupt lost, the exchange waits for the timeout
+	FAULT_WAIT,		// Device WAIT of wait_us before the response is evaluated
+	FAULT_TRANSACTION_ERROR,	// Response replaced by a FRAME_CRC transaction error
+	FAULT_DISCONNECT,	// Exchanges fail until the slot worker went through disconnect and reconnect
+	FAULT_CNT,
+};
+
+#ifdef CONFIG_SDBPK_FAULT_INJECTION
+
+/*
+ * Fault injection of the exchange path, configured per slot and fault in debugfs (sdbp/slotX/fail_*),
+ * see Documentation/fault-injection/fault-injection.rst for probability, interval and times.
+ */
+struct slot_faults {
+	struct fault_attr attr[FAULT_CNT];
+	u32 wait_us;		// Injected WAIT time
+	atomic_t disconnect;	// Injected disconnect not yet taken by the slot worker
+};
+
+void fault_init(struct slot_faults *faults);
+void fault_debugfs_init(struct slot_faults *faults, struct dentry *parent);
+bool fault_inject(struct Slot *slot, enum slot_fault fault);
+bool fault_disconnect(struct Slot *slot);
+u32 fault_wait_us(struct Slot *slot);
+
+static inline bool fault_take_disconnect(struct slot_faults *faults)
+{
+	return atomic_xchg(&faults->disconnect, 0);
+}
+
+#else
+
+struct slot_faults {
+};
+
+static inline void fault_init(struct slot_faults *faults)
+{
+}
+
+static inline void fault_debugfs_init(struct slot_faults *faults, struct dentry *parent)
+{
+}
+
+static inline bool fault_inject(struct Slot *slot, enum slot_fault fault)
+{
+	return false;
+}
+
+static inline bool fault_disconnect(struct Slot *slot)
+{
+	return false;
+}
+
+static inline u32 fault_wait_us(struct Slot *slot)
+{
+	return 0;
+}
+
+static inline bool fault_take_disconnect(struct slot_faults *faults)
+{
+	return false;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,252 @@
+#include <linux/firmware.h>
+#include <linux/log2.h>
+#include <linux/pm_runtime.h>
+#include <linux/string.h>
+#include <linux/ktime.h>
+#include <asm/unaligned.h>
+#include "firmware.h"
+#include "sdbp.h"
+#include "descriptor.h"
+#include "communication.h"
+#include "debug.h"
+
+static const char *const state_names[] = {
+	[FIRMWARE_IDLE] = "idle",
+	[FIRMWARE_RUNNING] = "running",
+	[FIRMWARE_DONE] = "done",
+	[FIRMWARE_FAILED] = "failed",
+};
+
+const char *firmware_state_name(enum firmware_state state)
+{
+	return state_names[state];
+}
+
+// Returns the largest record payload or -EINVAL if the image is malformed
+static int check_image(struct Slot *slot, const u8 * data, size_t size, u16 max_payload)
+{
+	size_t pos = 0;
+	u16 length;
+	int max = 0;
+
+	while (pos < size) {
+		if (size - pos < FIRMWARE_RECORD_HEADER)
+			goto invalid;
+		length = get_unaligned_be16(data + pos);
+		pos += FIRMWARE_RECORD_HEADER;
+		if (length < 2 || length > size - pos)
+			goto invalid;
+		if (length > max_payload) {
+			PRINT_SLOT_ERR("Firmware record at %zu exceeds the max. frame size (%u bytes)!\n", slot->number, pos, length);
+			return -EMSGSIZE;
+		}
+		max = max_t(int, max, length);
+		pos += length;
+	}
+	if (max == 0)
+		goto invalid;
+	return max;
+
+ invalid:
+	PRINT_SLOT_ERR("Firmware image malformed at %zu!\n", slot->number, pos);
+	return -EINVAL;
+}
+
+// Smallest frame size for the largest record and the max. SCLK speed of the device
+static int negotiate(struct Slot *slot, u32 frame_size)
+{
+	u8 frame_request[] = { 0x01, 0x00, 0x09, 0x00, 0x01, 0x03, 0x07, 0x00, 0x00 };
+	u8 sclk_request[] = { 0x01, 0x00, 0x0B, 0x00, 0x01, 0x03, 0x08, 0x00, 0x00, 0x00, 0x00 };
+	u32 sclk_khz = slot->descriptor.max_sclk_speed;
+
+	if (frame_size != slot->frame_size) {
+		frame_request[7] = frame_size >> 8;
+		frame_request[8] = frame_size & 0xff;
+		if (exchange_sdbp(slot, frame_request, slot->rx_buffer, LOG_LVL_NORMAL) != 0 || slot->frame_size != frame_size) {
+			PRINT_SLOT_ERR("Setting frame size to %u bytes failed!\n", slot->number, frame_size);
+			return -ECOMM;
+		}
+	}
+
+	if (sclk_khz >= 100 && sclk_khz * 1000 != slot->speed_sclk) {
+		put_unaligned_be32(sclk_khz, sclk_request + 7);
+		if (exchange_sdbp(slot, sclk_request, slot->rx_buffer, LOG_LVL_NORMAL) != 0 || slot->speed_sclk != sclk_khz * 1000) {
+			PRINT_SLOT_ERR("Setting SCLK speed to %u kHz failed!\n", slot->number, sclk_khz);
+			return -ECOMM;
+		}
+	}
+	slot->fw.frame_size = slot->frame_size;
+	slot->fw.sclk_khz = slot->speed_sclk / 1000;
+	return 0;
+}
+
+static int send_record(struct Slot *slot, const u8 * payload, u16 length)
+{
+	u8 *tx = slot->tx_buffer;
+	u8 *rx = slot->rx_buffer;
+
+	tx[0] = SDBP_MSG_TYPE_OPERATION;
+	put_unaligned_be16(length + 4, tx + 1);
+	tx[3] = SDBP_OPTION_BYTE;
+	memcpy(tx + 4, payload, length);
+	if (exchange_sdbp(slot, tx, rx, LOG_LVL_NORMAL) != 0)
+		return -ECOMM;
+
+	if (rx[3] == SDBP_OPTION_BYTE_NOTIFICATION_PENDING)
+		atomic_set(&slot->notification_arrived, 1);	// Fetched by the worker after the upload released the bus
+	if (rx[0] != SDBP_MSG_TYPE_RESPONSE || rx[4] != tx[4] || rx[5] != tx[5]) {
+		PRINT_SLOT_ERR("Firmware record %u not answered (response %02X %02X %02X)!\n", slot->number, slot->fw.records, rx[4], rx[5], rx[6]);
+		return -EIO;
+	}
+	// The status byte follows class and command
+	if (get_unaligned_be16(rx + 1) < 7 || rx[6] == FIRMWARE_STATUS_ERROR) {
+		PRINT_SLOT_ERR("Firmware record %u rejected by the device (status %02X)!\n", slot->number, slot->fw.records, rx[6]);
+		return -EREMOTEIO;
+	}
+	return 0;
+}
+
+static int upload(struct Slot *slot, const struct firmware *image)
+{
+	struct firmware_upload *fw = &slot->fw;
+	u32 max_frame_size = slot->buffer_size;
+	ktime_t start;
+	size_t pos;
+	u16 length;
+	int ret;
+
+	ret = check_image(slot, image->data, image->size, max_frame_size - 6);
+	if (ret < 0)
+		return ret;
+	fw->size = image->size;
+
+	ret = negotiate(slot, clamp_t(u32, roundup_pow_of_two(ret + 6), DEFAULT_FRAME_SIZE, max_frame_size));
+	if (ret != 0)
+		return ret;
+
+	PRINT_SLOT_NORM("Uploading firmware %s (%zu bytes, frame size %u, SCLK %u kHz).\n", slot->number, fw->name, fw->size, fw->frame_size,
+			fw->sclk_khz);
+	start = ktime_get();
+	for (pos = 0; pos < image->size; pos += FIRMWARE_RECORD_HEADER + length) {
+		if (atomic_read(&slot->stop) || atomic_read(&slot->link_state) == LINK_DISCONNECTED)
+			return -ENODEV;
+		length = get_unaligned_be16(image->data + pos);
+		ret = send_record(slot, image->data + pos + FIRMWARE_RECORD_HEADER, length);
+		if (ret != 0)
+			return ret;
+		fw->records++;
+		WRITE_ONCE(fw->done, pos + FIRMWARE_RECORD_HEADER + length);
+		WRITE_ONCE(fw->elapsed_us, ktime_us_delta(ktime_get(), start));
+	}
+	PRINT_SLOT_NORM("Firmware uploaded in %llu ms (%u records).\n", slot->number, fw->elapsed_us / 1000, fw->records);
+	return 0;
+}
+
+static void firmware_work(struct work_struct *work)
+{
+	struct firmware_upload *fw = container_of(work, struct firmware_upload, work);
+	struct Slot *slot = container_of(fw, struct Slot, fw);
+	const struct firmware *image;
+	int ret;
+
+	ret = request_firmware(&image, fw->name, &slot->spi_device->dev);
+	if (ret != 0) {
+		PRINT_SLOT_ERR("Loading firmware %s failed (%d)!\n", slot->number, fw->name, ret);
+		goto done;
+	}
+
+	ret = pm_runtime_resume_and_get(&slot->spi_device->dev);
+	if (ret < 0)
+		goto release_image;
+	// The bus is kept for the whole image, /dev/slotX is held open by the upload
+	bus_acquire(&slot->bus, BUS_PRIO_WRITE);
+	ret = upload(slot, image);
+	release_bus(slot);
+	// Restores frame size and SCLK, the descriptor changes once the device left the bootloader
+	reset_session(slot);
+	pm_runtime_put_autosuspend(&slot->spi_device->dev);
+
+ release_image:
+	release_firmware(image);
+ done:
+	mutex_lock(&fw->lock);
+	fw->error = ret;
+	fw->state = ret ? FIRMWARE_FAILED : FIRMWARE_DONE;
+	mutex_unlock(&fw->lock);
+	atomic_dec(&slot->access_count);
+	sysfs_notify(&slot->sdbp_device->kobj, NULL, "firmware_status");
+}
+
+void firmware_init(struct firmware_upload *fw)
+{
+	INIT_WORK(&fw->work, firmware_work);
+	mutex_init(&fw->lock);
+	fw->state = FIRMWARE_IDLE;
+}
+
+int firmware_start(struct Slot *slot, const char *name)
+{
+	struct firmware_upload *fw = &slot->fw;
+	char buffer[FIRMWARE_NAME_MAX];
+	char *trimmed;
+	int ret = 0;
+
+	if (slot->descriptor.bootloader_state != BOOTLOADER_STATE_ACTIVE)
+		return -EPERM;
+
+	// sysfs writes end with a newline, leading blanks are dropped as well
+	strscpy(buffer, name, sizeof(buffer));
+	trimmed = strim(buffer);
+	if (*trimmed == '\0')
+		return -EINVAL;
+
+	mutex_lock(&fw->lock);
+	if (slot->state != SLOT_STATE_CONNECTED || atomic_read(&slot->stop)) {
+		ret = -ENODEV;
+		goto unlock;
+	}
+	if (fw->state == FIRMWARE_RUNNING) {
+		ret = -EBUSY;
+		goto unlock;
+	}
+	// Exclusive like driver_open(), a kept alive session is reset by the upload
+	if (!atomic_inc_and_test(&slot->access_count)) {
+		atomic_dec(&slot->access_count);
+		ret = -EBUSY;
+		goto unlock;
+	}
+	cancel_delayed_work_sync(&slot->close_work);
+
+	strscpy(fw->name, trimmed, sizeof(fw->name));
+	fw->state = FIRMWARE_RUNNING;
+	fw->error = 0;
+	fw->size = 0;
+	fw->done = 0;
+	fw->records = 0;
+	fw->elapsed_us = 0;
+	fw->frame_size = slot->frame_size;
+	fw->sclk_khz = slot->speed_sclk / 1000;
+	queue_work(system_long_wq, &fw->work);
+
+ unlock:
+	mutex_unlock(&fw->lock);
+	return ret;
+}
+
+// Called after stop is set, no upload is started afterwards and a running one aborts at the next record
+void firmware_cancel(struct Slot *slot)
+{
+	struct firmware_upload *fw = &slot->fw;
+
+	mutex_lock(&fw->lock);
+	mutex_unlock(&fw->lock);
+	if (!cancel_work_sync(&fw->work))
+		return;
+
+	// Queued but never run, firmware_work() did not finish what firmware_start() began
+	mutex_lock(&fw->lock);
+	fw->error = -ECANCELED;
+	fw->state = FIRMWARE_FAILED;
+	mutex_unlock(&fw->lock);
+	atomic_dec(&slot->access_count);
+}
@@ -0,0 +1,47 @@
+#ifndef FIRMWARE_H_
+#define FIRMWARE_H_
+
+#include <linux/types.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+
+#define FIRMWARE_NAME_MAX 128
+#define FIRMWARE_RECORD_HEADER 2	// Big endian payload length
+#define BOOTLOADER_STATE_ACTIVE 2	// Device in bootloader mode
+#define FIRMWARE_STATUS_ERROR 0x01	// Response status of a rejected record, like DESCRIPTOR_ERROR_CODE
+
+struct Slot;
+
+enum firmware_state {
+	FIRMWARE_IDLE,
+	FIRMWARE_RUNNING,
+	FIRMWARE_DONE,
+	FIRMWARE_FAILED,
+};
+
+/*
+ * Firmware upload of one slot, the image is loaded with request_firmware().
+ * An image is a sequence of records: payload length (2 bytes, big endian) followed by one request payload starting with
+ * the class identifier, as it would be written to /dev/slotX. Records are sent back to back, each response must answer
+ * the class and command of its request with a status other than FIRMWARE_STATUS_ERROR.
+ */
+struct firmware_upload {
+	struct work_struct work;
+	struct mutex lock;	// Protects name and state changes
+	char name[FIRMWARE_NAME_MAX];
+	enum firmware_state state;
+	int error;
+	size_t size;		// Image bytes
+	size_t done;		// Image bytes acknowledged by the device
+	u32 records;
+	u64 elapsed_us;
+	u32 frame_size;		// Negotiated for the upload
+	u32 sclk_khz;
+};
+
+void firmware_init(struct firmware_upload *fw);
+int firmware_start(struct Slot *slot, const char *name);
+void firmware_cancel(struct Slot *slot);
+const char *firmware_state_name(enum firmware_state state);
+
+#endif
@@ -2,3 +2,4 @@
 export VERSION_CONTROL=none  # Disable backup files
 indent -linux -l160 -i8 *.c
 indent -linux -l160 -i8 *.h
+indent -linux -l160 -i8 emulator/*.c
@@ -0,0 +1,681 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include "libsdbp.h"
+#include "../sdbp_uapi.h"
+
+#define SYSFS_PATH "/sys/class/sdbp/slot%d/%s"
+#define DEV_PATH "/dev/slot%d"
+#define FANOUT_PATH "/dev/sdbp"
+#define DESCRIPTOR_RETRIES 10
+#define DESCRIPTOR_RETRY_US 1000
+
+struct queue_entry {
+	struct sdbp_xfer *xfer;
+	struct queue_entry *next;
+};
+
+struct sdbp_handle {
+	int slot;
+	int fd;
+	int rid_fd;
+	pthread_mutex_t io_lock;	// One write/read pair at a time
+	struct sdbp_descriptor descriptor;
+	int descriptor_valid;
+
+	// Asynchronous transfers
+	pthread_t worker;
+	int worker_running;
+	int event_fd;
+	pthread_mutex_t queue_lock;
+	pthread_cond_t queue_cond;
+	pthread_cond_t idle_cond;
+	struct queue_entry *head;
+	struct queue_entry *tail;
+	int busy;
+	int stop;
+};
+
+struct sdbp_notifier {
+	int slot;
+	int pending_fd;		// "notification_pending", -1 in fallback mode
+	int event_fd;		// Fallback mode only
+	pthread_t thread;
+	int thread_running;
+	pthread_mutex_t lock;
+	unsigned char data[SDBP_MAX_FRAME_SIZE];
+	ssize_t data_len;	// Fallback mode: buffered notification or negative errno
+};
+
+static int open_attribute(int slot, const char *name)
+{
+	char path[128];
+
+	snprintf(path, sizeof(path), SYSFS_PATH, slot, name);
+	return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+// sysfs attributes are re-read from offset 0 with a single syscall.
+static ssize_t pread_attribute(int fd, char *buf, size_t size)
+{
+	ssize_t ret;
+
+	do {
+		ret = pread(fd, buf, size - 1, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return -errno;
+	buf[ret] = '\0';
+	return ret;
+}
+
+static ssize_t read_attribute(int slot, const char *name, char *buf, size_t size)
+{
+	ssize_t ret;
+	int fd = open_attribute(slot, name);
+
+	if (fd < 0)
+		return -errno;
+	ret = pread_attribute(fd, buf, size);
+	close(fd);
+	return ret;
+}
+
+static int read_attribute_u32(int slot, const char *name, uint32_t *value)
+{
+	char buf[32];
+	ssize_t ret = read_attribute(slot, name, buf, sizeof(buf));
+
+	if (ret < 0)
+		return ret;
+	*value = strtoul(buf, NULL, 0);
+	return 0;
+}
+
+static void copy_string(char *dst, size_t size, const __u8 *src, size_t len)
+{
+	len = len ? len - 1 : 0;	// len includes the null byte
+	if (len > size - 1)
+		len = size - 1;
+	memcpy(dst, src, len);
+	dst[len] = '\0';
+}
+
+// One read of "descriptor_bin", formatted like the text attributes. -ENOENT for drivers without it.
+static int read_descriptor_bin(int slot, struct sdbp_descriptor *d)
+{
+	struct sdbp_descriptor_bin bin;
+	ssize_t ret;
+	int fd = open_attribute(slot, "descriptor_bin");
+	int i, pos;
+
+	if (fd < 0)
+		return -errno;
+	do {
+		ret = pread(fd, &bin, sizeof(bin), 0);
+	} while (ret < 0 && errno == EINTR);
+	close(fd);
+	if (ret < 0)
+		return -errno;
+	// Later layouts only append fields
+	if ((size_t)ret < sizeof(bin) || bin.version < SDBP_DESCRIPTOR_BIN_VERSION || bin.size < sizeof(bin))
+		return -EPROTO;
+
+	copy_string(d->vendor_product_id, sizeof(d->vendor_product_id), bin.vendor_product_id, bin.vendor_product_id_len);
+	copy_string(d->vendor_name, sizeof(d->vendor_name), bin.vendor_name, bin.vendor_name_len);
+	copy_string(d->product_name, sizeof(d->product_name), bin.product_name, bin.product_name_len);
+	for (i = 0, pos = 0; i < 16; i += 2)
+		pos += snprintf(d->serial_code + pos, sizeof(d->serial_code) - pos, "%s%02X%02X", i ? "-" : "", bin.serial_code[i], bin.serial_code[i + 1]);
+	snprintf(d->fw_version, sizeof(d->fw_version), "%c.%05u.%05u.%05u", bin.fw_version.stability, bin.fw_version.major, bin.fw_version.minor,
+		 bin.fw_version.patch);
+	snprintf(d->hw_version, sizeof(d->hw_version), "%05u.%05u.%05u", bin.hw_version.major, bin.hw_version.minor, bin.hw_version.patch);
+	snprintf(d->protocol_version, sizeof(d->protocol_version), "%05u.%05u.%05u", bin.protocol_version.major, bin.protocol_version.minor,
+		 bin.protocol_version.patch);
+	snprintf(d->bootloader_state, sizeof(d->bootloader_state), "%u", bin.bootloader_state);
+	d->max_power_3v3 = bin.max_power_3v3;
+	d->max_power_5v0 = bin.max_power_5v0;
+	d->max_power_12v = bin.max_power_12v;
+	d->max_sclk_speed = bin.max_sclk_speed;
+	d->max_frame_size = bin.max_frame_size;
+	d->rid = bin.rid;
+	return 0;
+}
+
+int sdbp_read_descriptor(int slot, struct sdbp_descriptor *d)
+{
+	struct {
+		const char *name;
+		char *buf;
+		size_t size;
+	} strings[] = {
+		{"vendor_product_id", d->vendor_product_id, sizeof(d->vendor_product_id)},
+		{"vendor_name", d->vendor_name, sizeof(d->vendor_name)},
+		{"product_name", d->product_name, sizeof(d->product_name)},
+		{"serial_code", d->serial_code, sizeof(d->serial_code)},
+		{"fw_version", d->fw_version, sizeof(d->fw_version)},
+		{"hw_version", d->hw_version, sizeof(d->hw_version)},
+		{"protocol_version", d->protocol_version, sizeof(d->protocol_version)},
+		{"bootloader_state", d->bootloader_state, sizeof(d->bootloader_state)},
+	};
+	struct {
+		const char *name;
+		uint32_t *value;
+	} numbers[] = {
+		{"max_power_3v3", &d->max_power_3v3},
+		{"max_power_5v0", &d->max_power_5v0},
+		{"max_power_12v", &d->max_power_12v},
+		{"max_sclk_speed", &d->max_sclk_speed},
+		{"max_frame_size", &d->max_frame_size},
+	};
+	uint32_t rid_after = 0;
+	int tries = 0;
+	ssize_t ret;
+	size_t i;
+
+	// -EAGAIN while the driver updates the descriptor, a device stuck in updates is reported instead of spinning on it
+	while ((ret = read_descriptor_bin(slot, d)) == -EAGAIN && ++tries < DESCRIPTOR_RETRIES)
+		usleep(DESCRIPTOR_RETRY_US);
+	if (ret != -ENOENT)
+		return ret;
+
+	// Drivers without descriptor_bin
+	tries = 0;
+	do {
+		if (tries)
+			usleep(DESCRIPTOR_RETRY_US);
+		ret = read_attribute_u32(slot, "rid", &d->rid);
+		for (i = 0; ret >= 0 && i < sizeof(strings) / sizeof(strings[0]); i++)
+			ret = read_attribute(slot, strings[i].name, strings[i].buf, strings[i].size);
+		for (i = 0; ret >= 0 && i < sizeof(numbers) / sizeof(numbers[0]); i++)
+			ret = read_attribute_u32(slot, numbers[i].name, numbers[i].value);
+		if (ret >= 0)
+			ret = read_attribute_u32(slot, "rid", &rid_after);
+		// The descriptor was updated while reading it, start over
+		if (ret >= 0 && rid_after != d->rid)
+			ret = -EAGAIN;
+	} while (ret == -EAGAIN && ++tries < DESCRIPTOR_RETRIES);
+
+	return ret < 0 ? ret : 0;
+}
+
+int sdbp_open(int slot, struct sdbp_handle **handle)
+{
+	struct sdbp_handle *h;
+	char path[64];
+
+	h = calloc(1, sizeof(*h));
+	if (!h)
+		return -ENOMEM;
+
+	snprintf(path, sizeof(path), DEV_PATH, slot);
+	h->fd = open(path, O_RDWR | O_CLOEXEC);	// Never buffered, see README
+	if (h->fd < 0) {
+		int err = -errno;
+		free(h);
+		return err;
+	}
+	h->slot = slot;
+	h->rid_fd = -1;
+	h->event_fd = -1;
+	pthread_mutex_init(&h->io_lock, NULL);
+	pthread_mutex_init(&h->queue_lock, NULL);
+	pthread_cond_init(&h->queue_cond, NULL);
+	pthread_cond_init(&h->idle_cond, NULL);
+	*handle = h;
+	return 0;
+}
+
+void sdbp_close(struct sdbp_handle *h)
+{
+	if (!h)
+		return;
+
+	if (h->worker_running) {
+		pthread_mutex_lock(&h->queue_lock);
+		h->stop = 1;
+		pthread_cond_signal(&h->queue_cond);
+		pthread_mutex_unlock(&h->queue_lock);
+		pthread_join(h->worker, NULL);
+	}
+	if (h->event_fd >= 0)
+		close(h->event_fd);
+	if (h->rid_fd >= 0)
+		close(h->rid_fd);
+	close(h->fd);
+	pthread_mutex_destroy(&h->io_lock);
+	pthread_mutex_destroy(&h->queue_lock);
+	pthread_cond_destroy(&h->queue_cond);
+	pthread_cond_destroy(&h->idle_cond);
+	free(h);
+}
+
+int sdbp_slot(struct sdbp_handle *h)
+{
+	return h->slot;
+}
+
+int sdbp_load_descriptor(struct sdbp_handle *h, const struct sdbp_descriptor **descriptor)
+{
+	char buf[32];
+	ssize_t ret;
+
+	if (h->rid_fd < 0) {
+		h->rid_fd = open_attribute(h->slot, "rid");
+		if (h->rid_fd < 0)
+			return -errno;
+	}
+
+	// Fast path: one pread() while the descriptor id is unchanged
+	if (h->descriptor_valid) {
+		ret = pread_attribute(h->rid_fd, buf, sizeof(buf));
+		if (ret >= 0 && strtoul(buf, NULL, 0) == h->descriptor.rid) {
+			*descriptor = &h->descriptor;
+			return 0;
+		}
+	}
+
+	h->descriptor_valid = 0;
+	ret = sdbp_read_descriptor(h->slot, &h->descriptor);
+	if (ret < 0)
+		return ret;
+	h->descriptor_valid = 1;
+	*descriptor = &h->descriptor;
+	return 0;
+}
+
+static ssize_t transact_locked(struct sdbp_handle *h, const void *tx, size_t tx_len, void *rx, size_t rx_size)
+{
+	ssize_t ret;
+
+	do {
+		ret = write(h->fd, tx, tx_len);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return -errno;
+	if ((size_t)ret != tx_len)
+		return -EIO;
+
+	if (!rx)
+		return 0;
+
+	do {
+		ret = read(h->fd, rx, rx_size);
+	} while (ret < 0 && errno == EINTR);
+	return ret < 0 ? -errno : ret;
+}
+
+ssize_t sdbp_transact(struct sdbp_handle *h, const void *tx, size_t tx_len, void *rx, size_t rx_size)
+{
+	ssize_t ret;
+
+	pthread_mutex_lock(&h->io_lock);
+	ret = transact_locked(h, tx, tx_len, rx, rx_size);
+	pthread_mutex_unlock(&h->io_lock);
+	return ret;
+}
+
+// Executes the transfers back to back without releasing the handle, stops at the first error.
+int sdbp_transact_batch(struct sdbp_handle *h, struct sdbp_xfer *xfers, int cnt)
+{
+	int ret;
+	int i;
+
+	pthread_mutex_lock(&h->io_lock);
+	for (i = 0; i < cnt; i++) {
+		xfers[i].result = transact_locked(h, xfers[i].tx, xfers[i].tx_len, xfers[i].rx, xfers[i].rx_size);
+		if (xfers[i].result < 0)
+			break;
+	}
+	pthread_mutex_unlock(&h->io_lock);
+	while (++i < cnt)
+		xfers[i].result = -ECANCELED;
+
+	ret = cnt;
+	for (i = 0; i < cnt; i++) {
+		if (xfers[i].complete)
+			xfers[i].complete(&xfers[i], xfers[i].context);
+		if (ret == cnt && xfers[i].result < 0)
+			ret = xfers[i].result;
+	}
+	return ret;
+}
+
+ssize_t sdbp_fanout(uint64_t slot_mask, const void *tx, size_t tx_len, void *results, size_t size)
+{
+	struct sdbp_fanout_request *request;
+	ssize_t ret;
+	int fd;
+
+	if (tx_len > SDBP_MAX_FRAME_SIZE - SDBP_HEADER_SIZE)
+		return -EMSGSIZE;
+	request = malloc(sizeof(*request) + tx_len);
+	if (!request)
+		return -ENOMEM;
+	request->slot_mask = slot_mask;
+	request->length = tx_len;
+	memcpy(request->payload, tx, tx_len);
+
+	fd = open(FANOUT_PATH, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		ret = -errno;
+		goto free;
+	}
+	do {
+		ret = write(fd, request, sizeof(*request) + tx_len);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0) {
+		ret = -errno;
+		goto close;
+	}
+	do {
+		ret = read(fd, results, size);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		ret = -errno;
+
+ close:
+	close(fd);
+ free:
+	free(request);
+	return ret;
+}
+
+static void *async_worker(void *arg)
+{
+	struct sdbp_handle *h = arg;
+	struct queue_entry *entry;
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&h->queue_lock);
+	for (;;) {
+		while (!h->head && !h->stop) {
+			h->busy = 0;
+			pthread_cond_broadcast(&h->idle_cond);
+			pthread_cond_wait(&h->queue_cond, &h->queue_lock);
+		}
+		if (!h->head)
+			break;
+		entry = h->head;
+		h->head = entry->next;
+		if (!h->head)
+			h->tail = NULL;
+		h->busy = 1;
+		pthread_mutex_unlock(&h->queue_lock);
+
+		entry->xfer->result = sdbp_transact(h, entry->xfer->tx, entry->xfer->tx_len, entry->xfer->rx, entry->xfer->rx_size);
+		if (entry->xfer->complete)
+			entry->xfer->complete(entry->xfer, entry->xfer->context);
+		free(entry);
+		if (write(h->event_fd, &one, sizeof(one)) < 0)
+			perror("libsdbp: eventfd");
+
+		pthread_mutex_lock(&h->queue_lock);
+	}
+	h->busy = 0;
+	pthread_cond_broadcast(&h->idle_cond);
+	pthread_mutex_unlock(&h->queue_lock);
+	return NULL;
+}
+
+static int start_worker(struct sdbp_handle *h)
+{
+	int ret;
+
+	if (h->worker_running)
+		return 0;
+
+	h->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (h->event_fd < 0)
+		return -errno;
+	ret = pthread_create(&h->worker, NULL, async_worker, h);
+	if (ret != 0) {
+		close(h->event_fd);
+		h->event_fd = -1;
+		return -ret;
+	}
+	h->worker_running = 1;
+	return 0;
+}
+
+int sdbp_submit(struct sdbp_handle *h, struct sdbp_xfer *xfer)
+{
+	struct queue_entry *entry;
+	int ret;
+
+	pthread_mutex_lock(&h->queue_lock);
+	ret = start_worker(h);
+	if (ret < 0) {
+		pthread_mutex_unlock(&h->queue_lock);
+		return ret;
+	}
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry) {
+		pthread_mutex_unlock(&h->queue_lock);
+		return -ENOMEM;
+	}
+	entry->xfer = xfer;
+	if (h->tail)
+		h->tail->next = entry;
+	else
+		h->head = entry;
+	h->tail = entry;
+	h->busy = 1;
+	pthread_cond_signal(&h->queue_cond);
+	pthread_mutex_unlock(&h->queue_lock);
+	return 0;
+}
+
+int sdbp_completion_fd(struct sdbp_handle *h)
+{
+	int ret;
+
+	pthread_mutex_lock(&h->queue_lock);
+	ret = start_worker(h);
+	pthread_mutex_unlock(&h->queue_lock);
+	return ret < 0 ? ret : h->event_fd;
+}
+
+// Waits until all submitted transfers completed.
+int sdbp_flush(struct sdbp_handle *h)
+{
+	pthread_mutex_lock(&h->queue_lock);
+	while (h->busy)
+		pthread_cond_wait(&h->idle_cond, &h->queue_lock);
+	pthread_mutex_unlock(&h->queue_lock);
+	return 0;
+}
+
+static int hex_value(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+// The driver returns notifications ASCII encoded ("0x12AB..").
+static ssize_t decode_notification(const char *hex, unsigned char *data, size_t size)
+{
+	size_t i = 0;
+	int high, low;
+
+	if (hex[0] != '0' || hex[1] != 'x')
+		return -EPROTO;
+	hex += 2;
+
+	while (hex[0] && hex[1]) {
+		high = hex_value(hex[0]);
+		low = hex_value(hex[1]);
+		if (high < 0 || low < 0)
+			return -EPROTO;
+		if (i >= size)
+			return -EMSGSIZE;
+		data[i++] = high << 4 | low;
+		hex += 2;
+	}
+	return i;
+}
+
+// Blocks until a notification is available.
+static ssize_t read_notification(int slot, unsigned char *data, size_t size)
+{
+	char *hex;
+	ssize_t ret;
+
+	hex = malloc(2 * SDBP_MAX_FRAME_SIZE + 3);
+	if (!hex)
+		return -ENOMEM;
+	ret = read_attribute(slot, "notification", hex, 2 * SDBP_MAX_FRAME_SIZE + 3);
+	if (ret >= 0)
+		ret = decode_notification(hex, data, size);
+	free(hex);
+	return ret;
+}
+
+static void *notifier_thread(void *arg)
+{
+	struct sdbp_notifier *n = arg;
+	unsigned char data[SDBP_MAX_FRAME_SIZE];
+	uint64_t one = 1;
+	ssize_t ret;
+
+	do {
+		ret = read_notification(n->slot, data, sizeof(data));
+		if (ret == -EIO || ret == -EINTR)
+			continue;	// Read aborted by the driver, retry
+		pthread_mutex_lock(&n->lock);
+		if (ret > 0)
+			memcpy(n->data, data, ret);
+		n->data_len = ret;
+		pthread_mutex_unlock(&n->lock);
+		if (write(n->event_fd, &one, sizeof(one)) < 0)
+			perror("libsdbp: eventfd");
+	} while (ret >= 0);
+	return NULL;
+}
+
+int sdbp_notifier_open(int slot, struct sdbp_notifier **notifier)
+{
+	struct sdbp_notifier *n;
+	char buf[16];
+	int ret;
+
+	n = calloc(1, sizeof(*n));
+	if (!n)
+		return -ENOMEM;
+	n->slot = slot;
+	n->event_fd = -1;
+	pthread_mutex_init(&n->lock, NULL);
+
+	n->pending_fd = open_attribute(slot, "notification_pending");
+	if (n->pending_fd >= 0) {
+		// sysfs only reports POLLPRI after the attribute has been read once
+		pread_attribute(n->pending_fd, buf, sizeof(buf));
+		*notifier = n;
+		return 0;
+	}
+
+	// Fallback for drivers without "notification_pending": a thread blocks on "notification"
+	n->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (n->event_fd < 0) {
+		ret = -errno;
+		goto error;
+	}
+	ret = -pthread_create(&n->thread, NULL, notifier_thread, n);
+	if (ret < 0)
+		goto error;
+	n->thread_running = 1;
+	*notifier = n;
+	return 0;
+
+ error:
+	if (n->event_fd >= 0)
+		close(n->event_fd);
+	pthread_mutex_destroy(&n->lock);
+	free(n);
+	return ret;
+}
+
+void sdbp_notifier_close(struct sdbp_notifier *n)
+{
+	if (!n)
+		return;
+
+	if (n->thread_running) {
+		pthread_cancel(n->thread);
+		pthread_join(n->thread, NULL);
+	}
+	if (n->pending_fd >= 0)
+		close(n->pending_fd);
+	if (n->event_fd >= 0)
+		close(n->event_fd);
+	pthread_mutex_destroy(&n->lock);
+	free(n);
+}
+
+int sdbp_notifier_fd(struct sdbp_notifier *n)
+{
+	return n->pending_fd >= 0 ? n->pending_fd : n->event_fd;
+}
+
+// Returns the notification payload, -EAGAIN if none is pending and -ENODEV after a disconnect.
+ssize_t sdbp_notifier_read(struct sdbp_notifier *n, void *buf, size_t size)
+{
+	char pending[16];
+	uint64_t cnt;
+	ssize_t ret;
+
+	if (n->pending_fd >= 0) {
+		ret = pread_attribute(n->pending_fd, pending, sizeof(pending));	// Also re-arms POLLPRI
+		if (ret < 0)
+			return ret;
+		if (strtol(pending, NULL, 0) == 0)
+			return -EAGAIN;
+		return read_notification(n->slot, buf, size);
+	}
+
+	if (read(n->event_fd, &cnt, sizeof(cnt)) < 0)
+		return -errno;
+	pthread_mutex_lock(&n->lock);
+	ret = n->data_len;
+	if (ret > (ssize_t) size)
+		ret = -EMSGSIZE;
+	else if (ret > 0)
+		memcpy(buf, n->data, ret);
+	pthread_mutex_unlock(&n->lock);
+	return ret;
+}
+
+const char *sdbp_strerror(int err)
+{
+	switch (err < 0 ? -err : err) {
+	case 0:
+		return "Success";
+	case EBADSLT:
+		return "Slot not present or device not connected";
+	case EBUSY:
+		return "Slot (or its notification attribute) is already opened";
+	case EMSGSIZE:
+		return "Payload exceeds the frame size or receive buffer too small";
+	case ECOMM:
+		return "SDBP exchange failed (CRC, timeout or transaction error), see the slot stats";
+	case ENODEV:
+		return "Device disconnected";
+	case EWOULDBLOCK:
+		return "No response available (read without write) or non-blocking access";
+	case EPROTO:
+		return "Malformed notification data";
+	default:
+		return strerror(err < 0 ? -err : err);
+	}
+}
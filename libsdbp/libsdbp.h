@@ -0,0 +1,108 @@
+#ifndef LIBSDBP_H_
+#define LIBSDBP_H_
+
+/*
+ * libsdbp - user space client library for the sdbpk kernel driver.
+ *
+ * All functions return 0 (or a byte count) on success and a negative errno on failure,
+ * sdbp_strerror() decodes the driver specific meaning.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SDBP_MAX_FRAME_SIZE 4096
+#define SDBP_HEADER_SIZE 6	// Frame header (4) + CRC16 (2)
+#define SDBP_DEFAULT_FRAME_SIZE 64
+
+struct sdbp_descriptor {
+	char vendor_product_id[256];
+	char vendor_name[256];
+	char product_name[256];
+	char serial_code[40];
+	char fw_version[32];
+	char hw_version[32];
+	char protocol_version[32];
+	char bootloader_state[32];
+	uint32_t max_power_3v3;
+	uint32_t max_power_5v0;
+	uint32_t max_power_12v;
+	uint32_t max_sclk_speed;
+	uint32_t max_frame_size;
+	uint32_t rid;		// Changes whenever the device updates its descriptor
+};
+
+struct sdbp_handle;
+struct sdbp_notifier;
+
+// One request/response pair, payload starts with the class identifier (header and CRC are added by the driver).
+struct sdbp_xfer {
+	const void *tx;
+	size_t tx_len;
+	void *rx;
+	size_t rx_size;
+	ssize_t result;		// Response length or negative errno
+	void (*complete)(struct sdbp_xfer *xfer, void *context);
+	void *context;
+};
+
+/* Slot handle, exclusive per slot (-EBUSY) */
+int sdbp_open(int slot, struct sdbp_handle **handle);
+void sdbp_close(struct sdbp_handle *handle);
+int sdbp_slot(struct sdbp_handle *handle);
+
+/*
+ * Descriptor.
+ * The descriptor is cached per handle, a reload only reads "rid" and returns the cache if it is unchanged.
+ * sdbp_read_descriptor() retries a descriptor which changes while it is read for about 10 ms, then it returns -EAGAIN.
+ */
+int sdbp_read_descriptor(int slot, struct sdbp_descriptor *descriptor);
+int sdbp_load_descriptor(struct sdbp_handle *handle, const struct sdbp_descriptor **descriptor);
+
+/*
+ * Blocking transactions.
+ * A batch runs back to back and stops at the first error, it returns cnt or the first error
+ * (transfers not executed complete with -ECANCELED).
+ */
+ssize_t sdbp_transact(struct sdbp_handle *handle, const void *tx, size_t tx_len, void *rx, size_t rx_size);
+int sdbp_transact_batch(struct sdbp_handle *handle, struct sdbp_xfer *xfers, int cnt);
+
+/*
+ * Asynchronous transactions.
+ * Requests are executed in submission order by a per-handle worker thread, the complete callback runs on that thread.
+ * sdbp_completion_fd() returns an eventfd which is readable when transfers completed (usable with epoll).
+ */
+int sdbp_submit(struct sdbp_handle *handle, struct sdbp_xfer *xfer);
+int sdbp_completion_fd(struct sdbp_handle *handle);
+int sdbp_flush(struct sdbp_handle *handle);
+
+/*
+ * Fan-out.
+ * Sends one request to every slot in slot_mask (bit n selects slot n) through /dev/sdbp, slots on different SPI buses run
+ * in parallel. results receives one struct sdbp_fanout_result (sdbp_uapi.h) per slot, each followed by its response
+ * padded to 8 bytes. Returns the total result size, per slot errors are reported in the results.
+ */
+ssize_t sdbp_fanout(uint64_t slot_mask, const void *tx, size_t tx_len, void *results, size_t size);
+
+/*
+ * Notifications.
+ * sdbp_notifier_fd() returns a file descriptor for epoll/poll, watch for EPOLLPRI (and EPOLLIN for the fallback).
+ * Drivers with the "notification_pending" attribute are polled directly, older drivers use a helper thread.
+ */
+int sdbp_notifier_open(int slot, struct sdbp_notifier **notifier);
+void sdbp_notifier_close(struct sdbp_notifier *notifier);
+int sdbp_notifier_fd(struct sdbp_notifier *notifier);
+ssize_t sdbp_notifier_read(struct sdbp_notifier *notifier, void *buf, size_t size);
+
+/* Error decoding */
+const char *sdbp_strerror(int err);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
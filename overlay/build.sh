@@ -1,2 +1,3 @@
 #!/bin/bash
 dtc -@ -I dts -O dtb -o spi0-free.dtbo spi0-free-overlay.dts
+dtc -@ -I dts -O dtb -o sdbp-slots.dtbo sdbp-slots-overlay.dts
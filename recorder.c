@@ -0,0 +1,119 @@
+#include <linux/slab.h>
+#include <linux/log2.h>
+#include <linux/string.h>
+#include <linux/seq_file.h>
+#include <linux/module.h>
+#include "recorder.h"
+
+static const char *const reason_names[RECORD_REASON_CNT] = {
+	[RECORD_OK] = "ok",
+	[RECORD_LENGTH] = "length",
+	[RECORD_IRQ_TIMEOUT] = "irq_timeout",
+	[RECORD_CRC] = "crc",
+	[RECORD_DUMMY] = "dummy",
+	[RECORD_ACK] = "ack",
+	[RECORD_MESSAGE_TYPE] = "message_type",
+	[RECORD_TRANSACTION_ERROR] = "transaction_error",
+	[RECORD_DESCRIPTOR] = "descriptor",
+	[RECORD_DISCONNECT] = "disconnect",
+};
+
+const char *recorder_reason_name(enum record_reason reason)
+{
+	return reason < RECORD_REASON_CNT ? reason_names[reason] : "unknown";
+}
+
+// 0 entries disables the recorder
+int recorder_init(struct frame_recorder *rec, u32 entries)
+{
+	rec->head = 0;
+	rec->entries = NULL;
+	rec->mask = 0;
+	if (entries == 0)
+		return 0;
+
+	entries = roundup_pow_of_two(min_t(u32, entries, 4096));
+	rec->entries = kcalloc(entries, sizeof(*rec->entries), GFP_KERNEL);
+	if (!rec->entries)
+		return -ENOMEM;
+	rec->mask = entries - 1;
+	return 0;
+}
+
+void recorder_free(struct frame_recorder *rec)
+{
+	kfree(rec->entries);
+	rec->entries = NULL;
+}
+
+size_t recorder_size(struct frame_recorder *rec)
+{
+	return rec->entries ? (rec->mask + 1) * sizeof(*rec->entries) : 0;
+}
+
+// Called with the bus owned, rx is NULL if no response was received
+void recorder_add(struct frame_recorder *rec, struct frame_record *record, const u8 *tx, const u8 *rx)
+{
+	struct frame_record *entry;
+	u32 number = rec->head;
+
+	if (!rec->entries)
+		return;
+
+	record->number = number;
+	record->tx_length = min_t(u16, (tx[1] << 8) | tx[2], RECORD_BYTES);
+	memcpy(record->tx, tx, record->tx_length);
+	record->rx_length = rx ? RECORD_BYTES : 0;	// Raw bytes, the length field may be corrupted
+	if (rx)
+		memcpy(record->rx, rx, RECORD_BYTES);
+
+	entry = &rec->entries[number & rec->mask];
+	WRITE_ONCE(entry->seq, 2 * number + 1);
+	smp_wmb();
+	memcpy(&entry->number, &record->number, sizeof(*entry) - offsetof(struct frame_record, number));
+	smp_wmb();
+	WRITE_ONCE(entry->seq, 2 * number + 2);
+	smp_store_release(&rec->head, number + 1);
+}
+
+static int recorder_show(struct seq_file *s, void *unused)
+{
+	struct frame_recorder *rec = s->private;
+	struct frame_record *entry;
+	struct frame_record record;
+	u32 head;
+	u32 seq;
+	u32 i;
+
+	if (!rec->entries)
+		return 0;
+
+	seq_puts(s, "number start_ns duration_us result reason retransmits_crc retransmits_ack waits frame_size sclk_speed tx rx\n");
+	head = smp_load_acquire(&rec->head);
+	for (i = head - min(head, rec->mask + 1); i != head; i++) {
+		entry = &rec->entries[i & rec->mask];
+		seq = READ_ONCE(entry->seq);
+		smp_rmb();
+		memcpy(&record, entry, sizeof(record));
+		smp_rmb();
+		if (seq != 2 * i + 2 || READ_ONCE(entry->seq) != seq)
+			continue;	// Overwritten while it was copied
+		seq_printf(s, "%u %llu %u %d %s %u %u %u %u %u %*phN %*phN%s\n", record.number, record.start_ns, record.duration_us,
+			   record.result, recorder_reason_name(record.reason), record.retransmits_crc, record.retransmits_ack, record.waits, record.frame_size,
+			   record.sclk_speed, record.tx_length, record.tx, record.rx_length, record.rx, record.rx_length ? "" : "-");
+	}
+	return 0;
+}
+
+static int recorder_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, recorder_show, inode->i_private);
+}
+
+const struct file_operations recorder_fops = {
+	.owner = THIS_MODULE,
+	.open = recorder_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
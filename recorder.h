@@ -0,0 +1,60 @@
+#ifndef RECORDER_H_
+#define RECORDER_H_
+
+#include <linux/types.h>
+#include <linux/atomic.h>
+#include <linux/fs.h>
+
+#define RECORD_BYTES 16		// Header and the start of the payload
+
+enum record_reason {
+	RECORD_OK,
+	RECORD_LENGTH,		// Request exceeds the frame buffers
+	RECORD_IRQ_TIMEOUT,
+	RECORD_CRC,		// Response CRC or length invalid
+	RECORD_DUMMY,		// Dummy frame CRC or length invalid
+	RECORD_ACK,		// Unexpected acknowledgement instead of a response
+	RECORD_MESSAGE_TYPE,
+	RECORD_TRANSACTION_ERROR,
+	RECORD_DESCRIPTOR,
+	RECORD_DISCONNECT,	// Injected disconnect
+	RECORD_REASON_CNT,
+};
+
+struct frame_record {
+	u32 seq;		// Odd while the entry is written
+	u32 number;		// Transaction number of the slot
+	u64 start_ns;		// CLOCK_MONOTONIC
+	u32 duration_us;
+	u32 frame_size;
+	u32 sclk_speed;
+	s8 result;		// Return value of exchange_sdbp()
+	u8 reason;		// enum record_reason, the failure or the last retransmit reason
+	u8 retransmits_crc;
+	u8 retransmits_ack;
+	u8 waits;
+	u8 tx_length;		// Bytes recorded
+	u8 rx_length;		// 0 without a response
+	u8 tx[RECORD_BYTES];
+	u8 rx[RECORD_BYTES];
+};
+
+/*
+ * Ring of the last exchanges of one slot. Written by the bus owner only, so adding an entry takes no lock;
+ * readers copy an entry and drop it if its seq changed meanwhile.
+ */
+struct frame_recorder {
+	struct frame_record *entries;	// NULL if disabled
+	u32 mask;
+	u32 head;		// Next transaction number
+};
+
+int recorder_init(struct frame_recorder *rec, u32 entries);
+void recorder_free(struct frame_recorder *rec);
+void recorder_add(struct frame_recorder *rec, struct frame_record *record, const u8 *tx, const u8 *rx);
+size_t recorder_size(struct frame_recorder *rec);
+const char *recorder_reason_name(enum record_reason reason);
+
+extern const struct file_operations recorder_fops;
+
+#endif
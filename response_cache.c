@@ -0,0 +1,110 @@
+#include <linux/slab.h>
+#include <linux/string.h>
+#include "response_cache.h"
+
+static u16 frame_length(const u8 *frame)
+{
+	return (frame[1] << 8) | frame[2];
+}
+
+void cache_init(struct response_cache *cache)
+{
+	mutex_init(&cache->lock);
+	cache->rid = 0;
+	cache->next = 0;
+	memset(cache->entries, 0, sizeof(cache->entries));
+}
+
+void cache_free(struct response_cache *cache)
+{
+	int i;
+
+	for (i = 0; i < CACHE_ENTRIES; i++) {
+		kfree(cache->entries[i].response);
+		cache->entries[i].response = NULL;
+		cache->entries[i].response_length = 0;
+	}
+}
+
+// Response buffers are kept for reuse, only the entries are dropped
+static void invalidate_locked(struct response_cache *cache)
+{
+	int i;
+
+	for (i = 0; i < CACHE_ENTRIES; i++)
+		cache->entries[i].response_length = 0;
+	cache->next = 0;
+}
+
+void cache_invalidate(struct response_cache *cache)
+{
+	mutex_lock(&cache->lock);
+	invalidate_locked(cache);
+	mutex_unlock(&cache->lock);
+}
+
+static struct cache_entry *find_entry(struct response_cache *cache, const u8 *request)
+{
+	u16 length = frame_length(request);
+	int i;
+
+	for (i = 0; i < CACHE_ENTRIES; i++) {
+		struct cache_entry *entry = &cache->entries[i];
+
+		if (entry->response_length && entry->request_length == length && memcmp(entry->request, request, length) == 0)
+			return entry;
+	}
+	return NULL;
+}
+
+// Copies the cached response of request into response, which must hold the slot buffer size
+bool cache_lookup(struct response_cache *cache, u32 rid, const u8 *request, u8 *response)
+{
+	struct cache_entry *entry;
+
+	if (frame_length(request) > CACHE_MAX_REQUEST)
+		return false;
+
+	mutex_lock(&cache->lock);
+	if (cache->rid != rid) {
+		invalidate_locked(cache);
+		cache->rid = rid;
+	}
+	entry = find_entry(cache, request);
+	if (entry)
+		memcpy(response, entry->response, entry->response_length);
+	mutex_unlock(&cache->lock);
+	return entry != NULL;
+}
+
+void cache_store(struct response_cache *cache, u32 rid, const u8 *request, const u8 *response)
+{
+	u16 request_length = frame_length(request);
+	u16 response_length = frame_length(response);
+	struct cache_entry *entry;
+	u8 *buffer;
+
+	if (request_length > CACHE_MAX_REQUEST || response_length == 0)
+		return;
+
+	mutex_lock(&cache->lock);
+	if (cache->rid != rid) {
+		invalidate_locked(cache);
+		cache->rid = rid;
+	}
+	entry = find_entry(cache, request);
+	if (!entry) {
+		entry = &cache->entries[cache->next];
+		cache->next = (cache->next + 1) % CACHE_ENTRIES;
+	}
+	entry->response_length = 0;
+	buffer = krealloc(entry->response, response_length, GFP_KERNEL);
+	if (buffer) {
+		entry->response = buffer;
+		memcpy(entry->request, request, request_length);
+		entry->request_length = request_length;
+		memcpy(entry->response, response, response_length);
+		entry->response_length = response_length;
+	}
+	mutex_unlock(&cache->lock);
+}
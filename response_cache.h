@@ -0,0 +1,34 @@
+#ifndef RESPONSE_CACHE_H_
+#define RESPONSE_CACHE_H_
+
+#include <linux/types.h>
+#include <linux/mutex.h>
+
+#define CACHE_ENTRIES 8
+#define CACHE_MAX_REQUEST 32	// Header included, longer requests are never cached
+
+struct cache_entry {
+	u16 request_length;
+	u16 response_length;	// 0 means unused
+	u8 request[CACHE_MAX_REQUEST];
+	u8 *response;
+};
+
+/*
+ * Per-slot cache of complete responses (header and payload, no CRC) keyed by the request frame.
+ * All entries belong to one descriptor rid, a lookup with another rid empties the cache.
+ */
+struct response_cache {
+	struct mutex lock;
+	u32 rid;
+	u8 next;		// Replaced next when the cache is full
+	struct cache_entry entries[CACHE_ENTRIES];
+};
+
+void cache_init(struct response_cache *cache);
+void cache_free(struct response_cache *cache);
+void cache_invalidate(struct response_cache *cache);
+bool cache_lookup(struct response_cache *cache, u32 rid, const u8 *request, u8 *response);
+void cache_store(struct response_cache *cache, u32 rid, const u8 *request, const u8 *response);
+
+#endif
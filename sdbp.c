@@ -2,7 +2,7 @@
 #include <linux/module.h>
 #include <linux/gpio.h>
 #include <linux/delay.h>
-#include <linux/kthread.h>
+#include <linux/workqueue.h>
 #include <linux/semaphore.h>
 #include <linux/spinlock.h>
 #include <linux/uaccess.h>
@@ -12,21 +12,97 @@
 #include <linux/spi/spi.h>
 #include <linux/gpio.h>
 #include <linux/interrupt.h>
+#include <linux/idr.h>
+#include <linux/of.h>
+#include <linux/of_gpio.h>
+#include <linux/version.h>
+#include <linux/pm_runtime.h>
+#include <linux/log2.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <uapi/linux/sched/types.h>
 #include "sdbp.h"
 #include "descriptor.h"
 #include "communication.h"
 #include "attributes.h"
+#include "fanout.h"
+#include "sdbp_uapi.h"
 #include "debug.h"
 
-static struct Slot *slot_list[MINOR_DEVICES];
+static DEFINE_IDR(slot_idr);
+static DEFINE_MUTEX(slot_lock);
 static dev_t major_device_number;
 static struct cdev *driver_object;
 static struct class *sdbp_class;
+static struct workqueue_struct *sdbp_wq;
+static struct dentry *debugfs_root;
 
 static bool spi_bus[3];
 static int bus_cnt = 0;
 module_param_array(spi_bus, bool, &bus_cnt, S_IRUGO);
-MODULE_PARM_DESC(spi_bus, " Selective SPI bus configuration, false means bus is not used. (bus=1,1,1)");
+MODULE_PARM_DESC(spi_bus, " Selective SPI bus configuration of the legacy slot table, false means bus is not used. (bus=1,1,1)");
+
+static int max_slots = DEFAULT_MAX_SLOTS;
+module_param(max_slots, int, S_IRUGO);
+MODULE_PARM_DESC(max_slots, " Number of minor numbers (slots) reserved for /dev/slotX. (default=64)");
+
+static const struct sdbp_slot_config legacy_slots[] = {
+	{0, BUS_0_CS_0_INT},
+	{1, BUS_0_CS_1_INT},
+	{2, BUS_1_CS_0_INT},
+	{3, BUS_1_CS_1_INT},
+	{4, BUS_1_CS_2_INT},
+	{5, BUS_2_CS_0_INT},
+	{6, BUS_2_CS_1_INT},
+	{7, BUS_2_CS_2_INT},
+};
+
+static struct spi_device *legacy_devices[ARRAY_SIZE(legacy_slots)];
+static bool legacy_disabled[ARRAY_SIZE(legacy_slots)];
+static struct delayed_work legacy_work;
+static u8 legacy_tries;
+
+static unsigned int keepalive_ms = 0;
+module_param(keepalive_ms, uint, S_IRUGO);
+MODULE_PARM_DESC(keepalive_ms, " Default idle time in ms before a closed slot is reset, 0 resets on close. (default=0)");
+
+static int autosuspend_ms = 2000;
+module_param(autosuspend_ms, int, S_IRUGO);
+MODULE_PARM_DESC(autosuspend_ms, " Idle time in ms before a slot is suspended by runtime PM, negative disables autosuspend. A notification on an idle slot costs a MODE_RUN and a MODE_SUSPEND exchange. (default=2000)");
+
+static bool auto_frame_size = true;
+module_param(auto_frame_size, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(auto_frame_size, " Writes exceeding the frame size increase it up to the maximum frame size of the device. (default=1)");
+
+static bool response_cache = false;
+module_param(response_cache, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(response_cache, " Repeated writes of cacheable requests are answered from a per-slot cache without a bus transfer. (default=0)");
+
+static ushort cache_commands[16] = { 0x0102 };
+
+static int cache_commands_cnt = 1;
+module_param_array(cache_commands, ushort, &cache_commands_cnt, S_IRUGO);
+MODULE_PARM_DESC(cache_commands, " Idempotent requests served by the response cache as class << 8 | command. (default=0x0102 descriptor GETs)");
+
+static int max_workers = 4;
+module_param(max_workers, int, S_IRUGO);
+MODULE_PARM_DESC(max_workers, " Maximum number of slot workers running concurrently, independent of the slot count. (default=4)");
+
+static unsigned int notification_queue = 16384;
+module_param(notification_queue, uint, S_IRUGO);
+MODULE_PARM_DESC(notification_queue, " Size in bytes of the per-slot notification queue, the oldest notifications are dropped when it is full. (default=16384)");
+
+static int rt_priority = 0;
+module_param(rt_priority, int, S_IRUGO);
+MODULE_PARM_DESC(rt_priority, " SCHED_FIFO priority (1-99) of a dedicated worker thread per slot, 0 runs the slots on the shared workqueue. (default=0)");
+
+static unsigned int recorder_entries = 32;
+module_param(recorder_entries, uint, S_IRUGO);
+MODULE_PARM_DESC(recorder_entries, " Exchanges kept per slot in debugfs (sdbp/slotX/frames), rounded up to a power of two, 0 disables it. (default=32)");
+
+static char *cpu_affinity = "";
+module_param(cpu_affinity, charp, S_IRUGO);
+MODULE_PARM_DESC(cpu_affinity, " CPU list (e.g. 2-3) of the slot worker threads and slot interrupts, empty means all CPUs. (default=\"\")");
 
 void print_struct(struct Slot *slot)
 {
@@ -42,6 +118,78 @@ void print_struct(struct Slot *slot)
 	PRINT_DBG("interrupt_arrived : %d\n", atomic_read(&slot->interrupt_arrived));
 }
 
+static struct Slot *lookup_slot(int minor)
+{
+	struct Slot *slot = idr_find(&slot_idr, minor);
+
+	if (slot == NULL || !slot->valid)
+		return NULL;
+	return slot;
+}
+
+// The slot work runs on the dedicated RT worker once the slot has one, otherwise on the shared workqueue.
+static void slot_queue_work(struct Slot *slot, unsigned long delay)
+{
+	struct kthread_worker *worker = smp_load_acquire(&slot->worker);
+
+	if (worker)
+		kthread_queue_delayed_work(worker, &slot->rt_work, delay);
+	else
+		queue_delayed_work(sdbp_wq, &slot->work, delay);
+}
+
+void sdbp_kick(struct Slot *slot)
+{
+	if (slot->state == SLOT_STATE_CONNECTED && !atomic_read(&slot->stop)) {
+		atomic64_cmpxchg(&slot->kick_time, 0, ktime_get());	// Scheduling latency is measured from the first kick
+		slot_queue_work(slot, 0);
+	}
+}
+
+void release_bus(struct Slot *slot)
+{
+	bus_release(&slot->bus);
+	if (atomic_read(&slot->notification_arrived))
+		sdbp_kick(slot);	// Notification fetch was deferred while the bus was busy
+}
+
+static int slot_pm_get(struct Slot *slot)
+{
+	return pm_runtime_resume_and_get(&slot->spi_device->dev);
+}
+
+// Worker side of slot_pm_get(), the resume waits for the bus and therefore runs on pm_wq instead of the shared workqueue.
+// Returns -EINPROGRESS until the device is active, the usage count is kept in between.
+static int slot_pm_get_nowait(struct Slot *slot)
+{
+	struct device *dev = &slot->spi_device->dev;
+	int ret;
+
+	if (!slot->pm_resuming) {
+		ret = pm_runtime_get(dev);
+		if (ret < 0 && ret != -EINPROGRESS) {
+			pm_runtime_put_noidle(dev);
+			return ret;
+		}
+		slot->pm_resuming = true;
+		if (ret != 1)
+			stats_inc(&slot->stats, STAT_NOTIFICATION_RESUMES);	// Device was suspended, the fetch pays a MODE_RUN and later a MODE_SUSPEND
+	}
+	ret = READ_ONCE(dev->power.runtime_error);
+	if (ret == 0 && !pm_runtime_active(dev))
+		return -EINPROGRESS;
+	slot->pm_resuming = false;
+	if (ret)
+		pm_runtime_put_noidle(dev);
+	return ret;
+}
+
+static void slot_pm_put(struct Slot *slot)
+{
+	pm_runtime_mark_last_busy(&slot->spi_device->dev);
+	pm_runtime_put_autosuspend(&slot->spi_device->dev);
+}
+
 static struct bus_type sdbp_bus = {
 	.name = "sdbp",
 };
@@ -54,288 +202,497 @@ static struct device_driver sdbp_driver = {
 
 static int driver_open(struct inode *device_file, struct file *instance)
 {
-	u8 i;
+	struct Slot *slot;
 	int minor_number = iminor(file_dentry(instance)->d_inode);
 
 	PRINT_DBG("Driver open called!\n");
-	for (i = 0; i < MINOR_DEVICES; i++) {
-		if (slot_list[i] != NULL) {
-			if (slot_list[i]->valid && slot_list[i]->number == minor_number) {
-				if (atomic_inc_and_test(&slot_list[i]->access_count)) {
-					PRINT_DBG("Driver open done ok!\n");
-					return 0;
-				}
-				PRINT_DBG("Driver open done EBUSY!\n");
-				atomic_dec(&slot_list[i]->access_count);
-				return -EBUSY;
-			}
-		}
+	// The file pins the slot until it is closed, release_slot() waits for it
+	slot = get_slot_ref(minor_number);
+	if (slot == NULL || !slot->valid) {
+		PRINT_DBG("Driver open EBADSLT called!\n");
+		if (slot)
+			put_slot(slot);
+		return -EBADSLT;
 	}
 
-	PRINT_DBG("Driver open EBADSLT called!\n");
-	return -EBADSLT;
+	if (atomic_inc_and_test(&slot->access_count)) {
+		// Reopened within the keep-alive time, the negotiated session is still valid.
+		if (cancel_delayed_work_sync(&slot->close_work))
+			PRINT_SLOT_DBG("Session kept alive.\n", slot->number);
+		instance->private_data = slot;
+		PRINT_DBG("Driver open done ok!\n");
+		return 0;
+	}
+	PRINT_DBG("Driver open done EBUSY!\n");
+	atomic_dec(&slot->access_count);
+	put_slot(slot);
+	return -EBUSY;
 }
 
-static int driver_close(struct inode *device_file, struct file *instance)
+// Resets frame size and SCLK speed, suspends the device and refreshes the descriptor.
+void reset_session(struct Slot *slot)
 {
-	u8 i, ret;
-	int minor_number = iminor(file_dentry(instance)->d_inode);
 	u8 *rx_buffer;
-	u8 cnt = 0;
-	PRINT_DBG("Driver close called!\n");
+	int pm_ret;
 
-	for (i = 0; i < MINOR_DEVICES; i++) {
-		if (slot_list[i] != NULL) {
-			if (slot_list[i]->valid && slot_list[i]->number == minor_number) {
-				PRINT_SLOT_DBG("Driver close slot found\n", slot_list[i]->number);
-				rx_buffer = kcalloc(MAXIMUM_FRAME_SIZE, sizeof(u8), GFP_KERNEL);
-				if (!atomic_inc_and_test(&slot_list[i]->write_count)) {
-					PRINT_SLOT_DBG("Reset delayed (bus busy)!\n", slot_list[i]->number);
-					ret =
-					    wait_event_interruptible_timeout(slot_list[i]->wait_queue_for_write, atomic_read(&slot_list[i]->write_count) == 0,
-									     msecs_to_jiffies(200));
-
-					if (ret == 0) {
-						PRINT_SLOT_DBG("Reset timeout (bus busy)!\n", slot_list[i]->number);
-					} else if (ret == -ERESTARTSYS) {
-						PRINT_SLOT_DBG("Reset timeout interrupted by system!\n", slot_list[i]->number);
-					} else {
-						PRINT_SLOT_DBG("Reset continued. (cnt: %d)\n", slot_list[i]->number, atomic_read(&slot_list[i]->write_count));
-					}
-				}
-				slot_list[i]->speed_sclk = DEFAULT_SCLK_SPEED;
+	pm_ret = slot_pm_get(slot);
+	if (bus_is_busy(&slot->bus))
+		PRINT_SLOT_DBG("Reset delayed (bus busy)!\n", slot->number);
+	bus_acquire(&slot->bus, BUS_PRIO_WRITE);
+	rx_buffer = slot->notification.rx_buffer;	// Only used while the bus is owned
+	slot->speed_sclk = DEFAULT_SCLK_SPEED;
 
-				if (slot_list[i]->frame_size != DEFAULT_FRAME_SIZE) {
-					if (exchange_sdbp(slot_list[i], (u8 *)
-							  CONTROL_SET_FRAME_SIZE_DEFAULT, rx_buffer, LOG_LVL_NORMAL))
-						PRINT_SLOT_ERR("Failed resetting frame size after FD close!", slot_list[i]->number);
-					slot_list[i]->frame_size = DEFAULT_FRAME_SIZE;
-				}
+	if (slot->state != SLOT_STATE_CONNECTED) {
+		slot->frame_size = DEFAULT_FRAME_SIZE;
+		goto release;
+	}
 
-				if (exchange_sdbp(slot_list[i], (u8 *) CONTROL_SET_MODE_SUSPEND, rx_buffer, LOG_LVL_NORMAL) != 0) {
-					PRINT_SLOT_ERR("Failed setting device into SUSPEND mode after FD close!", slot_list[i]->number);
+	if (slot->frame_size != DEFAULT_FRAME_SIZE) {
+		if (exchange_sdbp(slot, (u8 *)
+				  CONTROL_SET_FRAME_SIZE_DEFAULT, rx_buffer, LOG_LVL_NORMAL))
+			PRINT_SLOT_ERR("Failed resetting frame size after FD close!", slot->number);
+		slot->frame_size = DEFAULT_FRAME_SIZE;
+	}
 
-					for (cnt = 0; cnt < 5; cnt++) {
-						if (gpio_get_value(slot_list[i]->interrupt_pin)) {
-							PRINT_SLOT_DBG("Stopped disconnected detection after %d tries.\n", slot_list[i]->number, cnt);
-							break;	// Stop debounce phase
-						}
-						usleep_range(500, 1000);
-					}
-				}
+	// A disconnect is reported to the worker by the link timer, no need to wait for it here.
+	if (atomic_read(&slot->link_state) == LINK_DISCONNECTED)
+		PRINT_SLOT_DBG("Device disconnected on driver close! \n", slot->number);
+	else if (exchange_sdbp(slot, (u8 *)
+			       CONTROL_UPDATE_DESCRIPTOR, rx_buffer, LOG_LVL_NORMAL))
+		PRINT_SLOT_ERR("Failed updateing after FD close!", slot->number);
+
+ release:
+	release_bus(slot);
+	// Suspend right away instead of waiting for the autosuspend delay
+	if (pm_ret == 0)
+		pm_runtime_put_sync_suspend(&slot->spi_device->dev);
+}
 
-				if (exchange_sdbp(slot_list[i], (u8 *)
-						  CONTROL_UPDATE_DESCRIPTOR, rx_buffer, LOG_LVL_NORMAL))
-					PRINT_SLOT_ERR("Failed updateing after FD close!", slot_list[i]->number);
-
-				atomic_dec(&slot_list[i]->write_count);
-				wake_up_all(&slot_list[i]->wait_queue_for_write);
-				if (cnt >= 4) {
-					// If interrupt line stays low after failure we have a disconnect.
-					atomic_set(&slot_list[i]->notification_arrived, 1);
-					wake_up_all(&slot_list[i]->queue);
-					PRINT_SLOT_DBG("Device disconnected on driver close! \n", slot_list[i]->number);
-				}
-				kfree(rx_buffer);
-				atomic_dec(&slot_list[i]->access_count);
-				PRINT_SLOT_DBG("Driver close ok!\n", slot_list[i]->number);
-				return 0;
-			}
-		}
-	}
-	PRINT_DBG("Driver close with EBADSLT!\n");
-	return -EBADSLT;
+static void close_work_fn(struct work_struct *work)
+{
+	struct Slot *slot = container_of(to_delayed_work(work), struct Slot, close_work);
+
+	PRINT_SLOT_DBG("Keep-alive expired, resetting session.\n", slot->number);
+	reset_session(slot);
+}
+
+static int driver_close(struct inode *device_file, struct file *instance)
+{
+	struct Slot *slot = instance->private_data;
+	PRINT_DBG("Driver close called!\n");
+
+	PRINT_SLOT_DBG("Driver close slot found\n", slot->number);
+	if (atomic_read(&slot->stop))
+		PRINT_SLOT_DBG("Slot removed, session not reset.\n", slot->number);
+	else if (slot->keepalive_ms)
+		queue_delayed_work(system_long_wq, &slot->close_work, msecs_to_jiffies(slot->keepalive_ms));	// reset_session() waits for the bus
+	else
+		reset_session(slot);
+
+	atomic_dec(&slot->access_count);
+	PRINT_SLOT_DBG("Driver close ok!\n", slot->number);
+	put_slot(slot);
+	return 0;
 }
 
 static ssize_t driver_read(struct file *instance, char __user * user, size_t max_bytes_to_read, loff_t * offset)
 {
 	unsigned long not_copied, to_copy;
-	int minor_number = iminor(file_dentry(instance)->d_inode);
-	u8 i;
+	struct Slot *slot = instance->private_data;
+	ssize_t ret;
 
-	for (i = 0; i < MINOR_DEVICES; i++) {
-		if (slot_list[i] != NULL) {
-			if (slot_list[i]->valid && slot_list[i]->number == minor_number) {
+	if (atomic_read(&slot->stop))
+		return -ENODEV;
 
-				if (instance->f_flags & O_NONBLOCK || slot_list[i]->rx_len == 0)
-					return -EWOULDBLOCK;
+	if (instance->f_flags & O_NONBLOCK || READ_ONCE(slot->rx_len) == 0)
+		return -EWOULDBLOCK;
 
-				slot_list[i]->rx_len = (slot_list[i]->rx_buffer[1] << 8) | slot_list[i]->rx_buffer[2];
+	// rx_buffer is replaced on attach and disconnect, both with the bus owned
+	ret = bus_acquire_interruptible(&slot->bus, BUS_PRIO_WRITE);
+	if (ret != 0)
+		return ret;
 
-				if (max_bytes_to_read < (slot_list[i]->rx_len))
-					return -EMSGSIZE;
+	if (atomic_read(&slot->stop)) {
+		ret = -ENODEV;
+		goto release;
+	}
+	if (slot->rx_len == 0) {
+		ret = -EWOULDBLOCK;
+		goto release;
+	}
+	slot->rx_len = (slot->rx_buffer[1] << 8) | slot->rx_buffer[2];
+	if (slot->rx_len < 4 || slot->rx_len > slot->buffer_size) {
+		slot->rx_len = 0;
+		ret = -EIO;
+		goto release;
+	}
 
-				to_copy = slot_list[i]->rx_len - 4;
-				not_copied = copy_to_user(user, slot_list[i]->rx_buffer + 4, to_copy);
+	if (max_bytes_to_read < (slot->rx_len)) {
+		ret = -EMSGSIZE;
+		goto release;
+	}
 
-				slot_list[i]->rx_len = not_copied;
-				return to_copy - not_copied;
-			}
-		}
+	to_copy = slot->rx_len - 4;
+	not_copied = copy_to_user(user, slot->rx_buffer + 4, to_copy);
+
+	slot->rx_len = not_copied;
+	ret = to_copy - not_copied;
+ release:
+	release_bus(slot);
+	return ret;
+}
+
+// Increases the frame size for a payload which does not fit, the session reset restores the default.
+static int fit_frame_size(struct Slot *slot, size_t payload)
+{
+	u8 request[] = { 0x01, 0x00, 0x09, 0x00, 0x01, 0x03, 0x07, 0x00, 0x00 };
+	u32 max_frame_size = slot->buffer_size;
+	u32 frame_size;
+
+	if (!auto_frame_size || payload + 6 > max_frame_size)
+		return -EMSGSIZE;
+
+	frame_size = min_t(u32, roundup_pow_of_two(payload + 6), max_frame_size);
+	request[7] = frame_size >> 8;
+	request[8] = frame_size & 0xff;
+	if (exchange_sdbp(slot, request, slot->rx_buffer, LOG_LVL_NORMAL) != 0 || slot->frame_size != frame_size) {
+		PRINT_SLOT_ERR("Increasing frame size to %d bytes failed!\n", slot->number, frame_size);
+		return -ECOMM;
 	}
+	PRINT_SLOT_DBG("Frame size increased to %d bytes.\n", slot->number, frame_size);
+	return 0;
+}
 
-	PRINT_DBG("Minor is: %d", minor_number);
-	return -EBADSLT;
+static bool is_cacheable(u8 * data)
+{
+	int i;
+
+	if (!response_cache)
+		return false;
+	for (i = 0; i < cache_commands_cnt; i++)
+		if (cache_commands[i] == (data[4] << 8 | data[5]))
+			return true;
+	return false;
 }
 
-ssize_t driver_write(struct file * instance, const char __user * buffer, size_t max_bytes_to_write, loff_t * offset)
+// Only regular responses to the request are cached, transaction errors are answered by another class/command
+static void store_response(struct Slot *slot)
+{
+	u8 *tx = slot->tx_buffer;
+	u8 *rx = slot->rx_buffer;
+
+	if (rx[0] != SDBP_MSG_TYPE_RESPONSE || rx[4] != tx[4] || rx[5] != tx[5])
+		return;
+	if (rx[4] == SDBP_CLASSID_CORE && rx[5] == 0x02 && rx[6] == DESCRIPTOR_ERROR_CODE)
+		return;
+	rx[3] = SDBP_OPTION_BYTE;	// A pending notification is only signalled once
+	cache_store(&slot->cache, slot->descriptor.rid, tx, rx);
+}
+
+// Chained descriptor fields are collected in-kernel and returned as one response with the chaining byte cleared.
+static int exchange_chained(struct Slot *slot)
+{
+	u8 data[255];
+	u16 length;
+	int ret;
+
+	// The reassembled response replaces the last chunk in rx_buffer, which may be smaller than 9 + 255 bytes
+	ret = get_chained(slot, slot->tx_buffer, slot->rx_buffer, data, min_t(u32, sizeof(data), slot->buffer_size - 9), LOG_LVL_NORMAL);
+	if (ret == -2)
+		return 0;	// Descriptor error code is passed to the application
+	if (ret < 0)
+		return -1;
+
+	length = 9 + ret;
+	slot->rx_buffer[1] = length >> 8;
+	slot->rx_buffer[2] = length & 0xff;
+	slot->rx_buffer[7] = 0;
+	slot->rx_buffer[8] = ret;
+	memcpy(slot->rx_buffer + 9, data, ret);
+	return 0;
+}
+
+static ssize_t write_frame(struct Slot *slot, const char __user * buffer, size_t max_bytes_to_write)
 {
 	size_t to_copy, not_copied;
-	int minor_number = iminor(file_dentry(instance)->d_inode);
-	u8 i;
+	bool cacheable;
 	int ret;
 
-	for (i = 0; i < MINOR_DEVICES; i++) {
-		if (slot_list[i] != NULL) {
-			if (slot_list[i]->valid && slot_list[i]->number == minor_number) {
+	if (bus_is_busy(&slot->bus))
+		PRINT_SLOT_DBG("Write delayed (bus busy)!\n", slot->number);
+	ret = bus_acquire_interruptible(&slot->bus, BUS_PRIO_WRITE);
+	if (ret != 0) {
+		PRINT_SLOT_DBG("Write interrupted by system!\n", slot->number);
+		return ret;
+	}
+	if (atomic_read(&slot->stop)) {
+		release_bus(slot);
+		return -ENODEV;	// Removed while waiting for the bus
+	}
 
-				if (atomic_read(&slot_list[i]->write_count) != -1) {
-					wake_up_all(&slot_list[i]->wait_queue_for_write);
-					PRINT_SLOT_DBG("Write delayed (bus busy %d)!\n", slot_list[i]->number, atomic_read(&slot_list[i]->write_count));
-					wait_event_interruptible_timeout(slot_list[i]->wait_queue_for_write, atomic_read(&slot_list[i]->write_count) == -1,
-									 msecs_to_jiffies(200));
-					PRINT_SLOT_DBG("Write proceeds.\n", slot_list[i]->number);
-				}
+	if (max_bytes_to_write > (slot->frame_size - 6)) {
+		ret = fit_frame_size(slot, max_bytes_to_write);
+		if (ret != 0) {
+			release_bus(slot);
+			return ret;
+		}
+	}
 
-				if (!atomic_inc_and_test(&slot_list[i]->write_count)) {
-					PRINT_SLOT_DBG("Write delayed again (bus busy %d)!\n", slot_list[i]->number, atomic_read(&slot_list[i]->write_count));
-					ret =
-					    wait_event_interruptible_timeout(slot_list[i]->wait_queue_for_write, atomic_read(&slot_list[i]->write_count) == 0,
-									     msecs_to_jiffies(200));
-
-					if (ret == 0) {
-						PRINT_SLOT_ERR("Write timeout (bus busy)!\n", slot_list[i]->number);
-						atomic_dec(&slot_list[i]->write_count);
-						wake_up_all(&slot_list[i]->wait_queue_for_write);
-						return -EWOULDBLOCK;
-					} else if (ret == -ERESTARTSYS) {
-						PRINT_SLOT_DBG("Write interrupted by system!\n", slot_list[i]->number);
-						atomic_dec(&slot_list[i]->write_count);
-						wake_up_all(&slot_list[i]->wait_queue_for_write);
-						return -ERESTARTSYS;
-					} else {
-						PRINT_SLOT_DBG("Write continued. (cnt: %d)\n", slot_list[i]->number, atomic_read(&slot_list[i]->write_count));
-					}
-				}
+	to_copy = min((size_t) slot->frame_size, max_bytes_to_write);
+	max_bytes_to_write += 4;
+	slot->tx_buffer[0] = SDBP_MSG_TYPE_OPERATION;
+	slot->tx_buffer[1] = (max_bytes_to_write >> 8) & 0x00ff;
+	slot->tx_buffer[2] = max_bytes_to_write & 0x00ff;
+	slot->tx_buffer[3] = SDBP_OPTION_BYTE;
+
+	not_copied = copy_from_user(slot->tx_buffer + 4, buffer, to_copy);
+
+	cacheable = is_cacheable(slot->tx_buffer);
+	if (cacheable) {
+		if (cache_lookup(&slot->cache, slot->descriptor.rid, slot->tx_buffer, slot->rx_buffer)) {
+			stats_inc(&slot->stats, STAT_CACHE_HITS);
+			slot->rx_len = slot->frame_size;
+			release_bus(slot);
+			return to_copy;
+		}
+		stats_inc(&slot->stats, STAT_CACHE_MISSES);
+	}
 
-				if (instance->f_flags & O_NONBLOCK) {
-					PRINT_SLOT_DBG("Blocking call not possible!\n", slot_list[i]->number);
-					atomic_dec(&slot_list[i]->write_count);
-					wake_up_all(&slot_list[i]->wait_queue_for_write);
-					return -EWOULDBLOCK;
-				}
+	ret = 0;
+	slot->last_transaction.start = ktime_get();
+	slot->last_transaction.response = 0;
+	if (is_chained_request(slot->tx_buffer))
+		ret = exchange_chained(slot);
+	else
+		ret = exchange_sdbp(slot, slot->tx_buffer, slot->rx_buffer, LOG_LVL_NORMAL);
+	slot->last_transaction.response = slot->response_irq;
+	slot->last_transaction.end = ktime_get();
+	if (ret != 0) {
+		PRINT_SLOT_DBG("Data exchange failed!", slot->number);
+		ret = -ECOMM;
+	}
 
-				if ((max_bytes_to_write > (slot_list[i]->frame_size - 6))
-				    || (max_bytes_to_write > MAXIMUM_FRAME_SIZE)) {
-					atomic_dec(&slot_list[i]->write_count);
-					wake_up_all(&slot_list[i]->wait_queue_for_write);
-					return -EMSGSIZE;
-				}
+	if (atomic_read(&slot->link_state) == LINK_DISCONNECTED)
+		PRINT_SLOT_DBG("Device disconnected after write!\n", slot->number);
 
-				to_copy = min((size_t) slot_list[i]->frame_size, max_bytes_to_write);
-				max_bytes_to_write += 4;
-				slot_list[i]->tx_buffer[0] = SDBP_MSG_TYPE_OPERATION;
-				slot_list[i]->tx_buffer[1] = (max_bytes_to_write >> 8) & 0x00ff;
-				slot_list[i]->tx_buffer[2] = max_bytes_to_write & 0x00ff;
-				slot_list[i]->tx_buffer[3] = SDBP_OPTION_BYTE;
-
-				not_copied = copy_from_user(slot_list[i]->tx_buffer + 4, buffer, to_copy);
-
-				ret = 0;
-				if (exchange_sdbp(slot_list[i], slot_list[i]->tx_buffer, slot_list[i]->rx_buffer, LOG_LVL_NORMAL) != 0) {
-					atomic_dec(&slot_list[i]->write_count);
-					wake_up_all(&slot_list[i]->wait_queue_for_write);
-					PRINT_SLOT_DBG("Data exchange failed!", slot_list[i]->number);
-					ret = -ECOMM;
-				}
+	if (ret != 0) {
+		release_bus(slot);
+		return ret;	// Return after disconnect check
+	}
 
-				if (!gpio_get_value(slot_list[i]->interrupt_pin)) {
-					usleep_range(500, 1000);
-					if (!gpio_get_value(slot_list[i]->interrupt_pin)) {
-						atomic_set(&slot_list[i]->notification_arrived, 1);
-						wake_up_all(&slot_list[i]->queue);
-						PRINT_SLOT_DBG("Device disconnected after write!\n", slot_list[i]->number);
-					}
-				}
+	slot->rx_len = slot->frame_size;
 
-				if (ret != 0) {
-					return ret;	// Return after disconnect check
-				}
+	if (slot->rx_buffer[3] == SDBP_OPTION_BYTE_NOTIFICATION_PENDING) {
+		PRINT_SLOT_DBG("Notification pending.", slot->number);
+		// Fetched while the bus is still owned, the worker only takes over after a failed fetch
+		if (drain_notifications(slot) < 0)
+			atomic_set(&slot->notification_arrived, 1);
+	}
+	if (cacheable)
+		store_response(slot);
+	release_bus(slot);
+	return to_copy;
+}
+
+ssize_t driver_write(struct file * instance, const char __user * buffer, size_t max_bytes_to_write, loff_t * offset)
+{
+	struct Slot *slot = instance->private_data;
+	ssize_t ret;
 
-				slot_list[i]->rx_len = slot_list[i]->frame_size;
+	if (atomic_read(&slot->stop))
+		return -ENODEV;
 
-				atomic_dec(&slot_list[i]->write_count);
-				wake_up_all(&slot_list[i]->wait_queue_for_write);
+	if (instance->f_flags & O_NONBLOCK) {
+		PRINT_SLOT_DBG("Blocking call not possible!\n", slot->number);
+		return -EWOULDBLOCK;
+	}
 
-				if (slot_list[i]->rx_buffer[3] == SDBP_OPTION_BYTE_NOTIFICATION_PENDING) {
-					PRINT_SLOT_DBG("Notification pending.", slot_list[i]->number);
-					atomic_set(&slot_list[i]->notification_arrived, 1);
-					wake_up_all(&slot_list[i]->queue);
-				}
-				return to_copy;
-			}
+	ret = slot_pm_get(slot);
+	if (ret < 0)
+		return ret;
+	ret = write_frame(slot, buffer, max_bytes_to_write);
+	slot_pm_put(slot);
+	return ret;
+}
+
+static enum hrtimer_restart link_timer_fn(struct hrtimer *timer);
+
+static void rt_work_fn(struct kthread_work *work);
+
+static void free_slot_buffers(struct Slot *slot)
+{
+	free_cpumask_var(slot->cpus);
+	kfree(slot->tx_buffer);
+	kfree(slot->rx_buffer);
+	kfree(slot->tx_frame);
+	kfree(slot->dummy_buffer);
+	kfree(slot->tx_crc);
+	kfree(slot->dummy_frame);
+	kfree(slot->notification.rx_buffer);
+	kfree(slot->descriptor_buffer);
+}
+
+/*
+ * Frame buffers hold the largest frame of the connection, DEFAULT_FRAME_SIZE while no device is attached.
+ * Called with the bus owned (or before the slot is in use), the old buffers are kept if the allocation fails.
+ */
+static int resize_frame_buffers(struct Slot *slot, u32 size)
+{
+	u8 **buffers[FRAME_BUFFER_CNT] = {
+		&slot->tx_buffer, &slot->rx_buffer, &slot->tx_frame, &slot->dummy_buffer, &slot->dummy_frame, &slot->notification.rx_buffer,
+		&slot->descriptor_buffer,
+	};
+	u8 *resized[FRAME_BUFFER_CNT];
+	int i;
+
+	if (size == slot->buffer_size)
+		return 0;
+	for (i = 0; i < FRAME_BUFFER_CNT; i++) {
+		resized[i] = kzalloc(size, GFP_KERNEL);
+		if (!resized[i]) {
+			while (i--)
+				kfree(resized[i]);
+			return -ENOMEM;
 		}
 	}
 
-	PRINT_DBG("Minor is: %d", minor_number);
-	return -EBADSLT;
+	release_messages(slot);
+	cache_invalidate(&slot->cache);	// Cached responses may exceed the new rx buffer
+	for (i = 0; i < FRAME_BUFFER_CNT; i++) {
+		kfree(*buffers[i]);
+		*buffers[i] = resized[i];
+	}
+	memcpy(slot->dummy_frame, DUMMY_DUMMY, sizeof(DUMMY_DUMMY));
+	slot->dummy_frame_size = 0;
+	slot->buffer_size = size;
+	slot->frame_size = min(slot->frame_size, size);
+	slot->rx_len = 0;
+	return 0;
+}
+
+// Sizes the slot to the attached device, the notification queue is allocated on the first attach and kept afterwards
+static int attach_buffers(struct Slot *slot)
+{
+	u32 size = clamp_t(u32, slot->descriptor.max_frame_size, DEFAULT_FRAME_SIZE, MAXIMUM_FRAME_SIZE);
+	int ret = 0;
+
+	bus_acquire(&slot->bus, BUS_PRIO_NOTIFICATION);
+	if (!slot->notification.record)
+		ret = notification_queue_init(&slot->notification, max_t(u32, notification_queue, 2 * PAGE_SIZE));
+	if (ret == 0)
+		ret = resize_frame_buffers(slot, size);
+	bus_release(&slot->bus);
+	return ret;
 }
 
-struct Slot *init_slot_struct(u8 slot_number, u8 spi_bus, u8 spi_cs, u8 int_pin, u8 cs_pin_alt)
+static struct Slot *init_slot_struct(struct spi_device *spi, int int_pin, u8 cs_pin_alt)
 {
 	struct Slot *slot = kzalloc(sizeof(struct Slot),
 				    GFP_KERNEL);
+	if (!slot)
+		return NULL;
 
-	slot->number = slot_number;
-	slot->spi_bus = spi_bus;
-	slot->spi_chip_select = spi_cs;
+	slot->spi_device = spi;
+	slot->transfer = spi_api_exchange;
+	slot->spi_bus = spi->master->bus_num;
+	slot->spi_chip_select = spi->chip_select;
 	slot->interrupt_pin = int_pin;
 	slot->cs_pin_alt = cs_pin_alt;
 	atomic_set(&slot->interrupt_arrived, 0);
 	atomic_set(&slot->notification_arrived, 0);
 	atomic_set(&slot->access_count, -1);
-	atomic_set(&slot->write_count, -1);
+	atomic_set(&slot->users, 0);
+	init_waitqueue_head(&slot->users_wait);
+	bus_owner_init(&slot->bus);
+	cache_init(&slot->cache);
+	firmware_init(&slot->fw);
+	fault_init(&slot->faults);
 	atomic_set(&slot->descriptor.is_valid, -1);
 	atomic_set(&slot->descriptor_old.is_valid, 0);
 	atomic_set(&slot->stop, 0);
 	slot->speed_sclk = DEFAULT_SCLK_SPEED;
 	slot->crc_size = DEFAULT_CRC_SIZE;
 	slot->frame_size = DEFAULT_FRAME_SIZE;
-	slot->spi_device = NULL;
-	slot->tx_buffer = kcalloc(MAXIMUM_FRAME_SIZE, sizeof(u8), GFP_KERNEL);
-	slot->rx_buffer = kcalloc(MAXIMUM_FRAME_SIZE, sizeof(u8), GFP_KERNEL);
+	slot->tx_crc = kcalloc(CRC32_SIZE, sizeof(u8), GFP_KERNEL);
+	// Empty slots only hold frame buffers for the descriptor requests
+	if (!slot->tx_crc || resize_frame_buffers(slot, DEFAULT_FRAME_SIZE) != 0
+	    || !zalloc_cpumask_var(&slot->cpus, GFP_KERNEL) || stats_init(&slot->stats) != 0 || recorder_init(&slot->recorder, recorder_entries) != 0) {
+		stats_free(&slot->stats);
+		free_slot_buffers(slot);
+		kfree(slot);
+		return NULL;
+	}
+	spin_lock_init(&slot->notification.queue_lock);
+	ratelimit_state_init(&slot->print_limit, DEFAULT_RATELIMIT_INTERVAL, DEFAULT_RATELIMIT_BURST);
+	init_waitqueue_head(&slot->queue);
+	atomic_set(&slot->link_state, LINK_DISCONNECTED);
+	hrtimer_init(&slot->link_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	slot->link_timer.function = link_timer_fn;
 	init_waitqueue_head(&slot->wait_queue_for_read);
-	init_waitqueue_head(&slot->wait_queue_for_write);
 	init_waitqueue_head(&slot->notification.wait_for_notification);
 	init_completion(&slot->dev_obj_is_free);
-	slot->session_stats.transmission_errors = 0;
-	slot->session_stats.notifications = 0;
-	slot->session_stats.notifications_failed = 0;
-	slot->session_stats.descriptor_failed = 0;
+	INIT_DELAYED_WORK(&slot->work, sdbp_work);
+	kthread_init_delayed_work(&slot->rt_work, rt_work_fn);
+	mutex_init(&slot->work_lock);
+	mutex_init(&slot->sched_lock);
+	atomic64_set(&slot->kick_time, 0);
+	INIT_DELAYED_WORK(&slot->close_work, close_work_fn);
+	slot->keepalive_ms = keepalive_ms;
+	slot->state = SLOT_STATE_DISCONNECTED;
 	return slot;
 }
 
+static void free_slot_struct(struct Slot *slot)
+{
+	if (slot->worker)
+		kthread_destroy_worker(slot->worker);
+	release_messages(slot);
+	notification_queue_free(&slot->notification);
+	free_descriptor_strings(slot);
+	cache_free(&slot->cache);
+	stats_free(&slot->stats);
+	recorder_free(&slot->recorder);
+	free_slot_buffers(slot);
+	kfree(slot);
+}
+
 struct Slot *get_slot(int index)
 {
-	return slot_list[index];
+	return idr_find(&slot_idr, index);
+}
+
+// Pins a slot which is not being removed, release_slot() waits until every reference is put
+struct Slot *get_slot_ref(int index)
+{
+	struct Slot *slot;
+
+	mutex_lock(&slot_lock);
+	slot = idr_find(&slot_idr, index);
+	if (slot && !atomic_read(&slot->stop))
+		atomic_inc(&slot->users);
+	else
+		slot = NULL;
+	mutex_unlock(&slot_lock);
+	return slot;
+}
+
+void put_slot(struct Slot *slot)
+{
+	if (atomic_dec_and_test(&slot->users))
+		wake_up_all(&slot->users_wait);
 }
 
 int find_slot(dev_t devt)
 {
-	u8 i;
+	struct Slot *slot;
 
-	for (i = 0; i < MINOR_DEVICES; i++) {
-		if (slot_list[i] != NULL) {
-			if (slot_list[i]->valid) {
-				if (slot_list[i]->sdbp_device != NULL) {
-					if (slot_list[i]->sdbp_device->devt == devt) {
-						return i;
-					}
-				}
-			}
-		}
-	}
-	return -1;
+	if (MAJOR(devt) != MAJOR(major_device_number))
+		return -1;
+
+	slot = lookup_slot(MINOR(devt));
+	if (slot == NULL || slot->sdbp_device == NULL || slot->sdbp_device->devt != devt)
+		return -1;
+	return slot->number;
 }
 
 static DEVICE_ATTR(vendor_product_id, S_IRUGO, get_vendor_product_id, NULL);
@@ -352,11 +709,32 @@ static DEVICE_ATTR(hw_version, S_IRUGO, get_hw_version, NULL);
 static DEVICE_ATTR(protocol_version, S_IRUGO, get_protocol_version, NULL);
 static DEVICE_ATTR(serial_code, S_IRUGO, get_serial_code, NULL);
 static DEVICE_ATTR(notification, S_IRUGO, get_notification_data, NULL);
+static DEVICE_ATTR(notification_pending, S_IRUGO, get_notification_pending, NULL);
+static DEVICE_ATTR(last_transaction, S_IRUGO, get_last_transaction, NULL);
 static DEVICE_ATTR(stats_failed_transmissions, S_IRUGO, get_stats_failed_transmissions, NULL);
 static DEVICE_ATTR(stats_notifications, S_IRUGO, get_stats_notifications, NULL);
 static DEVICE_ATTR(stats_failed_notifications, S_IRUGO, get_stats_failed_notifications, NULL);
 static DEVICE_ATTR(stats_failed_descriptors, S_IRUGO, get_stats_failed_descriptors, NULL);
 static DEVICE_ATTR(rid, S_IRUGO, get_rid, NULL);
+static DEVICE_ATTR(spi_bus, S_IRUGO, get_spi_bus, NULL);
+static DEVICE_ATTR(spi_chip_select, S_IRUGO, get_spi_chip_select, NULL);
+static DEVICE_ATTR(stats_bus_acquired, S_IRUGO, get_stats_bus_acquired, NULL);
+static DEVICE_ATTR(stats_bus_contended, S_IRUGO, get_stats_bus_contended, NULL);
+static DEVICE_ATTR(stats_bus_max_queued, S_IRUGO, get_stats_bus_max_queued, NULL);
+static DEVICE_ATTR(stats_bus_wait_us, S_IRUGO, get_stats_bus_wait_us, NULL);
+static DEVICE_ATTR(keepalive_ms, S_IRUGO | S_IWUSR, get_keepalive_ms, set_keepalive_ms);
+static DEVICE_ATTR(stats_suspends, S_IRUGO, get_stats_suspends, NULL);
+static DEVICE_ATTR(stats_resumes, S_IRUGO, get_stats_resumes, NULL);
+static DEVICE_ATTR(stats_resume_us, S_IRUGO, get_stats_resume_us, NULL);
+static DEVICE_ATTR(stats_cache, S_IRUGO, get_stats_cache, NULL);
+static DEVICE_ATTR(rt_priority, S_IRUGO | S_IWUSR, get_rt_priority, set_rt_priority);
+static DEVICE_ATTR(cpu_affinity, S_IRUGO | S_IWUSR, get_cpu_affinity, set_cpu_affinity);
+static DEVICE_ATTR(stats_sched_latency_us, S_IRUGO, get_stats_sched_latency_us, NULL);
+static DEVICE_ATTR(firmware_update, S_IWUSR, NULL, set_firmware_update);
+static DEVICE_ATTR(firmware_status, S_IRUGO, get_firmware_status, NULL);
+static DEVICE_ATTR(memory_usage, S_IRUGO, get_memory_usage, NULL);
+static DEVICE_ATTR(stats, S_IRUGO, get_stats, NULL);
+static DEVICE_ATTR(stats_reset, S_IWUSR, NULL, set_stats_reset);
 
 static struct attribute *dev_attrs[] = {
 	&dev_attr_vendor_name.attr,
@@ -373,16 +751,47 @@ static struct attribute *dev_attrs[] = {
 	&dev_attr_protocol_version.attr,
 	&dev_attr_serial_code.attr,
 	&dev_attr_notification.attr,
+	&dev_attr_notification_pending.attr,
+	&dev_attr_last_transaction.attr,
 	&dev_attr_stats_failed_transmissions.attr,
 	&dev_attr_stats_notifications.attr,
 	&dev_attr_stats_failed_notifications.attr,
 	&dev_attr_stats_failed_descriptors.attr,
 	&dev_attr_rid.attr,
+	&dev_attr_spi_bus.attr,
+	&dev_attr_spi_chip_select.attr,
+	&dev_attr_stats_bus_acquired.attr,
+	&dev_attr_stats_bus_contended.attr,
+	&dev_attr_stats_bus_max_queued.attr,
+	&dev_attr_stats_bus_wait_us.attr,
+	&dev_attr_keepalive_ms.attr,
+	&dev_attr_stats_suspends.attr,
+	&dev_attr_stats_resumes.attr,
+	&dev_attr_stats_resume_us.attr,
+	&dev_attr_stats_cache.attr,
+	&dev_attr_rt_priority.attr,
+	&dev_attr_cpu_affinity.attr,
+	&dev_attr_stats_sched_latency_us.attr,
+	&dev_attr_firmware_update.attr,
+	&dev_attr_firmware_status.attr,
+	&dev_attr_memory_usage.attr,
+	&dev_attr_stats.attr,
+	&dev_attr_stats_reset.attr,
+	NULL,
+};
+
+static BIN_ATTR(descriptor_bin, S_IRUGO, read_descriptor_bin, NULL, sizeof(struct sdbp_descriptor_bin));
+static BIN_ATTR(notification_bin, S_IRUGO, read_notification_bin, NULL, 0);
+
+static struct bin_attribute *dev_bin_attrs[] = {
+	&bin_attr_descriptor_bin,
+	&bin_attr_notification_bin,
 	NULL,
 };
 
 static struct attribute_group dev_attr_group = {
 	.attrs = dev_attrs,
+	.bin_attrs = dev_bin_attrs,
 };
 
 static const struct attribute_group *dev_attr_groups[] = {
@@ -408,83 +817,666 @@ static void driver_release(struct device *dev)
 	complete(&get_slot(index)->dev_obj_is_free);
 }
 
+static enum hrtimer_restart link_timer_fn(struct hrtimer *timer)
+{
+	struct Slot *slot = container_of(timer, struct Slot, link_timer);
+
+	if (gpio_get_value(slot->interrupt_pin)) {
+		atomic_set(&slot->link_state, LINK_CONNECTED);
+		return HRTIMER_NORESTART;
+	}
+
+	if (ktime_us_delta(ktime_get(), slot->link_low_since) < LINK_DISCONNECT_TIMEOUT_US) {
+		hrtimer_forward_now(timer, us_to_ktime(LINK_SAMPLE_INTERVAL_US));
+		return HRTIMER_RESTART;
+	}
+
+	// Line stays low, the worker confirms the disconnect by a failing notification fetch.
+	if (atomic_xchg(&slot->link_state, LINK_DISCONNECTED) != LINK_DISCONNECTED) {
+		atomic_set(&slot->notification_arrived, 1);
+		sdbp_kick(slot);
+	}
+	return HRTIMER_NORESTART;
+}
+
 irqreturn_t gpio_rising_interrupt(int irq, void *dev_id)
 {
-	u8 i;
+	struct Slot *slot = dev_id;
+	ktime_t now = ktime_get();
+
+	atomic64_set(&slot->irq_time, now);
+	// The line was high before this edge, this also ends a disconnect which the worker did not confirm
+	if (atomic_read(&slot->link_state) != LINK_BUSY) {
+		atomic_set(&slot->link_state, LINK_BUSY);
+		slot->link_low_since = now;
+		hrtimer_start(&slot->link_timer, us_to_ktime(LINK_SAMPLE_INTERVAL_US), HRTIMER_MODE_REL);
+	}
 
-	for (i = 0; i < MINOR_DEVICES; i++) {
-		if (slot_list[i] != NULL) {
-			if (slot_list[i]->valid && slot_list[i]->irq_number == irq) {
-				if (atomic_read(&slot_list[i]->write_count) == -1) {
-					atomic_set(&slot_list[i]->notification_arrived, 1);
-				}
-				atomic_set(&slot_list[i]->interrupt_arrived, 1);
-				wake_up_all(&slot_list[i]->queue);
-			}
-		}
+	if (!bus_is_busy(&slot->bus)) {
+		atomic64_cmpxchg(&slot->announce_time, 0, now);	// Notification request
+		atomic_set(&slot->notification_arrived, 1);
+		sdbp_kick(slot);
 	}
+	atomic_set(&slot->interrupt_arrived, 1);
+	wake_up_all(&slot->queue);
 
 	return (IRQ_HANDLED);
 }
 
-void free_slots(void)
-{
-	int i, ret;
-	for (i = 0; i < MINOR_DEVICES; i++) {
-		if (slot_list[i] != NULL) {
-			ret = kthread_stop(slot_list[i]->thread);
-			if (!ret || -EINTR)
-				PRINT_DBG("Thread stopped.");
-			if (slot_list[i]->valid) {
-				atomic_set(&slot_list[i]->stop, 1);
-				wake_up_all(&slot_list[i]->queue);
-				if (slot_list[i]->spi_device != NULL) {
-					//PRINT_DBG("Unloaded spi.");
-					spi_unregister_device(slot_list[i]->spi_device);
+static void release_slot(struct Slot *slot)
+{
+	mutex_lock(&slot->sched_lock);	// No RT worker is created after stop
+	atomic_set(&slot->stop, 1);
+	mutex_unlock(&slot->sched_lock);
+	wake_up_all(&slot->queue);
+	cancel_delayed_work_sync(&slot->work);
+	if (slot->worker)
+		kthread_cancel_delayed_work_sync(&slot->rt_work);
+	firmware_cancel(slot);
+	// No reference is taken after stop, get_slot_ref() checks it under slot_lock. Open files hold one until they are closed.
+	mutex_lock(&slot_lock);
+	mutex_unlock(&slot_lock);
+	wait_event(slot->users_wait, atomic_read(&slot->users) == 0);
+	cancel_delayed_work_sync(&slot->close_work);	// Queued by a close before stop
+	if (slot->pm_resuming)
+		pm_runtime_put_noidle(&slot->spi_device->dev);
+	PRINT_DBG("Worker stopped.");
+	if (slot->was_connected) {
+		device_release_driver(slot->sdbp_device);
+		device_destroy(sdbp_class, major_device_number + slot->number);
+	} else {
+		complete(&slot->dev_obj_is_free);
+	}
+	free_irq(slot->irq_number, slot);
+	hrtimer_cancel(&slot->link_timer);
+	//PRINT_DBG("Unloaded irq.");
+	gpio_unexport(slot->interrupt_pin);
+	//PRINT_DBG("Unloaded gpio.");
+	gpio_free(slot->interrupt_pin);
+	//PRINT_DBG("Free gpio.");
+	wait_for_completion(&slot->dev_obj_is_free);
+	debugfs_remove_recursive(slot->debugfs);
+	PRINT_SLOT_DBG("Released slot %d.", slot->number, slot->number);
+
+	mutex_lock(&slot_lock);
+	idr_remove(&slot_idr, slot->number);
+	mutex_unlock(&slot_lock);
+	free_slot_struct(slot);
+}
+
+static int sdbp_runtime_suspend(struct device *dev)
+{
+	struct Slot *slot = spi_get_drvdata(to_spi_device(dev));
+	u8 *rx_buffer;
+	int ret = 0;
+
+	if (slot->state != SLOT_STATE_CONNECTED)
+		return 0;
+
+	// -EBUSY keeps the device active without making the error sticky
+	if (!bus_try_acquire(&slot->bus, BUS_PRIO_WRITE))
+		return -EBUSY;
+
+	rx_buffer = slot->notification.rx_buffer;	// Only used while the bus is owned
+	if (exchange_sdbp(slot, (u8 *) CONTROL_SET_MODE_SUSPEND, rx_buffer, LOG_LVL_NORMAL) != 0) {
+		PRINT_SLOT_ERR("Failed setting device into SUSPEND mode!", slot->number);
+		ret = -EBUSY;
+	} else {
+		stats_inc(&slot->stats, STAT_SUSPENDS);
+	}
+	release_bus(slot);
+	return ret;
+}
+
+static int sdbp_runtime_resume(struct device *dev)
+{
+	struct Slot *slot = spi_get_drvdata(to_spi_device(dev));
+	ktime_t start = ktime_get();
+	u8 *rx_buffer;
+	u32 resume_us;
+
+	if (slot->state != SLOT_STATE_CONNECTED)
+		return 0;
+
+	// Frame size and SCLK speed are kept by the device while suspended.
+	// Waiting for the bus is fine here, the slot worker only requests the resume and runs it on pm_wq.
+	// A failed wake-up is not returned because runtime PM errors are sticky, the next transaction reports it.
+	bus_acquire(&slot->bus, BUS_PRIO_NOTIFICATION);
+	rx_buffer = slot->notification.rx_buffer;
+	if (exchange_sdbp(slot, (u8 *) CONTROL_SET_MODE_RUN, rx_buffer, LOG_LVL_NORMAL) != 0)
+		PRINT_SLOT_ERR("Failed setting device into RUN mode!", slot->number);
+	release_bus(slot);
+
+	resume_us = ktime_us_delta(ktime_get(), start);
+	stats_inc(&slot->stats, STAT_RESUMES);
+	stats_add(&slot->stats, STAT_RESUME_US, resume_us);
+	if (resume_us > slot->resume_us_max)
+		WRITE_ONCE(slot->resume_us_max, resume_us);
+	return 0;
+}
+
+static const struct dev_pm_ops sdbp_pm_ops = {
+	SET_RUNTIME_PM_OPS(sdbp_runtime_suspend, sdbp_runtime_resume, NULL)
+};
+
+// debugfs entries of a slot, removed by release_slot()
+static void slot_debugfs_init(struct Slot *slot)
+{
+	char name[16];
+
+	snprintf(name, sizeof(name), "slot%d", slot->number);
+	slot->debugfs = debugfs_create_dir(name, debugfs_root);
+	debugfs_create_file("frames", 0400, slot->debugfs, &slot->recorder, &recorder_fops);
+	fault_debugfs_init(&slot->faults, slot->debugfs);
+}
+
+static int sdbp_probe(struct spi_device *spi)
+{
+	const struct sdbp_slot_config *config = spi->dev.platform_data;
+	struct Slot *slot;
+	int interrupt_pin;
+	int number = -1;
+	u8 cs_pin_alt = 0;
+	u32 value;
+	int ret;
+
+	if (spi->dev.of_node) {
+		interrupt_pin = of_get_named_gpio(spi->dev.of_node, "ready-gpios", 0);
+		if (interrupt_pin == -EPROBE_DEFER)
+			return -EPROBE_DEFER;
+		if (!gpio_is_valid(interrupt_pin)) {
+			PRINT_ERR("%s: missing or invalid \"ready-gpios\" property!\n", dev_name(&spi->dev));
+			return -EINVAL;
+		}
+		if (of_property_read_u32(spi->dev.of_node, "sdbp,slot", &value) == 0)
+			number = value;
+	} else if (config) {
+		number = config->number;
+		interrupt_pin = config->interrupt_pin;
+		cs_pin_alt = config->cs_pin_alt;
+	} else {
+		PRINT_ERR("%s: no slot description (device tree or platform data)!\n", dev_name(&spi->dev));
+		return -ENODEV;
+	}
+
+	if (number >= max_slots) {
+		PRINT_ERR("%s: slot number %d exceeds max_slots (%d)!\n", dev_name(&spi->dev), number, max_slots);
+		return -EINVAL;
+	}
+
+	slot = init_slot_struct(spi, interrupt_pin, cs_pin_alt);
+	if (!slot)
+		return -ENOMEM;
+
+	mutex_lock(&slot_lock);
+	if (number >= 0)
+		ret = idr_alloc(&slot_idr, slot, number, number + 1, GFP_KERNEL);
+	else
+		ret = idr_alloc(&slot_idr, slot, 0, max_slots, GFP_KERNEL);
+	mutex_unlock(&slot_lock);
+	if (ret < 0) {
+		PRINT_ERR("%s: no free slot number (%d)!\n", dev_name(&spi->dev), ret);
+		free_slot_struct(slot);
+		return ret == -ENOSPC ? -EBUSY : ret;
+	}
+	slot->number = ret;
+
+	ret = init_slot(slot);
+	if (ret != 0) {
+		PRINT_SLOT_ERR("Slot init failed!\n", slot->number);
+		mutex_lock(&slot_lock);
+		idr_remove(&slot_idr, slot->number);
+		mutex_unlock(&slot_lock);
+		free_slot_struct(slot);
+		return ret;
+	}
+
+	spi_set_drvdata(spi, slot);
+	slot_debugfs_init(slot);
+
+	pm_runtime_set_autosuspend_delay(&spi->dev, autosuspend_ms);
+	pm_runtime_use_autosuspend(&spi->dev);
+	pm_runtime_set_active(&spi->dev);
+	pm_runtime_enable(&spi->dev);
+
+	if (cpu_affinity[0] && (cpulist_parse(cpu_affinity, slot->cpus) != 0 || slot_set_cpu_affinity(slot, slot->cpus) != 0)) {
+		PRINT_SLOT_ERR("Invalid cpu_affinity \"%s\", using all CPUs!\n", slot->number, cpu_affinity);
+		cpumask_clear(slot->cpus);
+	}
+	if (rt_priority && slot_set_rt_priority(slot, rt_priority) != 0)
+		PRINT_SLOT_ERR("Failed creating RT worker, using the shared workqueue!\n", slot->number);
+
+	slot_queue_work(slot, 0);
+	return 0;
+}
+
+static void sdbp_pm_disable(struct spi_device *spi)
+{
+	pm_runtime_disable(&spi->dev);
+	pm_runtime_dont_use_autosuspend(&spi->dev);
+	pm_runtime_set_suspended(&spi->dev);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+static void sdbp_remove(struct spi_device *spi)
+{
+	sdbp_pm_disable(spi);
+	release_slot(spi_get_drvdata(spi));
+}
+#else
+static int sdbp_remove(struct spi_device *spi)
+{
+	sdbp_pm_disable(spi);
+	release_slot(spi_get_drvdata(spi));
+	return 0;
+}
+#endif
+
+static const struct of_device_id sdbp_of_match[] = {
+	{.compatible = SDBP_OF_COMPATIBLE},
+	{},
+};
+
+MODULE_DEVICE_TABLE(of, sdbp_of_match);
+
+static const struct spi_device_id sdbp_spi_ids[] = {
+	{"sdbpk", 0},
+	{},
+};
+
+MODULE_DEVICE_TABLE(spi, sdbp_spi_ids);
+
+static struct spi_driver sdbp_spi_driver = {
+	.driver = {
+		   .name = "sdbpk",
+		   .owner = THIS_MODULE,
+		   .of_match_table = sdbp_of_match,
+		   .pm = &sdbp_pm_ops,
+		   },
+	.id_table = sdbp_spi_ids,
+	.probe = sdbp_probe,
+	.remove = sdbp_remove,
+};
+
+/*
+ * Fallback for systems without a device tree description of the slots:
+ * instantiates the historic slot table on the SPI buses selected by "spi_bus".
+ * SPI controllers may register late, so missing buses are retried once per second.
+ */
+static void legacy_work_fn(struct work_struct *work)
+{
+	struct spi_master *master;
+	struct spi_board_info spi_device_info = {
+		.modalias = "sdbpk",
+		.max_speed_hz = DEFAULT_SCLK_SPEED,
+		.mode = 0,
+	};
+	int pending = 0;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(legacy_slots); i++) {
+		if (legacy_disabled[i] || legacy_devices[i] != NULL)
+			continue;
+
+		spi_device_info.bus_num = legacy_slots[i].spi_bus;
+		spi_device_info.chip_select = legacy_slots[i].spi_chip_select;
+		spi_device_info.platform_data = &legacy_slots[i];
+
+		master = spi_busnum_to_master(spi_device_info.bus_num);
+		if (!master) {
+			PRINT_SLOT_DBG("SPI bus %d not found.\n", legacy_slots[i].number, legacy_slots[i].spi_bus);
+			pending++;
+			continue;
+		}
+		// create a new slave device, given the master and device info
+		legacy_devices[i] = spi_new_device(master, &spi_device_info);
+		put_device(&master->dev);
+		if (!legacy_devices[i]) {
+			PRINT_SLOT_DBG("Failed to create SPI slave %d %d.\n", legacy_slots[i].number, legacy_slots[i].spi_bus,
+				       legacy_slots[i].spi_chip_select);
+			pending++;
+		}
+	}
+
+	if (pending == 0)
+		return;
+
+	if (++legacy_tries < SLOT_INIT_TRIES)
+		queue_delayed_work(sdbp_wq, &legacy_work, HZ);
+	else
+		PRINT_ERR("%d legacy slot(s) not created after %d attempts.\n", pending, legacy_tries);
+}
+
+static void legacy_release(void)
+{
+	int i;
+
+	cancel_delayed_work_sync(&legacy_work);
+	for (i = 0; i < ARRAY_SIZE(legacy_slots); i++) {
+		if (legacy_devices[i] != NULL) {
+			spi_unregister_device(legacy_devices[i]);
+			legacy_devices[i] = NULL;
+		}
+	}
+}
+
+static int register_slot_device(struct Slot *slot)
+{
+	int ret;
+
+	{			// Register device
+		slot->sdbp_device = kzalloc(sizeof(struct device), GFP_KERNEL);
+		if (!slot->sdbp_device) {
+			PRINT_SLOT_ERR("Could not allocate memory!\n", slot->number);
+			return -ENOMEM;
+		}
+
+		slot->sdbp_device->class = sdbp_class;
+		slot->sdbp_device->parent = NULL;
+		slot->sdbp_device->devt = major_device_number + slot->number;
+		dev_set_drvdata(slot->sdbp_device, NULL);
+		dev_set_name(slot->sdbp_device, "slot%d", slot->number);
+		slot->sdbp_device->release = driver_release;
+		slot->sdbp_device->groups = dev_attr_groups;
+		slot->sdbp_device->driver = &sdbp_driver;
+		// slot->sdbp_device->bus =
+		//     &sdbp_bus;
+
+		ret = device_register(slot->sdbp_device);
+		if (ret) {
+			PRINT_SLOT_ERR("Device registration failed!\n", slot->number);
+			put_device(slot->sdbp_device);
+			kfree(slot->sdbp_device);
+			return ret;
+		}
+	}
+
+	{			// Bind device to driver
+		mutex_lock(&slot->sdbp_device->mutex);
+		if (device_bind_driver(slot->sdbp_device)) {
+			mutex_unlock(&slot->sdbp_device->mutex);
+			PRINT_SLOT_ERR("Binding device to driver failed!\n", slot->number);
+			device_destroy(sdbp_class, major_device_number + slot->number);
+			kobject_put(&driver_object->kobj);
+			return -ENODEV;
+		}
+		mutex_unlock(&slot->sdbp_device->mutex);
+	}
+	return 0;
+}
+
+/*
+ * Slot state machine, executed on the shared sdbp workqueue or the RT worker of the slot.
+ * Every run handles one step and re-arms itself with the delay the step needs,
+ * so no worker sleeps on behalf of a slot between steps.
+ */
+static void slot_step(struct Slot *slot)
+{
+	unsigned long delay = msecs_to_jiffies(SLOT_POLL_INTERVAL_MS);
+	int pm_ret;
+	int ret;
+
+	if (atomic_read(&slot->stop))
+		return;
+
+	switch (slot->state) {
+	case SLOT_STATE_DISCONNECTED:
+		{
+			if (!gpio_get_value(slot->interrupt_pin)) {
+				if (slot->debounce_cnt)
+					PRINT_SLOT_DBG("Stopped debounce phase after %d tries.\n", slot->number, slot->debounce_cnt);
+				slot->debounce_cnt = 0;
+				break;
+			}
+			if (++slot->debounce_cnt < SLOT_DEBOUNCE_TRIES)
+				break;
+			PRINT_SLOT_DBG("Debounce successful after %d tries.\n", slot->number, slot->debounce_cnt);
+			atomic_set(&slot->link_state, LINK_CONNECTED);
+			slot->debounce_cnt = 0;
+			slot->state = SLOT_STATE_INITIATING;
+			delay = 0;
+		}
+		break;
+	case SLOT_STATE_INITIATING:
+		{
+			PRINT_SLOT_DBG("Reached state initiating.\n", slot->number);
+			slot->frame_size = DEFAULT_FRAME_SIZE;
+			slot->speed_sclk = DEFAULT_SCLK_SPEED;
+			notification_queue_reset(&slot->notification, 0);
+			atomic64_set(&slot->announce_time, 0);
+			atomic_set(&slot->notification.lock, -1);
+			atomic_set(&slot->notification_arrived, 0);
+			atomic_set(&slot->interrupt_arrived, 0);
+			stats_new_session(&slot->stats);
+			cache_invalidate(&slot->cache);
+			if (get_descriptor(slot, &slot->descriptor, 0, 0)
+			    != 0) {
+				sync_com(slot);
+
+				if (slot->tx_err_cnt < 60) {
+					slot->tx_err_cnt++;
+					PRINT_SLOT_DBG("Increasing sleep time. %d\n", slot->number, slot->tx_err_cnt);
 				}
-				free_irq(slot_list[i]->irq_number, NULL);
-				//PRINT_DBG("Unloaded irq.");
-				gpio_unexport(slot_list[i]->interrupt_pin);
-				//PRINT_DBG("Unloaded gpio.");
-				gpio_free(slot_list[i]->interrupt_pin);
-				//PRINT_DBG("Free gpio.");
-				wait_for_completion(&slot_list[i]->dev_obj_is_free);
-				PRINT_SLOT_DBG("Released slot %d.", slot_list[i]->number, slot_list[i]->number);
+
+				delay = msecs_to_jiffies(1000 * slot->tx_err_cnt);
+				slot->state = SLOT_STATE_DISCONNECTED;
+				break;
 			}
+
+			slot->tx_err_cnt = 0;
+			if (attach_buffers(slot) != 0) {
+				PRINT_SLOT_ERR("Allocating slot buffers failed!\n", slot->number);
+				slot->state = SLOT_STATE_FAILED;
+				break;
+			}
+			if (register_slot_device(slot) != 0) {
+				slot->state = SLOT_STATE_FAILED;
+				break;
+			}
+			slot->was_connected = 1;
+
+			PRINT_SLOT_DBG("Reached state connected.\n", slot->number);
+			slot->state = SLOT_STATE_CONNECTED;
+			if (!atomic_read(&slot->notification_arrived))
+				return;	// Wait for the next event
+			delay = 0;
+		}
+		break;
+	case SLOT_STATE_CONNECTED:
+		{
+			if (!atomic_read(&slot->notification_arrived))
+				return;
+
+			pm_ret = slot_pm_get_nowait(slot);
+			if (pm_ret == -EINPROGRESS) {
+				delay = msecs_to_jiffies(SLOT_RESUME_POLL_MS);
+				break;
+			}
+			// Never wait for the bus here, an owner may keep it for a whole firmware upload. release_bus() kicks again.
+			if (!bus_try_acquire(&slot->bus, BUS_PRIO_NOTIFICATION)) {
+				PRINT_SLOT_DBG("Device is used.\n", slot->number);
+				if (pm_ret == 0)
+					slot_pm_put(slot);
+				return;
+			}
+			atomic_set(&slot->notification_arrived, 0);
+
+			ret = drain_notifications(slot);
+			if (ret < 0 && (fault_take_disconnect(&slot->faults) || !gpio_get_value(slot->interrupt_pin))) {
+				// Trigger blocking attribute
+				notification_queue_reset(&slot->notification, -1);
+				wake_up_all(&slot->notification.wait_for_notification);
+				sysfs_notify(&slot->sdbp_device->kobj, NULL, "notification_pending");
+
+				PRINT_SLOT_NORM("Device disconnected.\n", slot->number);
+				cancel_delayed_work(&slot->close_work);
+				slot->state = SLOT_STATE_DISCONNECTED;
+				device_release_driver(slot->sdbp_device);
+				device_destroy(sdbp_class, major_device_number + slot->number);
+				slot->was_connected = 0;
+				slot->rx_len = 0;	// A response of the old connection is not read anymore
+				slot->frame_size = DEFAULT_FRAME_SIZE;
+				if (resize_frame_buffers(slot, DEFAULT_FRAME_SIZE) != 0)
+					PRINT_SLOT_DBG("Frame buffers kept.\n", slot->number);
+				bus_release(&slot->bus);
+				if (pm_ret == 0)
+					pm_runtime_put_noidle(&slot->spi_device->dev);
+				break;
+			}
+
+			if (ret < 0)
+				PRINT_SLOT_ERR("Notification exchange failed.\n", slot->number);
+			else
+				PRINT_SLOT_DBG("Notification exchange successful.\n", slot->number);
+			// Line was low longer than LINK_DISCONNECT_TIMEOUT_US but the device is still there
+			if (gpio_get_value(slot->interrupt_pin))
+				atomic_cmpxchg(&slot->link_state, LINK_DISCONNECTED, LINK_CONNECTED);
+
+			bus_release(&slot->bus);
+			if (pm_ret == 0)
+				slot_pm_put(slot);
+			if (!atomic_read(&slot->notification_arrived))
+				return;
+			delay = 0;
+		}
+		break;
+	case SLOT_STATE_FAILED:
+		PRINT_SLOT_ERR("Slot not used because of an error!\n", slot->number);
+		return;
+	default:
+		PRINT_SLOT_ERR("Wrong enum state!\n", slot->number);
+		return;
+	}
+
+	slot_queue_work(slot, delay);
+}
+
+static void run_slot_work(struct Slot *slot)
+{
+	ktime_t kick_time = atomic64_xchg(&slot->kick_time, 0);
+	u32 latency_us;
+
+	mutex_lock(&slot->work_lock);
+	if (kick_time) {
+		latency_us = ktime_us_delta(ktime_get(), kick_time);
+		stats_inc(&slot->stats, STAT_WORKER_KICKS);
+		stats_add(&slot->stats, STAT_SCHED_LATENCY_US, latency_us);
+		if (latency_us > slot->sched_latency_us_max)
+			slot->sched_latency_us_max = latency_us;
+	}
+	slot_step(slot);
+	mutex_unlock(&slot->work_lock);
+}
+
+void sdbp_work(struct work_struct *work)
+{
+	run_slot_work(container_of(to_delayed_work(work), struct Slot, work));
+}
+
+static void rt_work_fn(struct kthread_work *work)
+{
+	run_slot_work(container_of(work, struct Slot, rt_work.work));
+}
+
+static int set_worker_priority(struct kthread_worker *worker, int priority)
+{
+	struct sched_attr attr = {
+		.size = sizeof(attr),
+		.sched_policy = priority ? SCHED_FIFO : SCHED_NORMAL,
+		.sched_priority = priority,
+	};
+
+	return sched_setattr_nocheck(worker->task, &attr);
+}
+
+/*
+ * A priority above 0 moves the slot work to a dedicated SCHED_FIFO worker thread "sdbp-slotX".
+ * The worker is kept until the slot is released, priority 0 turns it into a SCHED_NORMAL thread.
+ */
+int slot_set_rt_priority(struct Slot *slot, int priority)
+{
+	struct kthread_worker *worker;
+	int ret = 0;
+
+	if (priority < 0 || priority >= MAX_RT_PRIO)
+		return -EINVAL;
+
+	mutex_lock(&slot->sched_lock);
+	if (atomic_read(&slot->stop)) {
+		ret = -ENODEV;
+		goto unlock;
+	}
+
+	if (!slot->worker && priority) {
+		worker = kthread_create_worker(0, "sdbp-slot%d", slot->number);
+		if (IS_ERR(worker)) {
+			ret = PTR_ERR(worker);
+			goto unlock;
+		}
+		if (!cpumask_empty(slot->cpus))
+			set_cpus_allowed_ptr(worker->task, slot->cpus);
+		ret = set_worker_priority(worker, priority);
+		if (ret != 0) {
+			kthread_destroy_worker(worker);
+			goto unlock;
 		}
+		// New work goes to the worker, a step pending on the workqueue is moved over
+		smp_store_release(&slot->worker, worker);
+		if (cancel_delayed_work_sync(&slot->work))
+			kthread_queue_delayed_work(worker, &slot->rt_work, 0);
+	} else if (slot->worker) {
+		ret = set_worker_priority(slot->worker, priority);
+	}
+
+	if (ret == 0)
+		slot->rt_priority = priority;
+ unlock:
+	mutex_unlock(&slot->sched_lock);
+	return ret;
+}
+
+// An empty mask allows all CPUs. Not every interrupt controller supports IRQ affinity, which is not treated as error.
+int slot_set_cpu_affinity(struct Slot *slot, const struct cpumask *cpus)
+{
+	const struct cpumask *mask = cpumask_empty(cpus) ? cpu_possible_mask : cpus;
+	int ret = 0;
+
+	mutex_lock(&slot->sched_lock);
+	if (slot->worker)
+		ret = set_cpus_allowed_ptr(slot->worker->task, mask);
+	if (ret == 0) {
+		if (slot->irq_number > 0 && irq_set_affinity(slot->irq_number, mask) != 0)
+			PRINT_SLOT_DBG("IRQ %d affinity not supported.\n", slot->number, slot->irq_number);
+		cpumask_copy(slot->cpus, cpus);
 	}
+	mutex_unlock(&slot->sched_lock);
+	return ret;
 }
 
 static int __init sdbp_init(void)
 {
+	struct device_node *np;
 	u8 i, j;
 	PRINT_NORM("Registering sdbp driver v%s...\n", DRIVER_VERSION);
 
-	slot_list[0] = init_slot_struct(0, BUS_0_CS_0_INT);
-	slot_list[1] = init_slot_struct(1, BUS_0_CS_1_INT);
-	slot_list[2] = init_slot_struct(2, BUS_1_CS_0_INT);
-	slot_list[3] = init_slot_struct(3, BUS_1_CS_1_INT);
-	slot_list[4] = init_slot_struct(4, BUS_1_CS_2_INT);
-	slot_list[5] = init_slot_struct(5, BUS_2_CS_0_INT);
-	slot_list[6] = init_slot_struct(6, BUS_2_CS_1_INT);
-	slot_list[7] = init_slot_struct(7, BUS_2_CS_2_INT);
-
 	PRINT_NORM("Debug level NORMAL enabled.\n");
 	PRINT_DBG("Debug level DEBUG enabled.\n");
 	PRINT_ERR("Debug level ERROR enabled.\n");
 
+	if (max_slots < 1 || max_slots > MAXIMUM_SLOTS) {
+		PRINT_ERR("Parameter max_slots must be between 1 and %d!\n", MAXIMUM_SLOTS);
+		return -EINVAL;
+	}
+
 	if (bus_cnt == 0) {
 		PRINT_NORM("All SPI buses used.\n");
 	} else if (bus_cnt == 3) {
 		for (i = 0; i < bus_cnt; i++) {
 			if (!spi_bus[i]) {
-				for (j = 0; j < MINOR_DEVICES; j++) {
-					if (slot_list[j] != NULL) {
-						if (slot_list[j]->spi_bus == i) {
-							PRINT_NORM("Slot %d disabled.\n", slot_list[j]->number);
-							kfree(slot_list[j]);
-							slot_list[j] = NULL;
-						}
+				for (j = 0; j < ARRAY_SIZE(legacy_slots); j++) {
+					if (legacy_slots[j].spi_bus == i) {
+						PRINT_NORM("Slot %d disabled.\n", legacy_slots[j].number);
+						legacy_disabled[j] = true;
 					}
 				}
 				PRINT_NORM("Bus %d unused.", i);
@@ -495,20 +1487,29 @@ static int __init sdbp_init(void)
 		return -EINVAL;
 	}
 
+	sdbp_wq = alloc_workqueue("sdbp", WQ_UNBOUND | WQ_HIGHPRI | WQ_SYSFS, max_workers);
+	if (!sdbp_wq) {
+		PRINT_ERR("Failed to allocate workqueue...\n");
+		return -ENOMEM;
+	}
+	INIT_DELAYED_WORK(&legacy_work, legacy_work_fn);
+
+	if (init_padding() != 0)
+		goto free_workqueue;
+
 	if (bus_register(&sdbp_bus) != 0) {
 		PRINT_ERR("Failed to register sdbp bus...\n");
-		return -EAGAIN;
+		goto free_padding;
 	}
 
 	if (driver_register(&sdbp_driver) != 0) {
 		PRINT_ERR("Failed to register sdbp driver...\n");
-		bus_unregister(&sdbp_bus);
-		return -EAGAIN;
+		goto free_bus;
 	}
 
-	if (alloc_chrdev_region(&major_device_number, 0, MINOR_DEVICES, "sdbp_class")
+	if (alloc_chrdev_region(&major_device_number, 0, max_slots, "sdbp_class")
 	    < 0)
-		goto free_bus_and_slots;
+		goto free_driver;
 	driver_object = cdev_alloc();
 	if (driver_object == NULL)
 		goto free_device_number;
@@ -516,7 +1517,7 @@ static int __init sdbp_init(void)
 	driver_object->owner = THIS_MODULE;
 	driver_object->ops = &fops;
 
-	if (cdev_add(driver_object, major_device_number, MINOR_DEVICES))
+	if (cdev_add(driver_object, major_device_number, max_slots))
 		goto free_cdev;
 
 	sdbp_class = class_create(THIS_MODULE, "sdbp");
@@ -525,264 +1526,66 @@ static int __init sdbp_init(void)
 		goto free_cdev;
 	}
 
-	for (i = 0; i < MINOR_DEVICES; i++) {
-		if (slot_list[i] != NULL) {
-			slot_list[i]->thread = kthread_create(sdbp_main, slot_list[i], "sdbp-thread");
-			if (slot_list[i]->thread) {
-				wake_up_process(slot_list[i]->thread);
-			} else {
-				PRINT_ERR("Thread creation failed!\n");
-				goto free_cdev;
-			}
-			//usleep_range(1000000, 1500000);       // Wait to get structured descriptor logging
-		} else {
-			PRINT_DBG("Index %d disabled.", i);
-		}
+	if (fanout_init() != 0)
+		goto free_class;
+
+	// Optional, the driver works without debugfs
+	debugfs_root = debugfs_create_dir("sdbp", NULL);
+	if (spi_register_driver(&sdbp_spi_driver) != 0) {
+		PRINT_ERR("Failed to register sdbp SPI driver...\n");
+		goto free_fanout;
+	}
+
+	np = of_find_compatible_node(NULL, NULL, SDBP_OF_COMPATIBLE);
+	if (np) {
+		PRINT_NORM("Slots are described by the device tree.\n");
+		of_node_put(np);
+	} else {
+		PRINT_NORM("No device tree slots found, using legacy slot table.\n");
+		queue_delayed_work(sdbp_wq, &legacy_work, 0);
 	}
+
 	PRINT_NORM("Registered sdbp driver.\n");
 	return 0;
 
+ free_fanout:
+	debugfs_remove_recursive(debugfs_root);
+	fanout_exit();
+ free_class:
+	class_destroy(sdbp_class);
  free_cdev:
 	kobject_put(&driver_object->kobj);
-	goto free_device_number;
-
  free_device_number:
-	unregister_chrdev_region(major_device_number, MINOR_DEVICES);
-	goto free_bus_and_slots;
-
- free_bus_and_slots:
-	free_slots();
+	unregister_chrdev_region(major_device_number, max_slots);
+ free_driver:
 	driver_unregister(&sdbp_driver);
+ free_bus:
 	bus_unregister(&sdbp_bus);
+ free_padding:
+	free_padding();
+ free_workqueue:
+	destroy_workqueue(sdbp_wq);
 	return -EAGAIN;
 }
 
-int sdbp_main(void *data)
-{
-	struct Slot *slot = (struct Slot *)data;
-	u8 exit;
-	u8 was_connected;
-	int ret;
-	u8 tx_err_cnt;
-	u8 input;
-	int not_check;
-
-	enum {
-		disconnected, initiating, connected, failed
-	} state;
-
-	was_connected = 0;
-	exit = 0;
-	tx_err_cnt = 0;
-	input = 0;
-
-	state = disconnected;
-
-	if (init_slot(slot) != 0) {
-		PRINT_SLOT_ERR("Slot init failed!\n", slot->number);
-		state = failed;
-	}
-
-	while (!kthread_should_stop()) {
-		switch (state) {
-		case disconnected:
-			{
-				slot->session_stats.transmission_errors = 0;
-				slot->session_stats.notifications = 0;
-				slot->session_stats.notifications_failed = 0;
-				slot->session_stats.descriptor_failed = 0;
-				input = gpio_get_value(slot->interrupt_pin);
-				if (input) {
-					u8 cnt = 0;
-					for (cnt = 0; cnt < 5; cnt++) {
-						if (!gpio_get_value(slot->interrupt_pin)) {
-							PRINT_SLOT_DBG("Stopped debounce phase after %d tries.\n", slot->number, cnt);
-							break;	// Stop debounce phase
-						}
-
-						msleep_interruptible(100);
-					}
-					if (cnt < 4)
-						break;
-					PRINT_SLOT_DBG("Debounce successful after %d tries.\n", slot->number, cnt);
-					state = initiating;
-				} else
-					msleep_interruptible(100);
-			}
-			break;
-		case initiating:
-			{
-				PRINT_SLOT_DBG("Reached state initiating.\n", slot->number);
-				slot->frame_size = DEFAULT_FRAME_SIZE;
-				slot->speed_sclk = DEFAULT_SCLK_SPEED;
-				atomic_set(&slot->notification.length, 0);
-				atomic_set(&slot->notification.lock, -1);
-				atomic_set(&slot->notification_arrived, 0);
-				atomic_set(&slot->interrupt_arrived, 0);
-				slot->session_stats.transmission_errors = 0;
-				slot->session_stats.notifications = 0;
-				slot->session_stats.notifications_failed = 0;
-				if (get_descriptor(slot, &slot->descriptor, 0, 0)
-				    != 0) {
-					sync_com(slot);
-
-					if (tx_err_cnt < 60) {
-						tx_err_cnt++;
-						PRINT_SLOT_DBG("Increasing sleep time. %d\n", slot->number, tx_err_cnt);
-					}
-
-					msleep_interruptible(1000 * tx_err_cnt);
-					state = disconnected;
-				} else {
-					tx_err_cnt = 0;
-					was_connected = 1;
-
-					{	// Register device
-						slot->sdbp_device = kzalloc(sizeof(struct device), GFP_KERNEL);
-						if (!slot->sdbp_device) {
-							PRINT_SLOT_ERR("Could not allocate memory!\n", slot->number);
-							state = failed;
-							break;
-						}
-
-						slot->sdbp_device->class = sdbp_class;
-						slot->sdbp_device->parent = NULL;
-						slot->sdbp_device->devt = major_device_number + slot->number;
-						dev_set_drvdata(slot->sdbp_device, NULL);
-						dev_set_name(slot->sdbp_device, "slot%d", slot->number);
-						slot->sdbp_device->release = driver_release;
-						slot->sdbp_device->groups = dev_attr_groups;
-						slot->sdbp_device->driver = &sdbp_driver;
-						// slot->sdbp_device->bus =
-						//     &sdbp_bus;
-
-						ret = device_register(slot->sdbp_device);
-						if (ret) {
-							PRINT_SLOT_ERR("Device registration failed!\n", slot->number);
-							put_device(slot->sdbp_device);
-							kfree(slot->sdbp_device);
-							state = failed;
-							break;
-						}
-					}
-
-					{	// Bind device to driver
-						mutex_lock(&slot->sdbp_device->mutex);
-						if (device_bind_driver(slot->sdbp_device)) {
-							mutex_unlock(&slot->sdbp_device->mutex);
-							PRINT_SLOT_ERR("Binding device to driver failed!\n", slot->number);
-							device_destroy(sdbp_class, major_device_number + slot->number);
-							kobject_put(&driver_object->kobj);
-							state = failed;
-							break;
-						}
-						mutex_unlock(&slot->sdbp_device->mutex);
-					}
-
-					PRINT_SLOT_DBG("Reached state connected.\n", slot->number);
-					state = connected;
-				}
-			}
-			break;
-		case connected:
-			{
-
-				ret = wait_event_interruptible(slot->queue, atomic_read(&slot->notification_arrived)
-							       > 0 || atomic_read(&slot->stop));
-
-				if (ret == -ERESTARTSYS) {
-					PRINT_SLOT_DBG("Interrupted by system!\n", slot->number);
-				}
-
-				if (atomic_read(&slot->stop)) {
-					//exit = 1;
-					break;
-				}
-
-				if (!atomic_inc_and_test(&slot->write_count)) {
-					PRINT_SLOT_DBG("Device is used %d.\n", slot->number, atomic_read(&slot->write_count));
-					ret = wait_event_interruptible(slot->wait_queue_for_write, atomic_read(&slot->write_count) == 0
-								       || atomic_read(&slot->stop));
-
-					if (ret == ERESTARTSYS) {
-						PRINT_SLOT_DBG("Notification interrupted by system!\n", slot->number);
-						atomic_dec(&slot->write_count);
-						wake_up_all(&slot->wait_queue_for_write);
-						break;
-					}
-					PRINT_SLOT_DBG("Device freed.\n", slot->number);
-				}
-				not_check = get_notification(slot);
-				if (not_check != 0) {
-					input = gpio_get_value(slot->interrupt_pin);
-					if (input == 0) {
-
-						// Trigger blocking attribute
-						atomic_set(&slot->notification.length, -1);
-						wake_up_all(&slot->notification.wait_for_notification);
-
-						PRINT_SLOT_NORM("Device disconnected.\n", slot->number);
-						device_release_driver(slot->sdbp_device);
-						device_destroy(sdbp_class, major_device_number + slot->number);
-						was_connected = 0;
-						state = disconnected;
-						msleep_interruptible(100);
-					} else {
-						if (not_check == -2)
-							PRINT_SLOT_DBG("Notification queue is full.\n", slot->number);
-						else
-							PRINT_SLOT_ERR("Notification exchange failed.\n", slot->number);
-					}
-				} else {
-					PRINT_SLOT_DBG("Notification exchange successful.\n", slot->number);
-				}
-				atomic_dec(&slot->write_count);
-				wake_up_all(&slot->wait_queue_for_write);
-				atomic_set(&slot->notification_arrived, 0);
-			}
-			break;
-		case failed:
-			{
-				PRINT_SLOT_ERR("Slot not used because of an error!\n", slot->number);
-				while (!kthread_should_stop()) {
-					msleep_interruptible(100);
-				}
-			}
-			break;
-		default:
-			PRINT_SLOT_ERR("Wrong enum state!\n", slot->number);
-		}
-		if (exit) {
-			while (!kthread_should_stop()) {
-				msleep_interruptible(100);
-			}
-		}
-
-	}
-
-	if (was_connected) {
-		device_release_driver(slot->sdbp_device);
-		device_destroy(sdbp_class, major_device_number + slot->number);
-	} else {
-		complete(&slot->dev_obj_is_free);
-	}
-	kfree(slot->tx_buffer);
-	kfree(slot->rx_buffer);
-	return 0;
-}
-
 static void __exit sdbp_exit(void)
 {
 
 	PRINT_NORM("Driver unloading.\n");
 
-	free_slots();
+	fanout_exit();
+	legacy_release();
+	spi_unregister_driver(&sdbp_spi_driver);
+	debugfs_remove_recursive(debugfs_root);
+	destroy_workqueue(sdbp_wq);
 
 	class_destroy(sdbp_class);
 	cdev_del(driver_object);
-	unregister_chrdev_region(major_device_number, MINOR_DEVICES);
+	unregister_chrdev_region(major_device_number, max_slots);
 	driver_unregister(&sdbp_driver);
 	bus_unregister(&sdbp_bus);
+	free_padding();
+	idr_destroy(&slot_idr);
 	PRINT_NORM("Driver unloaded.\n");
 }
 
@@ -794,4 +1597,5 @@ MODULE_AUTHOR("Richard Schleich <rs@noreya.tech>");
 MODULE_DESCRIPTION("Serial Device Bus Protocol (SDBP) driver");
 MODULE_SOFTDEP("post: spi_bcm2835aux");
 MODULE_SOFTDEP("post: spi_bcm2835");
+MODULE_ALIAS("spi:sdbpk");
 MODULE_VERSION(DRIVER_VERSION);
@@ -1,13 +1,48 @@
 #ifndef SDBP_H_
 #define SDBP_H_
 
+#include <linux/export.h>
 #include <linux/irq.h>
+#include <linux/workqueue.h>
 
-int sdbp_main(void *data);
+enum slot_state {
+	SLOT_STATE_DISCONNECTED,
+	SLOT_STATE_INITIATING,
+	SLOT_STATE_CONNECTED,
+	SLOT_STATE_FAILED,
+};
+
+// Interrupt line state, tracked from the falling edge and sampled by the link timer
+enum link_state {
+	LINK_CONNECTED,		// Line high, device idle
+	LINK_BUSY,		// Line low, CTS or notification request
+	LINK_DISCONNECTED,	// Line low for more than LINK_DISCONNECT_TIMEOUT_US, until the next edge or notification fetch
+};
+
+struct Slot;
+
+// Slot description handed to the spi_driver as platform data when no device tree is present
+struct sdbp_slot_config {
+	int number;
+	u8 spi_bus;
+	u8 spi_chip_select;
+	int interrupt_pin;
+	u8 cs_pin_alt;
+};
+
+#define SDBP_OF_COMPATIBLE "nexus-unity,sdbp-slot"
+
+void sdbp_work(struct work_struct *work);
+void sdbp_kick(struct Slot *slot);
+void release_bus(struct Slot *slot);
+void reset_session(struct Slot *slot);
+int slot_set_rt_priority(struct Slot *slot, int priority);
+int slot_set_cpu_affinity(struct Slot *slot, const struct cpumask *cpus);
 irqreturn_t gpio_rising_interrupt(int irq, void *dev_id);
 struct Slot *get_slot(int index);
+struct Slot *get_slot_ref(int index);
+void put_slot(struct Slot *slot);
 int find_slot(dev_t devt);
-void free_slots(void);
 
 #define BUS_0_CS_0_INT 0,0,34,8
 #define BUS_0_CS_1_INT 0,1,35,7
@@ -18,8 +53,22 @@ void free_slots(void);
 #define BUS_2_CS_1_INT 2,1,30,44
 #define BUS_2_CS_2_INT 2,2,31,45
 
-#define MINOR_DEVICES 8
+#define DEFAULT_MAX_SLOTS 64
+#define MAXIMUM_SLOTS 1024
+#define SLOT_INIT_TRIES 20
+#define SLOT_DEBOUNCE_TRIES 5
+#define SLOT_POLL_INTERVAL_MS 100
+#define SLOT_RESUME_POLL_MS 1
+#define LINK_SAMPLE_INTERVAL_US 250
+#define LINK_DISCONNECT_TIMEOUT_US 1000
+
+#define DRIVER_VERSION "1.2.0"
 
-#define DRIVER_VERSION "1.1.2"
+// Symbols used by the sdbp_kunit test module, only exported when CONFIG_SDBPK_KUNIT_TEST is set
+#ifdef SDBPK_KUNIT_EXPORTS
+#define EXPORT_FOR_KUNIT(sym) EXPORT_SYMBOL_GPL(sym)
+#else
+#define EXPORT_FOR_KUNIT(sym)
+#endif
 
 #endif
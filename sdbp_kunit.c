@@ -0,0 +1,594 @@
+#include <kunit/test.h>
+#include <linux/module.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/ratelimit.h>
+#include <linux/slab.h>
+#include "descriptor.h"
+#include "communication.h"
+#include "stats.h"
+
+/*
+ * Frame codec and exchange_sdbp() driven by a mock slot->transfer which answers with scripted frames and raises
+ * the ready interrupt itself. Separate module (CONFIG_SDBPK_KUNIT_TEST), sdbpk exports the tested functions.
+ */
+
+#define MOCK_STEPS 4
+#define BENCH_ROUNDS 1000
+
+struct mock_step {
+	const u8 *frame;	// Unpadded frame, padded and CRC'd at the frame size of the transfer
+	bool corrupt;		// CRC low byte flipped
+	u32 ready_us;		// Ready interrupt that long after the transfer, ends a device WAIT
+};
+
+struct mock_slot {
+	struct Slot slot;
+	const struct mock_step *steps;
+	int step_cnt;
+	int transfers;
+	u8 tx[MOCK_STEPS][MAXIMUM_FRAME_SIZE];	// Frames as they went over the wire
+	struct hrtimer ready_timer;
+};
+
+// Frames as the device sends them, length in bytes 1 and 2
+static const u8 PROTOCOL_VERSION_RESPONSE[] = { 0x02, 0x00, 0x0D, 0x00, 0x01, 0x02, 0x08, 0x00, 0x01, 0x00, 0x02, 0x00, 0x03 };
+static const u8 ACKNOWLEDGEMENT[] = { 0x04, 0x00, 0x04, 0x00 };
+static const u8 FRAME_SIZE_REQUEST[] = { 0x01, 0x00, 0x09, 0x00, 0x01, 0x03, 0x07, 0x00, 0x80 };	// 128 bytes
+static const u8 FRAME_SIZE_ACCEPTED[] = { 0x02, 0x00, 0x08, 0x00, 0x01, 0x03, 0x07, 0x00 };
+static const u8 FRAME_SIZE_REJECTED[] = { 0x02, 0x00, 0x08, 0x00, 0x01, 0x03, 0x07, 0x01 };
+static const u8 SCLK_REQUEST[] = { 0x01, 0x00, 0x0B, 0x00, 0x01, 0x03, 0x08, 0x00, 0x00, 0x4E, 0x20 };	// 20000 kHz
+static const u8 SCLK_ACCEPTED[] = { 0x02, 0x00, 0x08, 0x00, 0x01, 0x03, 0x08, 0x00 };
+static const u8 WAIT_RESPONSE[] = { 0x02, 0x00, 0x0B, 0x00, 0x01, 0x05, 0x02, 0x00, 0x00, 0x4E, 0x20 };	// 20000 us
+static const u8 WAIT_SUB_MS[] = { 0x02, 0x00, 0x0B, 0x00, 0x01, 0x05, 0x02, 0x00, 0x00, 0x01, 0xF4 };	// 500 us
+static const u8 WAIT_SHORT[] = { 0x02, 0x00, 0x0A, 0x00, 0x01, 0x05, 0x02, 0x00, 0x4E, 0x20 };	// Length 10, no WAIT
+
+#define WAIT_RESPONSE_US 20000
+
+// CRC16 (XMODEM) of frames padded with DUMMY_PATTERN, calculated independently of crc16_ccitt()
+struct codec_vector {
+	u32 frame_size;
+	u16 request_crc;	// DESCRIPTOR_GET_PROTOCOL_VERSION
+	u16 dummy_crc;		// DUMMY_DUMMY
+};
+
+static const struct codec_vector codec_vectors[] = {
+	{ 64, 0x883c, 0x1331 },
+	{ 128, 0xdc4f, 0x7fe6 },
+	{ 256, 0x4433, 0xf9ca },
+	{ 512, 0x32ba, 0x8e4e },
+	{ 1024, 0xa388, 0x7d8b },
+	{ 2048, 0xf3a5, 0xcc05 },
+	{ 4096, 0xf99f, 0x25fb },
+};
+
+static void codec_vector_desc(const struct codec_vector *vector, char *desc)
+{
+	snprintf(desc, KUNIT_PARAM_DESC_SIZE, "frame_size=%u", vector->frame_size);
+}
+
+KUNIT_ARRAY_PARAM(codec, codec_vectors, codec_vector_desc);
+
+// Bitwise reference, the driver uses the table based crc16_ccitt()
+static u16 reference_crc(const u8 * data, u32 length)
+{
+	u16 crc = 0;
+	int bit;
+
+	while (length--) {
+		crc ^= *data++ << 8;
+		for (bit = 0; bit < 8; bit++)
+			crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+	return crc;
+}
+
+// Pads the frame with DUMMY_PATTERN and appends the CRC like a device does
+static void build_frame(u8 * frame, u32 frame_size, const u8 * data)
+{
+	u16 length = (data[1] << 8) | data[2];
+	u16 crc;
+
+	memcpy(frame, data, length);
+	memset(frame + length, DUMMY_PATTERN, frame_size - DEFAULT_CRC_SIZE - length);
+	crc = reference_crc(frame, frame_size - DEFAULT_CRC_SIZE);
+	frame[frame_size - DEFAULT_CRC_SIZE] = crc >> 8;
+	frame[frame_size - DEFAULT_CRC_SIZE + 1] = crc & 0xff;
+}
+
+// Header, DUMMY_PATTERN up to the CRC and the CRC of a whole frame
+static void expect_frame(struct kunit *test, const u8 * frame, u32 frame_size, const u8 * header, u16 length, u16 crc)
+{
+	u32 crc_pos = frame_size - DEFAULT_CRC_SIZE;
+	u32 i;
+
+	KUNIT_EXPECT_EQ(test, memcmp(frame, header, length), 0);
+	for (i = length; i < crc_pos; i++)
+		if (frame[i] != DUMMY_PATTERN)
+			break;
+	KUNIT_EXPECT_EQ_MSG(test, i, crc_pos, "padding");
+	KUNIT_EXPECT_EQ(test, frame[crc_pos] << 8 | frame[crc_pos + 1], crc);
+}
+
+// Frame as spi_api_exchange() sends it: header and payload, DUMMY_PATTERN padding and slot->tx_crc
+static void wire_frame(struct Slot *slot, const u8 * data, u8 * frame)
+{
+	u16 length = (data[1] << 8) | data[2];
+
+	memcpy(frame, data, length);
+	memset(frame + length, DUMMY_PATTERN, slot->frame_size - slot->crc_size - length);
+	memcpy(frame + slot->frame_size - slot->crc_size, slot->tx_crc, slot->crc_size);
+}
+
+// Same as the interrupt handler for a ready edge
+static void mock_ready(struct Slot *slot)
+{
+	atomic64_set(&slot->irq_time, ktime_get());
+	atomic_set(&slot->interrupt_arrived, 1);
+	wake_up_all(&slot->queue);
+}
+
+static enum hrtimer_restart mock_ready_fn(struct hrtimer *timer)
+{
+	struct mock_slot *mock = container_of(timer, struct mock_slot, ready_timer);
+
+	mock_ready(&mock->slot);
+	return HRTIMER_NORESTART;
+}
+
+// The device is ready right after every frame, transfers beyond the script receive an empty frame
+static ssize_t mock_transfer(struct Slot *slot, u8 * tx_buffer, u8 * rx_buffer)
+{
+	struct mock_slot *mock = container_of(slot, struct mock_slot, slot);
+	const struct mock_step *step;
+
+	if (mock->transfers >= mock->step_cnt) {
+		memset(rx_buffer, 0, slot->frame_size);
+		mock_ready(slot);
+		return -EIO;
+	}
+
+	step = &mock->steps[mock->transfers];
+	wire_frame(slot, tx_buffer, mock->tx[mock->transfers]);
+	mock->transfers++;
+
+	build_frame(rx_buffer, slot->frame_size, step->frame);
+	if (step->corrupt)
+		rx_buffer[slot->frame_size - 1] ^= 0xff;
+
+	mock_ready(slot);
+	if (step->ready_us)
+		hrtimer_start(&mock->ready_timer, us_to_ktime(step->ready_us), HRTIMER_MODE_REL);
+	return 0;
+}
+
+static int mock_exchange(struct kunit *test, const u8 * request, const struct mock_step *steps, int step_cnt)
+{
+	struct mock_slot *mock = test->priv;
+
+	mock->steps = steps;
+	mock->step_cnt = step_cnt;
+	mock->transfers = 0;
+	return exchange_sdbp(&mock->slot, (u8 *) request, mock->slot.rx_buffer, LOG_LVL_SILENT);
+}
+
+static u64 mock_stat(struct kunit *test, enum sdbp_stat id)
+{
+	struct mock_slot *mock = test->priv;
+
+	return stats_get_session(&mock->slot.stats, id);
+}
+
+static u8 *mock_buffer(struct kunit *test, size_t size)
+{
+	u8 *buffer = kunit_kzalloc(test, size, GFP_KERNEL);
+
+	KUNIT_ASSERT_NOT_NULL(test, buffer);
+	return buffer;
+}
+
+// Buffers of the largest frame size, so every test can change the frame size
+static int mock_init(struct kunit *test)
+{
+	struct mock_slot *mock;
+	struct Slot *slot;
+
+	mock = kunit_kzalloc(test, sizeof(*mock), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, mock);
+	slot = &mock->slot;
+	slot->tx_buffer = mock_buffer(test, MAXIMUM_FRAME_SIZE);
+	slot->rx_buffer = mock_buffer(test, MAXIMUM_FRAME_SIZE);
+	slot->tx_frame = mock_buffer(test, MAXIMUM_FRAME_SIZE);
+	slot->dummy_buffer = mock_buffer(test, MAXIMUM_FRAME_SIZE);
+	slot->tx_crc = mock_buffer(test, CRC32_SIZE);
+	slot->dummy_frame = mock_buffer(test, MAXIMUM_FRAME_SIZE);
+	memcpy(slot->dummy_frame, DUMMY_DUMMY, sizeof(DUMMY_DUMMY));
+	KUNIT_ASSERT_EQ(test, stats_init(&slot->stats), 0);
+
+	slot->transfer = mock_transfer;
+	slot->frame_size = DEFAULT_FRAME_SIZE;
+	slot->buffer_size = MAXIMUM_FRAME_SIZE;
+	slot->speed_sclk = DEFAULT_SCLK_SPEED;
+	slot->descriptor.max_frame_size = MAXIMUM_FRAME_SIZE;
+	slot->descriptor.max_sclk_speed = 50000;
+	init_waitqueue_head(&slot->queue);
+	ratelimit_state_init(&slot->print_limit, DEFAULT_RATELIMIT_INTERVAL, DEFAULT_RATELIMIT_BURST);
+	fault_init(&slot->faults);
+	hrtimer_init(&mock->ready_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	mock->ready_timer.function = mock_ready_fn;
+	test->priv = mock;
+	return 0;
+}
+
+static void mock_exit(struct kunit *test)
+{
+	struct mock_slot *mock = test->priv;
+
+	if (!mock)
+		return;		// mock_init() failed
+	hrtimer_cancel(&mock->ready_timer);
+	stats_free(&mock->slot.stats);
+}
+
+static void prepare_frame_vectors(struct kunit *test)
+{
+	const struct codec_vector *vector = test->param_value;
+	struct mock_slot *mock = test->priv;
+	struct Slot *slot = &mock->slot;
+	u8 *frame = slot->tx_buffer;
+
+	slot->frame_size = vector->frame_size;
+	memcpy(frame, DESCRIPTOR_GET_PROTOCOL_VERSION, sizeof(DESCRIPTOR_GET_PROTOCOL_VERSION));
+	KUNIT_ASSERT_EQ(test, prepare_frame(slot, frame), 0);
+	KUNIT_EXPECT_EQ(test, slot->crc_size, DEFAULT_CRC_SIZE);
+	KUNIT_EXPECT_EQ(test, frame[sizeof(DESCRIPTOR_GET_PROTOCOL_VERSION)], 0);	// Padded on the wire only
+	wire_frame(slot, frame, slot->rx_buffer);
+	expect_frame(test, slot->rx_buffer, vector->frame_size, DESCRIPTOR_GET_PROTOCOL_VERSION, sizeof(DESCRIPTOR_GET_PROTOCOL_VERSION),
+		     vector->request_crc);
+
+	// Largest payload of the frame size and one byte more
+	frame[1] = (vector->frame_size - DEFAULT_CRC_SIZE) >> 8;
+	frame[2] = (vector->frame_size - DEFAULT_CRC_SIZE) & 0xff;
+	KUNIT_EXPECT_EQ(test, prepare_frame(slot, frame), 0);
+	frame[1] = (vector->frame_size - DEFAULT_CRC_SIZE + 1) >> 8;
+	frame[2] = (vector->frame_size - DEFAULT_CRC_SIZE + 1) & 0xff;
+	KUNIT_EXPECT_EQ(test, prepare_frame(slot, frame), -1);
+}
+
+static void prepare_dummy_vectors(struct kunit *test)
+{
+	const struct codec_vector *vector = test->param_value;
+	struct mock_slot *mock = test->priv;
+	struct Slot *slot = &mock->slot;
+
+	// Rebuilt after a frame size change, from a larger and a smaller frame size
+	slot->frame_size = vector->frame_size == DEFAULT_FRAME_SIZE ? MAXIMUM_FRAME_SIZE : DEFAULT_FRAME_SIZE;
+	prepare_dummy(slot);
+	slot->frame_size = vector->frame_size;
+	prepare_dummy(slot);
+	KUNIT_EXPECT_EQ(test, slot->dummy_frame_size, vector->frame_size);
+	KUNIT_EXPECT_EQ(test, slot->crc_size, DEFAULT_CRC_SIZE);
+	expect_frame(test, slot->dummy_frame, vector->frame_size, DUMMY_DUMMY, sizeof(DUMMY_DUMMY), vector->dummy_crc);
+	KUNIT_EXPECT_EQ(test, check_crc(slot, slot->dummy_frame, LOG_LVL_SILENT), 0);
+	KUNIT_EXPECT_EQ(test, slot->tx_crc[0] << 8 | slot->tx_crc[1], vector->dummy_crc);
+
+	// Unchanged frame size, only tx_crc is restored
+	memset(slot->tx_crc, 0, DEFAULT_CRC_SIZE);
+	prepare_dummy(slot);
+	KUNIT_EXPECT_EQ(test, slot->tx_crc[0] << 8 | slot->tx_crc[1], vector->dummy_crc);
+}
+
+static void check_crc_vectors(struct kunit *test)
+{
+	const struct codec_vector *vector = test->param_value;
+	struct mock_slot *mock = test->priv;
+	struct Slot *slot = &mock->slot;
+	u8 *frame = slot->rx_buffer;
+	u32 corrupt[] = { 0, 6, sizeof(DESCRIPTOR_GET_PROTOCOL_VERSION), vector->frame_size - 2, vector->frame_size - 1 };
+	int i;
+
+	slot->frame_size = vector->frame_size;
+	slot->crc_size = DEFAULT_CRC_SIZE;
+	memcpy(frame, DESCRIPTOR_GET_PROTOCOL_VERSION, sizeof(DESCRIPTOR_GET_PROTOCOL_VERSION));
+	memset(frame + sizeof(DESCRIPTOR_GET_PROTOCOL_VERSION), DUMMY_PATTERN, vector->frame_size - sizeof(DESCRIPTOR_GET_PROTOCOL_VERSION));
+	frame[vector->frame_size - 2] = vector->request_crc >> 8;
+	frame[vector->frame_size - 1] = vector->request_crc & 0xff;
+	KUNIT_EXPECT_EQ(test, check_crc(slot, frame, LOG_LVL_SILENT), 0);
+
+	// Header, payload, padding and both CRC bytes
+	for (i = 0; i < ARRAY_SIZE(corrupt); i++) {
+		frame[corrupt[i]] ^= 0x01;
+		KUNIT_EXPECT_EQ_MSG(test, check_crc(slot, frame, LOG_LVL_SILENT), -1, "byte %u", corrupt[i]);
+		frame[corrupt[i]] ^= 0x01;
+	}
+	KUNIT_EXPECT_EQ(test, mock_stat(test, STAT_CRC_ERRORS), ARRAY_SIZE(corrupt));
+}
+
+// Request and dummy frame as they go over the wire
+static void exchange_frames(struct kunit *test)
+{
+	const struct codec_vector *vector = test->param_value;
+	struct mock_slot *mock = test->priv;
+	struct Slot *slot = &mock->slot;
+	static const struct mock_step steps[] = {
+		{.frame = DUMMY_DUMMY },
+		{.frame = PROTOCOL_VERSION_RESPONSE },
+	};
+
+	slot->frame_size = vector->frame_size;
+	KUNIT_ASSERT_EQ(test, mock_exchange(test, DESCRIPTOR_GET_PROTOCOL_VERSION, steps, ARRAY_SIZE(steps)), 0);
+	KUNIT_ASSERT_EQ(test, mock->transfers, 2);
+	expect_frame(test, mock->tx[0], vector->frame_size, DESCRIPTOR_GET_PROTOCOL_VERSION, sizeof(DESCRIPTOR_GET_PROTOCOL_VERSION),
+		     vector->request_crc);
+	expect_frame(test, mock->tx[1], vector->frame_size, DUMMY_DUMMY, sizeof(DUMMY_DUMMY), vector->dummy_crc);
+	KUNIT_EXPECT_EQ(test, memcmp(slot->rx_buffer, PROTOCOL_VERSION_RESPONSE, sizeof(PROTOCOL_VERSION_RESPONSE)), 0);
+	KUNIT_EXPECT_NE(test, slot->response_irq, 0);
+	KUNIT_EXPECT_EQ(test, mock_stat(test, STAT_TRANSACTIONS), 1);
+	KUNIT_EXPECT_EQ(test, mock_stat(test, STAT_TRANSACTIONS_FAILED), 0);
+}
+
+static void control_frame_size(struct kunit *test)
+{
+	struct mock_slot *mock = test->priv;
+	struct Slot *slot = &mock->slot;
+	u8 request[sizeof(FRAME_SIZE_REQUEST)];
+	static const struct mock_step accepted[] = {
+		{.frame = DUMMY_DUMMY },
+		{.frame = FRAME_SIZE_ACCEPTED },
+	};
+	static const struct mock_step rejected[] = {
+		{.frame = DUMMY_DUMMY },
+		{.frame = FRAME_SIZE_REJECTED },
+	};
+
+	memcpy(request, FRAME_SIZE_REQUEST, sizeof(request));
+	KUNIT_EXPECT_EQ(test, check_frame_size_change(request, sizeof(request), 128, slot), 128);
+	KUNIT_EXPECT_EQ(test, check_frame_size_change(request, sizeof(request), 127, slot), -1);
+	request[8] = 63;
+	KUNIT_EXPECT_EQ(test, check_frame_size_change(request, sizeof(request), MAXIMUM_FRAME_SIZE, slot), -1);
+	KUNIT_EXPECT_EQ(test, check_frame_size_change((u8 *) DESCRIPTOR_GET_PROTOCOL_VERSION, sizeof(DESCRIPTOR_GET_PROTOCOL_VERSION),
+						      MAXIMUM_FRAME_SIZE, slot), 0);
+
+	// Only applied once the device confirmed the request
+	KUNIT_ASSERT_EQ(test, mock_exchange(test, FRAME_SIZE_REQUEST, rejected, ARRAY_SIZE(rejected)), 0);
+	KUNIT_EXPECT_EQ(test, slot->frame_size, DEFAULT_FRAME_SIZE);
+	KUNIT_ASSERT_EQ(test, mock_exchange(test, DESCRIPTOR_GET_PROTOCOL_VERSION, accepted, ARRAY_SIZE(accepted)), 0);
+	KUNIT_EXPECT_EQ(test, slot->frame_size, DEFAULT_FRAME_SIZE);
+	KUNIT_ASSERT_EQ(test, mock_exchange(test, FRAME_SIZE_REQUEST, accepted, ARRAY_SIZE(accepted)), 0);
+	KUNIT_EXPECT_EQ(test, slot->frame_size, 128);
+}
+
+static void control_sclk(struct kunit *test)
+{
+	struct mock_slot *mock = test->priv;
+	struct Slot *slot = &mock->slot;
+	u8 request[sizeof(SCLK_REQUEST)];
+	static const struct mock_step accepted[] = {
+		{.frame = DUMMY_DUMMY },
+		{.frame = SCLK_ACCEPTED },
+	};
+
+	memcpy(request, SCLK_REQUEST, sizeof(request));
+	KUNIT_EXPECT_EQ(test, check_sclk_change(request, sizeof(request), 20000, slot), 20000);
+	KUNIT_EXPECT_EQ(test, check_sclk_change(request, sizeof(request), 19999, slot), -1);
+	request[9] = 0;
+	request[10] = 99;
+	KUNIT_EXPECT_EQ(test, check_sclk_change(request, sizeof(request), 50000, slot), -1);
+	KUNIT_EXPECT_EQ(test, check_sclk_change(request, sizeof(request) - 1, 50000, slot), 0);
+
+	KUNIT_ASSERT_EQ(test, mock_exchange(test, SCLK_REQUEST, accepted, ARRAY_SIZE(accepted)), 0);
+	KUNIT_EXPECT_EQ(test, slot->speed_sclk, 20000 * 1000);
+	KUNIT_EXPECT_EQ(test, slot->frame_size, DEFAULT_FRAME_SIZE);
+}
+
+// The dummy frame is sent again and its response replaces the corrupted one
+static void retransmit_crc(struct kunit *test)
+{
+	struct mock_slot *mock = test->priv;
+	struct Slot *slot = &mock->slot;
+	static const struct mock_step once[] = {
+		{.frame = DUMMY_DUMMY },
+		{.frame = PROTOCOL_VERSION_RESPONSE,.corrupt = true },
+		{.frame = PROTOCOL_VERSION_RESPONSE },
+	};
+	static const struct mock_step twice[] = {
+		{.frame = DUMMY_DUMMY },
+		{.frame = PROTOCOL_VERSION_RESPONSE,.corrupt = true },
+		{.frame = PROTOCOL_VERSION_RESPONSE,.corrupt = true },
+	};
+
+	KUNIT_ASSERT_EQ(test, mock_exchange(test, DESCRIPTOR_GET_PROTOCOL_VERSION, once, ARRAY_SIZE(once)), 0);
+	KUNIT_ASSERT_EQ(test, mock->transfers, 3);
+	KUNIT_EXPECT_EQ(test, memcmp(mock->tx[2], DUMMY_DUMMY, sizeof(DUMMY_DUMMY)), 0);
+	KUNIT_EXPECT_EQ(test, memcmp(slot->rx_buffer, PROTOCOL_VERSION_RESPONSE, sizeof(PROTOCOL_VERSION_RESPONSE)), 0);
+	KUNIT_EXPECT_EQ(test, check_crc(slot, slot->rx_buffer, LOG_LVL_SILENT), 0);
+	KUNIT_EXPECT_EQ(test, mock_stat(test, STAT_RETRANSMITS_CRC), 1);
+
+	KUNIT_EXPECT_EQ(test, mock_exchange(test, DESCRIPTOR_GET_PROTOCOL_VERSION, twice, ARRAY_SIZE(twice)), -1);
+	KUNIT_EXPECT_EQ(test, mock->transfers, 3);
+	KUNIT_EXPECT_EQ(test, mock_stat(test, STAT_RETRANSMITS_CRC), 2);
+	KUNIT_EXPECT_EQ(test, mock_stat(test, STAT_TRANSACTIONS_FAILED), 1);
+}
+
+static void retransmit_ack(struct kunit *test)
+{
+	struct mock_slot *mock = test->priv;
+	struct Slot *slot = &mock->slot;
+	static const struct mock_step once[] = {
+		{.frame = DUMMY_DUMMY },
+		{.frame = ACKNOWLEDGEMENT },
+		{.frame = PROTOCOL_VERSION_RESPONSE },
+	};
+	static const struct mock_step twice[] = {
+		{.frame = DUMMY_DUMMY },
+		{.frame = ACKNOWLEDGEMENT },
+		{.frame = ACKNOWLEDGEMENT },
+	};
+
+	KUNIT_ASSERT_EQ(test, mock_exchange(test, DESCRIPTOR_GET_PROTOCOL_VERSION, once, ARRAY_SIZE(once)), 0);
+	KUNIT_ASSERT_EQ(test, mock->transfers, 3);
+	KUNIT_EXPECT_EQ(test, memcmp(mock->tx[2], DUMMY_DUMMY, sizeof(DUMMY_DUMMY)), 0);
+	KUNIT_EXPECT_EQ(test, memcmp(slot->rx_buffer, PROTOCOL_VERSION_RESPONSE, sizeof(PROTOCOL_VERSION_RESPONSE)), 0);
+	KUNIT_EXPECT_EQ(test, mock_stat(test, STAT_RETRANSMITS_ACK), 1);
+
+	KUNIT_EXPECT_EQ(test, mock_exchange(test, DESCRIPTOR_GET_PROTOCOL_VERSION, twice, ARRAY_SIZE(twice)), -1);
+	KUNIT_EXPECT_EQ(test, mock->transfers, 3);
+	KUNIT_EXPECT_EQ(test, mock_stat(test, STAT_RETRANSMITS_ACK), 2);
+	KUNIT_EXPECT_EQ(test, mock_stat(test, STAT_TRANSACTIONS_FAILED), 1);
+}
+
+static void wait_ready(struct kunit *test)
+{
+	struct mock_slot *mock = test->priv;
+	struct Slot *slot = &mock->slot;
+	static const struct mock_step steps[] = {
+		{.frame = DUMMY_DUMMY },
+		{.frame = WAIT_RESPONSE,.ready_us = WAIT_RESPONSE_US / 2 },
+		{.frame = PROTOCOL_VERSION_RESPONSE },
+	};
+
+	KUNIT_ASSERT_EQ(test, mock_exchange(test, DESCRIPTOR_GET_PROTOCOL_VERSION, steps, ARRAY_SIZE(steps)), 0);
+	KUNIT_ASSERT_EQ(test, mock->transfers, 3);
+	KUNIT_EXPECT_EQ(test, memcmp(mock->tx[2], DUMMY_DUMMY, sizeof(DUMMY_DUMMY)), 0);
+	KUNIT_EXPECT_EQ(test, memcmp(slot->rx_buffer, PROTOCOL_VERSION_RESPONSE, sizeof(PROTOCOL_VERSION_RESPONSE)), 0);
+	KUNIT_EXPECT_EQ(test, mock_stat(test, STAT_WAIT_REQUESTS), 1);
+	KUNIT_EXPECT_GT(test, mock_stat(test, STAT_WAIT_US), 0);
+}
+
+// Without a ready interrupt the exchange fails after the requested time instead of the ready timeout
+static void wait_timeout(struct kunit *test)
+{
+	static const struct mock_step steps[] = {
+		{.frame = DUMMY_DUMMY },
+		{.frame = WAIT_RESPONSE },
+	};
+	ktime_t start = ktime_get();
+	s64 elapsed_us;
+
+	KUNIT_EXPECT_EQ(test, mock_exchange(test, DESCRIPTOR_GET_PROTOCOL_VERSION, steps, ARRAY_SIZE(steps)), -1);
+	elapsed_us = ktime_us_delta(ktime_get(), start);
+	KUNIT_EXPECT_GE(test, elapsed_us, WAIT_RESPONSE_US);
+	KUNIT_EXPECT_LT(test, elapsed_us, READY_TIMEOUT_US);
+	KUNIT_EXPECT_EQ(test, mock_stat(test, STAT_WAIT_REQUESTS), 1);
+	KUNIT_EXPECT_EQ(test, mock_stat(test, STAT_IRQ_TIMEOUTS), 1);
+}
+
+// Used to be rounded down to a zero timeout
+static void wait_sub_ms(struct kunit *test)
+{
+	struct mock_slot *mock = test->priv;
+	static const struct mock_step steps[] = {
+		{.frame = DUMMY_DUMMY },
+		{.frame = WAIT_SUB_MS,.ready_us = 250 },
+		{.frame = PROTOCOL_VERSION_RESPONSE },
+	};
+
+	KUNIT_EXPECT_EQ(test, mock_exchange(test, DESCRIPTOR_GET_PROTOCOL_VERSION, steps, ARRAY_SIZE(steps)), 0);
+	KUNIT_EXPECT_EQ(test, mock->transfers, 3);
+	KUNIT_EXPECT_EQ(test, mock_stat(test, STAT_WAIT_REQUESTS), 1);
+	KUNIT_EXPECT_EQ(test, mock_stat(test, STAT_IRQ_TIMEOUTS), 0);
+}
+
+static void wait_length(struct kunit *test)
+{
+	struct mock_slot *mock = test->priv;
+	static const struct mock_step steps[] = {
+		{.frame = DUMMY_DUMMY },
+		{.frame = WAIT_SHORT },
+	};
+
+	KUNIT_EXPECT_EQ(test, mock_exchange(test, DESCRIPTOR_GET_PROTOCOL_VERSION, steps, ARRAY_SIZE(steps)), 0);
+	KUNIT_EXPECT_EQ(test, mock->transfers, 2);
+	KUNIT_EXPECT_EQ(test, mock_stat(test, STAT_WAIT_REQUESTS), 0);
+}
+
+// Time per frame of encoding a request (prepare_frame()), validating a response (check_crc()) and rebuilding the dummy frame
+// (prepare_dummy()) for every frame size
+static void codec_benchmark(struct kunit *test)
+{
+	struct mock_slot *mock = test->priv;
+	struct Slot *slot = &mock->slot;
+	u64 encode_ns, decode_ns, dummy_ns;
+	u64 start;
+	int ret = 0;
+	int i, j;
+
+	for (i = 0; i < ARRAY_SIZE(codec_vectors); i++) {
+		slot->frame_size = codec_vectors[i].frame_size;
+		memcpy(slot->tx_buffer, DESCRIPTOR_GET_PROTOCOL_VERSION, sizeof(DESCRIPTOR_GET_PROTOCOL_VERSION));
+		build_frame(slot->rx_buffer, slot->frame_size, PROTOCOL_VERSION_RESPONSE);
+
+		start = ktime_get_ns();
+		for (j = 0; j < BENCH_ROUNDS; j++)
+			ret |= prepare_frame(slot, slot->tx_buffer);
+		encode_ns = ktime_get_ns() - start;
+
+		start = ktime_get_ns();
+		for (j = 0; j < BENCH_ROUNDS; j++)
+			ret |= check_crc(slot, slot->rx_buffer, LOG_LVL_SILENT);
+		decode_ns = ktime_get_ns() - start;
+
+		start = ktime_get_ns();
+		for (j = 0; j < BENCH_ROUNDS; j++) {
+			slot->dummy_frame_size = 0;
+			prepare_dummy(slot);
+		}
+		dummy_ns = ktime_get_ns() - start;
+
+		kunit_info(test, "frame_size=%u encode_ns=%llu decode_ns=%llu dummy_ns=%llu\n", slot->frame_size,
+			   div_u64(encode_ns, BENCH_ROUNDS), div_u64(decode_ns, BENCH_ROUNDS), div_u64(dummy_ns, BENCH_ROUNDS));
+	}
+	KUNIT_EXPECT_EQ(test, ret, 0);
+}
+
+static struct kunit_case sdbp_codec_cases[] = {
+	KUNIT_CASE_PARAM(prepare_frame_vectors, codec_gen_params),
+	KUNIT_CASE_PARAM(prepare_dummy_vectors, codec_gen_params),
+	KUNIT_CASE_PARAM(check_crc_vectors, codec_gen_params),
+	{ }
+};
+
+static struct kunit_case sdbp_exchange_cases[] = {
+	KUNIT_CASE_PARAM(exchange_frames, codec_gen_params),
+	KUNIT_CASE(control_frame_size),
+	KUNIT_CASE(control_sclk),
+	KUNIT_CASE(retransmit_crc),
+	KUNIT_CASE(retransmit_ack),
+	KUNIT_CASE(wait_ready),
+	KUNIT_CASE(wait_timeout),
+	KUNIT_CASE(wait_sub_ms),
+	KUNIT_CASE(wait_length),
+	{ }
+};
+
+static struct kunit_case sdbp_codec_benchmark_cases[] = {
+	KUNIT_CASE(codec_benchmark),
+	{ }
+};
+
+static struct kunit_suite sdbp_codec_suite = {
+	.name = "sdbp_codec",
+	.init = mock_init,
+	.exit = mock_exit,
+	.test_cases = sdbp_codec_cases,
+};
+
+static struct kunit_suite sdbp_exchange_suite = {
+	.name = "sdbp_exchange",
+	.init = mock_init,
+	.exit = mock_exit,
+	.test_cases = sdbp_exchange_cases,
+};
+
+static struct kunit_suite sdbp_codec_benchmark_suite = {
+	.name = "sdbp_codec_benchmark",
+	.init = mock_init,
+	.exit = mock_exit,
+	.test_cases = sdbp_codec_benchmark_cases,
+};
+
+kunit_test_suites(&sdbp_codec_suite, &sdbp_exchange_suite, &sdbp_codec_benchmark_suite);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("KUnit tests of the sdbpk frame codec and exchange");
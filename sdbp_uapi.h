@@ -0,0 +1,82 @@
+#ifndef SDBP_UAPI_H_
+#define SDBP_UAPI_H_
+
+/*
+ * User space interface definitions of the sdbpk driver, shared with user space (libsdbp).
+ */
+
+#include <linux/types.h>
+
+#define SDBP_DESCRIPTOR_BIN_VERSION 1
+
+struct sdbp_version_bin {
+	__u8 stability;		// fw_version only, 0 otherwise
+	__u16 major;
+	__u16 minor;
+	__u16 patch;
+} __attribute__((packed));
+
+/*
+ * Content of /sys/class/sdbp/slotX/descriptor_bin, one consistent descriptor generation per read.
+ * Packed, host byte order. Fields are only appended, version and size identify the layout.
+ * String lengths include the terminating null byte.
+ */
+struct sdbp_descriptor_bin {
+	__u16 version;		// SDBP_DESCRIPTOR_BIN_VERSION
+	__u16 size;		// sizeof(struct sdbp_descriptor_bin)
+	__u32 rid;
+	struct sdbp_version_bin protocol_version;
+	struct sdbp_version_bin fw_version;
+	struct sdbp_version_bin hw_version;
+	__u32 max_sclk_speed;
+	__u32 max_frame_size;
+	__u32 max_power_3v3;
+	__u32 max_power_5v0;
+	__u32 max_power_12v;
+	__u8 bootloader_state;
+	__u8 serial_code[16];
+	__u8 vendor_product_id_len;
+	__u8 vendor_name_len;
+	__u8 product_name_len;
+	__u8 vendor_product_id[256];
+	__u8 vendor_name[256];
+	__u8 product_name[256];
+} __attribute__((packed));
+
+/*
+ * One read of /sys/class/sdbp/slotX/notification_bin: header and payload of the oldest queued notification.
+ * Times are CLOCK_MONOTONIC (clock_gettime()) in ns.
+ */
+struct sdbp_notification_bin {
+	__u64 irq_ns;		// Interrupt which announced the notification (request or pending flag of a response)
+	__u64 fetch_ns;		// Notification received by the driver
+	__u32 sequence;		// Per received notification, gaps are dropped notifications
+	__u16 length;		// Payload bytes following
+	__u16 reserved;
+	__u8 payload[];
+};
+
+/*
+ * Fan-out transaction, written to /dev/sdbp: one request payload (class identifier first, as written to /dev/slotX)
+ * for every slot selected in slot_mask. Slots on different SPI buses run in parallel, slots of one bus back to back.
+ */
+struct sdbp_fanout_request {
+	__u64 slot_mask;	// Bit n selects slot n
+	__u16 length;		// Payload bytes following
+	__u8 payload[];
+} __attribute__((packed));
+
+/*
+ * The read after a fan-out write returns one result per selected slot in slot order.
+ * Each result is followed by length response bytes (as read from /dev/slotX), padded to a multiple of 8 bytes.
+ */
+struct sdbp_fanout_result {
+	__u32 slot;		// Requested slot number, also for slots which failed
+	__s32 error;		// 0 or negative errno of this slot
+	__u64 start_ns;		// Start of the exchange, relative to the earliest slot
+	__u64 duration_ns;
+	__u16 length;
+	__u8 reserved[6];
+};
+
+#endif
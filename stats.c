@@ -0,0 +1,147 @@
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/errno.h>
+#include "sdbp.h"
+#include "stats.h"
+
+static const char *const stat_names[STAT_CNT] = {
+	[STAT_TRANSACTIONS] = "transactions",
+	[STAT_TRANSACTIONS_FAILED] = "transactions_failed",
+	[STAT_TX_PAYLOAD_BYTES] = "tx_payload_bytes",
+	[STAT_RX_PAYLOAD_BYTES] = "rx_payload_bytes",
+	[STAT_TX_WIRE_BYTES] = "tx_wire_bytes",
+	[STAT_RX_WIRE_BYTES] = "rx_wire_bytes",
+	[STAT_RETRANSMITS_CRC] = "retransmits_crc",
+	[STAT_RETRANSMITS_ACK] = "retransmits_ack",
+	[STAT_CRC_ERRORS] = "crc_errors",
+	[STAT_WAIT_REQUESTS] = "wait_requests",
+	[STAT_WAIT_US] = "wait_us",
+	[STAT_IRQ_TIMEOUTS] = "irq_timeouts",
+	[STAT_ERROR_FRAME_CRC] = "error_frame_crc",
+	[STAT_ERROR_MESSAGE_TYPE_INVALID] = "error_message_type_invalid",
+	[STAT_ERROR_CLASS_IDENTIFIER_INVALID] = "error_class_identifier_invalid",
+	[STAT_ERROR_CLASS_INVALID] = "error_class_invalid",
+	[STAT_ERROR_DATA_LENGTH_INVALID] = "error_data_length_invalid",
+	[STAT_ERROR_DEVICE_WRONG_MODE] = "error_device_wrong_mode",
+	[STAT_ERROR_UNKNOWN] = "error_unknown",
+	[STAT_NOTIFICATIONS] = "notifications",
+	[STAT_NOTIFICATIONS_FAILED] = "notifications_failed",
+	[STAT_NOTIFICATIONS_DROPPED] = "notifications_dropped",
+	[STAT_DESCRIPTOR_FAILED] = "descriptor_failed",
+	[STAT_CACHE_HITS] = "cache_hits",
+	[STAT_CACHE_MISSES] = "cache_misses",
+	[STAT_WORKER_KICKS] = "worker_kicks",
+	[STAT_SCHED_LATENCY_US] = "sched_latency_us",
+	[STAT_FAULTS_INJECTED] = "faults_injected",
+	[STAT_SUSPENDS] = "suspends",
+	[STAT_RESUMES] = "resumes",
+	[STAT_RESUME_US] = "resume_us",
+	[STAT_NOTIFICATION_RESUMES] = "notification_resumes",
+};
+
+int stats_init(struct sdbp_stats *stats)
+{
+	int cpu;
+
+	stats->cpu = alloc_percpu(struct sdbp_stats_cpu);
+	if (!stats->cpu)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu)
+	    u64_stats_init(&per_cpu_ptr(stats->cpu, cpu)->syncp);
+	spin_lock_init(&stats->lock);
+	memset(stats->reset_base, 0, sizeof(stats->reset_base));
+	memset(stats->session_base, 0, sizeof(stats->session_base));
+	return 0;
+}
+EXPORT_FOR_KUNIT(stats_init);
+
+void stats_free(struct sdbp_stats *stats)
+{
+	free_percpu(stats->cpu);
+	stats->cpu = NULL;
+}
+EXPORT_FOR_KUNIT(stats_free);
+
+void stats_add(struct sdbp_stats *stats, enum sdbp_stat id, u64 value)
+{
+	struct sdbp_stats_cpu *cpu_stats = get_cpu_ptr(stats->cpu);
+
+	u64_stats_update_begin(&cpu_stats->syncp);
+	u64_stats_add(&cpu_stats->counter[id], value);
+	u64_stats_update_end(&cpu_stats->syncp);
+	put_cpu_ptr(stats->cpu);
+}
+
+// Sums up all CPUs, each CPU is read consistently.
+static void stats_sum(struct sdbp_stats *stats, u64 *total)
+{
+	struct sdbp_stats_cpu *cpu_stats;
+	u64 values[STAT_CNT];
+	unsigned int start;
+	int cpu, i;
+
+	memset(total, 0, sizeof(u64) * STAT_CNT);
+	for_each_possible_cpu(cpu) {
+		cpu_stats = per_cpu_ptr(stats->cpu, cpu);
+		do {
+			start = u64_stats_fetch_begin(&cpu_stats->syncp);
+			for (i = 0; i < STAT_CNT; i++)
+				values[i] = u64_stats_read(&cpu_stats->counter[i]);
+		} while (u64_stats_fetch_retry(&cpu_stats->syncp, start));
+
+		for (i = 0; i < STAT_CNT; i++)
+			total[i] += values[i];
+	}
+}
+
+void stats_get(struct sdbp_stats *stats, u64 *lifetime, u64 *session)
+{
+	u64 total[STAT_CNT];
+	int i;
+
+	spin_lock(&stats->lock);
+	stats_sum(stats, total);
+	for (i = 0; i < STAT_CNT; i++) {
+		if (lifetime)
+			lifetime[i] = total[i] - stats->reset_base[i];
+		if (session)
+			session[i] = total[i] - stats->session_base[i];
+	}
+	spin_unlock(&stats->lock);
+}
+
+u64 stats_get_session(struct sdbp_stats *stats, enum sdbp_stat id)
+{
+	u64 session[STAT_CNT];
+
+	stats_get(stats, NULL, session);
+	return session[id];
+}
+EXPORT_FOR_KUNIT(stats_get_session);
+
+void stats_reset(struct sdbp_stats *stats)
+{
+	u64 total[STAT_CNT];
+
+	spin_lock(&stats->lock);
+	stats_sum(stats, total);
+	memcpy(stats->reset_base, total, sizeof(total));
+	memcpy(stats->session_base, total, sizeof(total));
+	spin_unlock(&stats->lock);
+}
+
+void stats_new_session(struct sdbp_stats *stats)
+{
+	u64 total[STAT_CNT];
+
+	spin_lock(&stats->lock);
+	stats_sum(stats, total);
+	memcpy(stats->session_base, total, sizeof(total));
+	spin_unlock(&stats->lock);
+}
+
+const char *stats_name(enum sdbp_stat id)
+{
+	return stat_names[id];
+}
@@ -0,0 +1,75 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <linux/types.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+#include <linux/u64_stats_sync.h>
+
+enum sdbp_stat {
+	STAT_TRANSACTIONS,
+	STAT_TRANSACTIONS_FAILED,
+	STAT_TX_PAYLOAD_BYTES,
+	STAT_RX_PAYLOAD_BYTES,
+	STAT_TX_WIRE_BYTES,
+	STAT_RX_WIRE_BYTES,
+	STAT_RETRANSMITS_CRC,
+	STAT_RETRANSMITS_ACK,
+	STAT_CRC_ERRORS,
+	STAT_WAIT_REQUESTS,
+	STAT_WAIT_US,
+	STAT_IRQ_TIMEOUTS,
+	STAT_ERROR_FRAME_CRC,
+	STAT_ERROR_MESSAGE_TYPE_INVALID,
+	STAT_ERROR_CLASS_IDENTIFIER_INVALID,
+	STAT_ERROR_CLASS_INVALID,
+	STAT_ERROR_DATA_LENGTH_INVALID,
+	STAT_ERROR_DEVICE_WRONG_MODE,
+	STAT_ERROR_UNKNOWN,
+	STAT_NOTIFICATIONS,
+	STAT_NOTIFICATIONS_FAILED,
+	STAT_NOTIFICATIONS_DROPPED,
+	STAT_DESCRIPTOR_FAILED,
+	STAT_CACHE_HITS,
+	STAT_CACHE_MISSES,
+	STAT_WORKER_KICKS,
+	STAT_SCHED_LATENCY_US,
+	STAT_FAULTS_INJECTED,
+	STAT_SUSPENDS,
+	STAT_RESUMES,
+	STAT_RESUME_US,
+	STAT_NOTIFICATION_RESUMES,
+	STAT_CNT,
+};
+
+struct sdbp_stats_cpu {
+	u64_stats_t counter[STAT_CNT];
+	struct u64_stats_sync syncp;
+};
+
+/*
+ * Counters only grow, the lifetime and session views are differences to a base snapshot.
+ * Resetting a view therefore never races with the lock-free updaters.
+ */
+struct sdbp_stats {
+	struct sdbp_stats_cpu __percpu *cpu;
+	spinlock_t lock;	// Protects the bases
+	u64 reset_base[STAT_CNT];
+	u64 session_base[STAT_CNT];
+};
+
+int stats_init(struct sdbp_stats *stats);
+void stats_free(struct sdbp_stats *stats);
+void stats_add(struct sdbp_stats *stats, enum sdbp_stat id, u64 value);
+void stats_get(struct sdbp_stats *stats, u64 *lifetime, u64 *session);
+u64 stats_get_session(struct sdbp_stats *stats, enum sdbp_stat id);
+void stats_reset(struct sdbp_stats *stats);
+void stats_new_session(struct sdbp_stats *stats);
+const char *stats_name(enum sdbp_stat id);
+
+static inline void stats_inc(struct sdbp_stats *stats, enum sdbp_stat id)
+{
+	stats_add(stats, id, 1);
+}
+
+#endif
@@ -0,0 +1,547 @@
+/*
+ * Throughput/latency benchmark for /dev/slotX.
+ *
+ * Sweeps payload size, frame size, SCLK speed and the number of concurrent slots (on a shared or on separate SPI buses).
+ * Every run reports throughput, latency percentiles and CPU usage as text, CSV or JSON.
+ *
+ * gcc -O2 -pthread -o sdbp-bench sdbp-bench.c
+ * ./sdbp-bench -s 0,1,2 -c 1,2 -f 64,256 -k 1000,10000 -p 3,32 -o json > result.json
+ */
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/utsname.h>
+
+#define MAX_LIST 16
+#define MAX_SLOTS 64
+#define MAX_FRAME_SIZE 4096
+#define FRAME_OVERHEAD 6	// Header (4) + CRC16 (2)
+
+enum output_format {
+	OUTPUT_TEXT,
+	OUTPUT_CSV,
+	OUTPUT_JSON,
+};
+
+enum bus_mode {
+	BUS_ANY,
+	BUS_SHARED,
+	BUS_SEPARATE,
+};
+
+struct list {
+	unsigned int value[MAX_LIST];
+	int cnt;
+};
+
+struct config {
+	struct list slots;
+	struct list concurrency;
+	struct list payload;
+	struct list frame_size;
+	struct list sclk_khz;
+	enum bus_mode bus_mode;
+	enum output_format format;
+	unsigned char request[MAX_FRAME_SIZE];
+	size_t request_len;
+	double duration;
+	double warmup;
+};
+
+struct worker {
+	pthread_t thread;
+	int slot;
+	int fd;
+	size_t payload;
+	const struct config *config;
+	uint32_t *samples;	// Latency in us
+	size_t sample_cnt;
+	size_t sample_size;
+	uint64_t transactions;
+	uint64_t errors;
+};
+
+struct result {
+	int concurrency;
+	int buses;
+	char slots[128];
+	size_t payload;
+	unsigned int frame_size;
+	unsigned int sclk_khz;
+	uint64_t transactions;
+	uint64_t errors;
+	double seconds;
+	double tps;
+	double payload_bps;
+	uint32_t p50, p99, p999, max;
+	double mean;
+	double cpu_process;	// Percent of one CPU used by the benchmark incl. its syscalls
+	double cpu_system;	// Percent of all CPUs busy during the run
+};
+
+static volatile int running;
+static volatile int measuring;
+static int slot_bus[MAX_SLOTS];
+static int first_output = 1;
+static char driver_version[32] = "unknown";
+static struct utsname uts;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int parse_list(const char *arg, struct list *list)
+{
+	char *copy = strdup(arg);
+	char *token, *save;
+
+	list->cnt = 0;
+	for (token = strtok_r(copy, ",", &save); token && list->cnt < MAX_LIST; token = strtok_r(NULL, ",", &save))
+		list->value[list->cnt++] = strtoul(token, NULL, 0);
+	free(copy);
+	return list->cnt > 0 ? 0 : -1;
+}
+
+static int parse_hex(const char *arg, unsigned char *data, size_t size)
+{
+	size_t len = 0;
+	unsigned int byte;
+
+	while (arg[0] && arg[1] && len < size) {
+		if (sscanf(arg, "%2x", &byte) != 1)
+			return -1;
+		data[len++] = byte;
+		arg += 2;
+	}
+	return len;
+}
+
+static int read_sysfs_int(int slot, const char *name)
+{
+	char path[96];
+	char buf[32] = { 0 };
+	int fd, ret = -1;
+
+	snprintf(path, sizeof(path), "/sys/class/sdbp/slot%d/%s", slot, name);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (read(fd, buf, sizeof(buf) - 1) > 0)
+		ret = atoi(buf);
+	close(fd);
+	return ret;
+}
+
+// Returns the busy and total jiffies of all CPUs.
+static void read_cpu_times(uint64_t *busy, uint64_t *total)
+{
+	unsigned long long v[8] = { 0 };
+	FILE *f = fopen("/proc/stat", "r");
+
+	*busy = *total = 0;
+	if (!f)
+		return;
+	if (fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu", &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]) == 8) {
+		*total = v[0] + v[1] + v[2] + v[3] + v[4] + v[5] + v[6] + v[7];
+		*busy = *total - v[3] - v[4];	// Without idle and iowait
+	}
+	fclose(f);
+}
+
+static double process_cpu_seconds(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static int control(int fd, const unsigned char *request, size_t len)
+{
+	unsigned char response[MAX_FRAME_SIZE];
+
+	if (write(fd, request, len) != (ssize_t) len)
+		return -errno;
+	if (read(fd, response, sizeof(response)) < 0)
+		return -errno;
+	return 0;
+}
+
+// SDBP control class: SET_FRAME_SIZE (0x07) and SET_SCLK_SPEED (0x08, kHz)
+static int configure_slot(int fd, unsigned int frame_size, unsigned int sclk_khz)
+{
+	unsigned char frame[] = { 0x01, 0x03, 0x07, frame_size >> 8, frame_size & 0xff };
+	unsigned char sclk[] = { 0x01, 0x03, 0x08, sclk_khz >> 24, sclk_khz >> 16, sclk_khz >> 8, sclk_khz & 0xff };
+	int ret;
+
+	ret = control(fd, frame, sizeof(frame));
+	if (ret == 0 && sclk_khz)
+		ret = control(fd, sclk, sizeof(sclk));
+	return ret;
+}
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+	unsigned char request[MAX_FRAME_SIZE] = { 0 };
+	unsigned char response[MAX_FRAME_SIZE];
+	size_t len = w->payload;
+	double start;
+
+	// The request is padded with zeros up to the payload size, this needs a device command accepting variable lengths.
+	if (len < w->config->request_len)
+		len = w->config->request_len;
+	memcpy(request, w->config->request, w->config->request_len);
+
+	while (running) {
+		start = now();
+		if (write(w->fd, request, len) != (ssize_t) len || read(w->fd, response, sizeof(response)) < 0) {
+			if (measuring)
+				w->errors++;
+			continue;
+		}
+		if (!measuring)
+			continue;
+		w->transactions++;
+		if (w->sample_cnt == w->sample_size) {
+			w->sample_size = w->sample_size ? 2 * w->sample_size : 65536;
+			w->samples = realloc(w->samples, w->sample_size * sizeof(uint32_t));
+			if (!w->samples) {
+				fprintf(stderr, "Out of memory\n");
+				exit(1);
+			}
+		}
+		w->samples[w->sample_cnt++] = (now() - start) * 1e6;
+	}
+	return NULL;
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+// Picks "cnt" slots according to the bus mode, returns the number of slots selected.
+static int select_slots(const struct config *config, int cnt, int *selected)
+{
+	int i, j, n = 0, best_bus = -1, best_cnt = 0, bus_cnt;
+	int used_bus[MAX_SLOTS];
+
+	if (config->bus_mode == BUS_SHARED) {
+		// The bus with most slots
+		for (i = 0; i < config->slots.cnt; i++) {
+			bus_cnt = 0;
+			for (j = 0; j < config->slots.cnt; j++)
+				bus_cnt += slot_bus[config->slots.value[j]] == slot_bus[config->slots.value[i]];
+			if (bus_cnt > best_cnt) {
+				best_cnt = bus_cnt;
+				best_bus = slot_bus[config->slots.value[i]];
+			}
+		}
+	}
+
+	for (i = 0; i < config->slots.cnt && n < cnt; i++) {
+		int slot = config->slots.value[i];
+
+		if (config->bus_mode == BUS_SHARED && slot_bus[slot] != best_bus)
+			continue;
+		if (config->bus_mode == BUS_SEPARATE) {
+			for (j = 0; j < n; j++)
+				if (used_bus[j] == slot_bus[slot])
+					break;
+			if (j < n)
+				continue;
+		}
+		used_bus[n] = slot_bus[slot];
+		selected[n++] = slot;
+	}
+	return n;
+}
+
+static int count_buses(const int *slots, int cnt)
+{
+	int i, j, buses = 0;
+
+	for (i = 0; i < cnt; i++) {
+		for (j = 0; j < i; j++)
+			if (slot_bus[slots[j]] == slot_bus[slots[i]])
+				break;
+		buses += j == i;
+	}
+	return buses;
+}
+
+static int run(const struct config *config, const int *slots, int cnt, size_t payload, unsigned int frame_size, unsigned int sclk_khz,
+	       struct result *result)
+{
+	struct worker workers[MAX_SLOTS];
+	uint64_t busy_start, total_start, busy_end, total_end;
+	double start, cpu_start, elapsed;
+	uint32_t *all;
+	size_t total = 0, pos = 0;
+	uint64_t sum = 0;
+	char dev[32];
+	int i, ret = 0;
+
+	memset(workers, 0, sizeof(workers));
+	memset(result, 0, sizeof(*result));
+	for (i = 0; i < cnt; i++) {
+		snprintf(dev, sizeof(dev), "/dev/slot%d", slots[i]);
+		workers[i].fd = open(dev, O_RDWR);
+		if (workers[i].fd < 0) {
+			fprintf(stderr, "%s: %s\n", dev, strerror(errno));
+			ret = -1;
+			goto close;
+		}
+		workers[i].slot = slots[i];
+		workers[i].payload = payload;
+		workers[i].config = config;
+		if (configure_slot(workers[i].fd, frame_size, sclk_khz) != 0) {
+			fprintf(stderr, "slot%d: frame size %u / SCLK %u kHz not accepted\n", slots[i], frame_size, sclk_khz);
+			ret = -1;
+			goto close;
+		}
+		snprintf(result->slots + strlen(result->slots), sizeof(result->slots) - strlen(result->slots), "%s%d", i ? " " : "", slots[i]);
+	}
+
+	running = 1;
+	measuring = 0;
+	for (i = 0; i < cnt; i++)
+		pthread_create(&workers[i].thread, NULL, worker_fn, &workers[i]);
+
+	usleep(config->warmup * 1e6);
+	read_cpu_times(&busy_start, &total_start);
+	cpu_start = process_cpu_seconds();
+	start = now();
+	measuring = 1;
+	usleep(config->duration * 1e6);
+	measuring = 0;
+	elapsed = now() - start;
+	result->cpu_process = 100.0 * (process_cpu_seconds() - cpu_start) / elapsed;
+	read_cpu_times(&busy_end, &total_end);
+	if (total_end > total_start)
+		result->cpu_system = 100.0 * (busy_end - busy_start) / (total_end - total_start);
+	running = 0;
+
+	for (i = 0; i < cnt; i++) {
+		pthread_join(workers[i].thread, NULL);
+		result->transactions += workers[i].transactions;
+		result->errors += workers[i].errors;
+		total += workers[i].sample_cnt;
+	}
+
+	all = malloc((total ? total : 1) * sizeof(uint32_t));
+	for (i = 0; i < cnt && all; i++) {
+		memcpy(all + pos, workers[i].samples, workers[i].sample_cnt * sizeof(uint32_t));
+		pos += workers[i].sample_cnt;
+	}
+	if (all && total) {
+		qsort(all, total, sizeof(uint32_t), compare_u32);
+		for (pos = 0; pos < total; pos++)
+			sum += all[pos];
+		result->p50 = all[total / 2];
+		result->p99 = all[total * 99 / 100];
+		result->p999 = all[total * 999 / 1000];
+		result->max = all[total - 1];
+		result->mean = (double)sum / total;
+	}
+	free(all);
+
+	result->concurrency = cnt;
+	result->buses = count_buses(slots, cnt);
+	result->payload = payload > config->request_len ? payload : config->request_len;
+	result->frame_size = frame_size;
+	result->sclk_khz = sclk_khz;
+	result->seconds = elapsed;
+	result->tps = result->transactions / elapsed;
+	result->payload_bps = result->tps * result->payload;
+
+ close:
+	for (i = 0; i < cnt; i++) {
+		if (workers[i].fd > 0)
+			close(workers[i].fd);
+		free(workers[i].samples);
+	}
+	return ret;
+}
+
+static void print_header(const struct config *config)
+{
+	int fd;
+
+	fd = open("/sys/module/sdbpk/version", O_RDONLY);
+	if (fd >= 0) {
+		ssize_t len = read(fd, driver_version, sizeof(driver_version) - 1);
+		driver_version[len > 0 ? len : 0] = '\0';
+		driver_version[strcspn(driver_version, "\n")] = '\0';
+		close(fd);
+	}
+	uname(&uts);
+
+	switch (config->format) {
+	case OUTPUT_JSON:
+		printf("{\n  \"driver_version\": \"%s\",\n  \"kernel\": \"%s\",\n  \"machine\": \"%s\",\n  \"duration_s\": %.1f,\n  \"runs\": [", driver_version,
+		       uts.release, uts.machine, config->duration);
+		break;
+	case OUTPUT_CSV:
+		printf("driver_version,kernel,concurrency,buses,slots,payload,frame_size,sclk_khz,transactions,errors,seconds,tps,payload_bps,"
+		       "lat_mean_us,lat_p50_us,lat_p99_us,lat_p999_us,lat_max_us,cpu_process_pct,cpu_system_pct\n");
+		break;
+	default:
+		printf("sdbpk %s, kernel %s\n", driver_version, uts.release);
+		printf("%5s %5s %-12s %7s %6s %8s %10s %12s %8s %8s %8s %8s %6s %6s %6s\n", "conc", "buses", "slots", "payload", "frame", "sclk", "tps",
+		       "payload B/s", "p50 us", "p99 us", "p99.9us", "max us", "errors", "cpu%", "sys%");
+		break;
+	}
+}
+
+static void print_result(const struct config *config, const struct result *r)
+{
+	switch (config->format) {
+	case OUTPUT_JSON:
+		printf("%s\n    {\"concurrency\": %d, \"buses\": %d, \"slots\": \"%s\", \"payload\": %zu, \"frame_size\": %u, \"sclk_khz\": %u, "
+		       "\"transactions\": %llu, \"errors\": %llu, \"seconds\": %.3f, \"tps\": %.1f, \"payload_bps\": %.1f, "
+		       "\"latency_us\": {\"mean\": %.1f, \"p50\": %u, \"p99\": %u, \"p999\": %u, \"max\": %u}, "
+		       "\"cpu_process_pct\": %.1f, \"cpu_system_pct\": %.1f}", first_output ? "" : ",", r->concurrency, r->buses, r->slots, r->payload,
+		       r->frame_size, r->sclk_khz, (unsigned long long)r->transactions, (unsigned long long)r->errors, r->seconds, r->tps, r->payload_bps,
+		       r->mean, r->p50, r->p99, r->p999, r->max, r->cpu_process, r->cpu_system);
+		break;
+	case OUTPUT_CSV:
+		printf("%s,%s,%d,%d,%s,%zu,%u,%u,%llu,%llu,%.3f,%.1f,%.1f,%.1f,%u,%u,%u,%u,%.1f,%.1f\n", driver_version,
+		       uts.release, r->concurrency, r->buses, r->slots, r->payload, r->frame_size, r->sclk_khz,
+		       (unsigned long long)r->transactions, (unsigned long long)r->errors, r->seconds, r->tps, r->payload_bps, r->mean, r->p50, r->p99,
+		       r->p999, r->max, r->cpu_process, r->cpu_system);
+		break;
+	default:
+		printf("%5d %5d %-12s %7zu %6u %8u %10.1f %12.1f %8u %8u %8u %8u %6llu %6.1f %6.1f\n", r->concurrency, r->buses, r->slots, r->payload,
+		       r->frame_size, r->sclk_khz, r->tps, r->payload_bps, r->p50, r->p99, r->p999, r->max, (unsigned long long)r->errors, r->cpu_process,
+		       r->cpu_system);
+		break;
+	}
+	first_output = 0;
+	fflush(stdout);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [options]\n"
+		"  -s LIST   slots to use (default 1)\n"
+		"  -c LIST   numbers of concurrent slots (default 1)\n"
+		"  -b MODE   bus selection for concurrent slots: any, shared, separate (default any)\n"
+		"  -p LIST   payload sizes in bytes, the request is zero padded (default request length)\n"
+		"  -f LIST   frame sizes in bytes (default 64)\n"
+		"  -k LIST   SCLK speeds in kHz (default: not changed)\n"
+		"  -r HEX    request payload starting with the class identifier (default 010202)\n"
+		"  -t SEC    measuring time per run (default 10)\n"
+		"  -w SEC    warm-up time per run (default 1)\n" "  -o FMT    output format: text, csv, json (default text)\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	struct config config = {
+		.slots = {{1}, 1},
+		.concurrency = {{1}, 1},
+		.payload = {{0}, 1},
+		.frame_size = {{64}, 1},
+		.sclk_khz = {{0}, 1},
+		.request = {0x01, 0x02, 0x02},
+		.request_len = 3,
+		.duration = 10,
+		.warmup = 1,
+	};
+	struct result result;
+	int selected[MAX_SLOTS];
+	int c, i, n, p, f, k, opt, ret = 0;
+
+	while ((opt = getopt(argc, argv, "s:c:b:p:f:k:r:t:w:o:h")) != -1) {
+		switch (opt) {
+		case 's':
+			ret |= parse_list(optarg, &config.slots);
+			break;
+		case 'c':
+			ret |= parse_list(optarg, &config.concurrency);
+			break;
+		case 'b':
+			config.bus_mode = !strcmp(optarg, "shared") ? BUS_SHARED : !strcmp(optarg, "separate") ? BUS_SEPARATE : BUS_ANY;
+			break;
+		case 'p':
+			ret |= parse_list(optarg, &config.payload);
+			break;
+		case 'f':
+			ret |= parse_list(optarg, &config.frame_size);
+			break;
+		case 'k':
+			ret |= parse_list(optarg, &config.sclk_khz);
+			break;
+		case 'r':
+			n = parse_hex(optarg, config.request, sizeof(config.request));
+			if (n <= 0)
+				ret = -1;
+			config.request_len = n;
+			break;
+		case 't':
+			config.duration = atof(optarg);
+			break;
+		case 'w':
+			config.warmup = atof(optarg);
+			break;
+		case 'o':
+			config.format = !strcmp(optarg, "json") ? OUTPUT_JSON : !strcmp(optarg, "csv") ? OUTPUT_CSV : OUTPUT_TEXT;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (ret != 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	for (i = 0; i < config.slots.cnt; i++) {
+		if (config.slots.value[i] >= MAX_SLOTS) {
+			fprintf(stderr, "Slot %u out of range\n", config.slots.value[i]);
+			return 1;
+		}
+		slot_bus[config.slots.value[i]] = read_sysfs_int(config.slots.value[i], "spi_bus");
+	}
+
+	print_header(&config);
+	for (c = 0; c < config.concurrency.cnt; c++) {
+		n = select_slots(&config, config.concurrency.value[c], selected);
+		if (n < (int)config.concurrency.value[c]) {
+			fprintf(stderr, "Only %d slot(s) match %u concurrent slots with this bus mode, skipped\n", n, config.concurrency.value[c]);
+			continue;
+		}
+		for (f = 0; f < config.frame_size.cnt; f++) {
+			for (k = 0; k < config.sclk_khz.cnt; k++) {
+				for (p = 0; p < config.payload.cnt; p++) {
+					if (config.payload.value[p] + FRAME_OVERHEAD > config.frame_size.value[f])
+						continue;	// Does not fit into the frame
+					if (run(&config, selected, n, config.payload.value[p], config.frame_size.value[f], config.sclk_khz.value[k], &result) == 0)
+						print_result(&config, &result);
+					else
+						ret = 2;
+				}
+			}
+		}
+	}
+	if (config.format == OUTPUT_JSON)
+		printf("\n  ]\n}\n");
+	return ret;
+}